@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+//Runs a raycast command and records how long it took:
+//harness [--repeat R] [--label L] [--csv results.csv] [--json results.jsonl] -- ./raycast --stats ...
+//The command must be run with --stats, its output is parsed for the per phase timings and the ray count.
+//The fastest of R runs is reported, together with the largest peak RSS seen.
+
+typedef struct {	//What one run of the renderer reported
+	double wall_ms;
+	double load_ms;	//read_scene
+	double build_ms;	//BVH build
+	double render_ms;	//raycast_scene, 0 if the renderer did not report its phases
+	double image_ms;	//create_image
+	long long rays;
+	long peak_rss_kb;
+} Result;
+
+double now_ms(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1e3 + now.tv_nsec*1e-6;
+}
+
+int run_once(char** command, Result* result){	//Runs the command once, returns 0 if it failed
+	int pipe_fds[2];
+	struct rusage usage;
+	char line[512];
+	FILE* output;
+	pid_t pid;
+	int status;
+	double start;
+	
+	if(pipe(pipe_fds) != 0) return 0;
+	memset(result, 0, sizeof(Result));
+	start = now_ms();
+	pid = fork();
+	if(pid < 0) return 0;
+	if(pid == 0){	//Child: send stdout down the pipe and run the renderer
+		dup2(pipe_fds[1], STDOUT_FILENO);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		execvp(command[0], command);
+		perror("exec");
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	output = fdopen(pipe_fds[0], "r");
+	while(fgets(line, sizeof(line), output) != NULL){
+		const char* in = strstr(line, " in ");
+		if(strncmp(line, "read_scene:", 11) == 0 && in != NULL){
+			sscanf(in, " in %lf ms", &result->load_ms);
+		}else if(strncmp(line, "bvh:", 4) == 0 && strstr(line, "built in") != NULL){
+			sscanf(strstr(line, "built in"), "built in %lf ms", &result->build_ms);
+		}else if(strncmp(line, "instances:", 10) == 0 && strstr(line, "built in") != NULL){	//Group and instance BVHs
+			double instance_ms = 0;
+			sscanf(strstr(line, "built in"), "built in %lf ms", &instance_ms);
+			result->build_ms += instance_ms;
+		}else if(strncmp(line, "bvh:", 4) == 0 && strstr(line, " rays,") != NULL){
+			sscanf(line, "bvh: %lld rays,", &result->rays);
+		}else if(strncmp(line, "phase: raycast_scene ", 21) == 0){
+			sscanf(line, "phase: raycast_scene %lf ms", &result->render_ms);
+		}else if(strncmp(line, "phase: create_image ", 20) == 0){
+			sscanf(line, "phase: create_image %lf ms", &result->image_ms);
+		}
+	}
+	fclose(output);
+	if(wait4(pid, &status, 0, &usage) < 0) return 0;
+	result->wall_ms = now_ms() - start;
+	result->peak_rss_kb = usage.ru_maxrss;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int c, char** argv){
+	const char* label = "run";
+	const char* csv_name = NULL;
+	const char* json_name = NULL;
+	int repeat = 3;
+	Result best;
+	Result result;
+	double render_ms;
+	double mrays;
+	FILE* file;
+	int i = 1;
+	int run;
+	
+	while(i < c && strcmp(argv[i], "--") != 0){
+		if(i + 1 >= c){
+			fprintf(stderr, "Error: Missing value for \"%s\"\n", argv[i]);
+			return 1;
+		}
+		if(strcmp(argv[i], "--repeat") == 0){
+			repeat = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--label") == 0){
+			label = argv[i + 1];
+		}else if(strcmp(argv[i], "--csv") == 0){
+			csv_name = argv[i + 1];
+		}else if(strcmp(argv[i], "--json") == 0){
+			json_name = argv[i + 1];
+		}else{
+			fprintf(stderr, "Error: Unknown option \"%s\"\n", argv[i]);
+			return 1;
+		}
+		i += 2;
+	}
+	if(i + 1 >= c || repeat < 1){
+		fprintf(stderr, "Usage: harness [--repeat R] [--label L] [--csv file] [--json file] -- command...\n");
+		return 1;
+	}
+	
+	for(run = 0; run < repeat; run++){
+		if(!run_once(&argv[i + 1], &result)){
+			fprintf(stderr, "Error: %s failed\n", label);
+			return 1;
+		}
+		if(run == 0 || result.wall_ms < best.wall_ms){
+			long rss = run == 0 ? 0 : best.peak_rss_kb;
+			best = result;
+			if(rss > best.peak_rss_kb) best.peak_rss_kb = rss;
+		}else if(result.peak_rss_kb > best.peak_rss_kb){
+			best.peak_rss_kb = result.peak_rss_kb;
+		}
+	}
+	
+	//Use the renderer's own raycast_scene time, older builds only report loading and the BVH build so everything
+	//else counts as rendering there, including writing the image
+	render_ms = best.render_ms > 0 ? best.render_ms : best.wall_ms - best.load_ms - best.build_ms;
+	mrays = render_ms > 0 ? best.rays/(render_ms*1e3) : 0;
+	printf("%-40s %9.1f ms  load %8.1f  bvh %8.1f  render %9.1f  image %7.1f  %8.2f Mrays/s  %8ld KB\n", label,
+		best.wall_ms, best.load_ms, best.build_ms, render_ms, best.image_ms, mrays, best.peak_rss_kb);
+	
+	if(csv_name != NULL){
+		file = fopen(csv_name, "a");
+		if(file == NULL){
+			fprintf(stderr, "Error: Could not open \"%s\"\n", csv_name);
+			return 1;
+		}
+		if(ftell(file) == 0){
+			fprintf(file, "label,wall_ms,load_ms,bvh_ms,render_ms,rays,mrays_per_s,peak_rss_kb,image_ms\n");
+		}
+		fprintf(file, "%s,%.3f,%.3f,%.3f,%.3f,%lld,%.4f,%ld,%.3f\n", label, best.wall_ms, best.load_ms, best.build_ms,
+			render_ms, best.rays, mrays, best.peak_rss_kb, best.image_ms);
+		fclose(file);
+	}
+	if(json_name != NULL){	//One JSON object per line
+		file = fopen(json_name, "a");
+		if(file == NULL){
+			fprintf(stderr, "Error: Could not open \"%s\"\n", json_name);
+			return 1;
+		}
+		fprintf(file, "{\"label\": \"%s\", \"wall_ms\": %.3f, \"phases_ms\": {\"read_scene\": %.3f, \"bvh_build\": %.3f, "
+			"\"render\": %.3f, \"create_image\": %.3f}, \"rays\": %lld, \"mrays_per_s\": %.4f, \"peak_rss_kb\": %ld}\n", label,
+			best.wall_ms, best.load_ms, best.build_ms, render_ms, best.image_ms, best.rays, mrays, best.peak_rss_kb);
+		fclose(file);
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../raycast.h"
+
+//Renders a scene through raycast.h from several threads at once, all sharing one parsed scene:
+//librender [--renders R] [--threads T] [--precision float] [--accel bins] width height scene.json output.ppm [camera]
+//Every render must give the same pixels, the first is written to output.ppm. A truncated copy of the scene is then
+//parsed to check that the error comes back as RAYCAST_ERROR_INPUT instead of ending the process. Exits 0 when all of
+//that holds, 1 otherwise.
+
+typedef struct {	//One render thread
+	const RaycastScene* scene;
+	const char* camera;
+	int width;
+	int height;
+	const RenderOptions* options;
+	unsigned char* pixels;
+	RaycastError error;
+	int result;
+} Render;
+
+void* render(void* input){
+	Render* job = input;
+	job->result = raycast_render(job->scene, job->camera, job->width, job->height, job->options, job->pixels, &job->error);
+	return NULL;
+}
+
+char* read_file(const char* filename, size_t* size){	//Reads the whole file into memory, NULL if it can not be read
+	FILE* file = fopen(filename, "rb");
+	char* data;
+	long length;
+	if(file == NULL || fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0){
+		return NULL;
+	}
+	rewind(file);
+	data = malloc(length + 1);
+	if(data == NULL || fread(data, 1, length, file) != (size_t)length){
+		return NULL;
+	}
+	fclose(file);
+	*size = length;
+	return data;
+}
+
+int main(int argc, char** argv){
+	RenderOptions options;
+	RaycastScene* scene;
+	RaycastScene* broken;
+	RaycastError error;
+	Render* renders;
+	pthread_t* threads;
+	FILE* output;
+	char* json;
+	size_t size;
+	size_t bytes;
+	int num_renders = 4;
+	int width;
+	int height;
+	int i = 1;
+	int r;
+
+	raycast_default_options(&options);
+	while(i < argc && strncmp(argv[i], "--", 2) == 0){
+		if(i + 1 >= argc){
+			fprintf(stderr, "Error: %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if(strcmp(argv[i], "--renders") == 0){
+			num_renders = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--threads") == 0){
+			options.threads = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--precision") == 0){
+			options.precision = strcmp(argv[i + 1], "float") == 0 ? PRECISION_FLOAT : PRECISION_DOUBLE;
+		}else if(strcmp(argv[i], "--accel") == 0){
+			options.accel = strcmp(argv[i + 1], "bins") == 0 ? ACCEL_BINS : ACCEL_BVH;
+		}else{
+			fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+			return 1;
+		}
+		i += 2;
+	}
+	if(argc - i != 4 && argc - i != 5){
+		fprintf(stderr, "Usage: librender [--renders R] [--threads T] [--precision float] [--accel bins] width height scene.json output.ppm [camera]\n");
+		return 1;
+	}
+	width = atoi(argv[i]);
+	height = atoi(argv[i + 1]);
+	if(num_renders < 1 || width <= 0 || height <= 0){
+		fprintf(stderr, "Error: Renders, width and height must be greater than 0\n");
+		return 1;
+	}
+	json = read_file(argv[i + 2], &size);
+	if(json == NULL){
+		fprintf(stderr, "Error: Could not read \"%s\"\n", argv[i + 2]);
+		return 1;
+	}
+	if(raycast_parse_scene(json, size, &scene, &error) != RAYCAST_OK){
+		fprintf(stderr, "Error: %s\n", error.message);
+		return 1;
+	}
+
+	bytes = 3*(size_t)width*height;
+	renders = malloc(sizeof(Render)*num_renders);
+	threads = malloc(sizeof(pthread_t)*num_renders);
+	for(r = 0; r < num_renders; r++){
+		renders[r].scene = scene;
+		renders[r].camera = argc - i == 5 ? argv[i + 4] : NULL;
+		renders[r].width = width;
+		renders[r].height = height;
+		renders[r].options = &options;
+		renders[r].pixels = malloc(bytes);
+		if(renders[r].pixels == NULL || pthread_create(&threads[r], NULL, render, &renders[r]) != 0){
+			fprintf(stderr, "Error: Could not start render %d\n", r);
+			return 1;
+		}
+	}
+	for(r = 0; r < num_renders; r++){
+		pthread_join(threads[r], NULL);
+	}
+	for(r = 0; r < num_renders; r++){
+		if(renders[r].result != RAYCAST_OK){
+			fprintf(stderr, "Error: %s\n", renders[r].error.message);
+			return 1;
+		}
+		if(memcmp(renders[r].pixels, renders[0].pixels, bytes) != 0){
+			fprintf(stderr, "Error: Render %d differs from render 0\n", r);
+			return 1;
+		}
+	}
+
+	output = fopen(argv[i + 3], "wb");
+	if(output == NULL){
+		fprintf(stderr, "Error: Could not open \"%s\"\n", argv[i + 3]);
+		return 1;
+	}
+	fprintf(output, "P6\n%d %d\n255\n", width, height);
+	fwrite(renders[0].pixels, 1, bytes, output);
+	fclose(output);
+
+	if(raycast_parse_scene(json, size/2, &broken, &error) != RAYCAST_ERROR_INPUT || broken != NULL){
+		fprintf(stderr, "Error: A truncated scene did not fail with RAYCAST_ERROR_INPUT\n");
+		return 1;
+	}
+	printf("%d renders through raycast.h match, a truncated scene fails with \"%s\"\n", num_renders, error.message);
+
+	for(r = 0; r < num_renders; r++){
+		free(renders[r].pixels);
+	}
+	free(renders);
+	free(threads);
+	raycast_free_scene(scene);
+	free(json);
+	return 0;
+}
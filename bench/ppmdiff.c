@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+//Compares two images (P3 or P6 PPM with 8 bits per channel, or QOI) pixel by pixel:
+//ppmdiff [--tolerance T] [--max-differing P] a.ppm b.ppm
+//Prints the number of differing pixels and the largest channel difference. A pixel fails when one of its channels
+//differs by more than T (default 0). Exits 0 when at most P percent of the pixels fail (default 0), 1 when more do,
+//2 when the images can not be compared.
+
+typedef struct {
+	int width;
+	int height;
+	unsigned char* data;
+} Image;
+
+int read_token(FILE* file){	//Reads one header integer, skipping white space and comments
+	int c = fgetc(file);
+	int value = 0;
+	while(c == '#' || isspace(c)){
+		if(c == '#'){
+			while(c != '\n' && c != EOF) c = fgetc(file);
+		}
+		c = fgetc(file);
+	}
+	if(!isdigit(c)) return -1;
+	while(isdigit(c)){
+		value = value*10 + (c - '0');
+		c = fgetc(file);
+	}
+	return value;	//The single white space character after the value has been consumed
+}
+
+int load_qoi(FILE* file, const char* filename, Image* image){	//Decodes a QOI file, the magic has been read
+	unsigned char header[10];
+	unsigned char index[64][4] = {{0}};
+	unsigned char px[4] = {0, 0, 0, 255};
+	size_t pixels;
+	size_t i;
+	int run = 0;
+	int b;
+	int vg;
+	int k;
+	if(fread(header, 1, 10, file) != 10){
+		fprintf(stderr, "Error: \"%s\" is truncated\n", filename);
+		return 0;
+	}
+	image->width = header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+	image->height = header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+	pixels = (size_t)image->width*image->height;
+	image->data = malloc(3*pixels + 1);
+	for(i = 0; i < pixels; i++){
+		if(run > 0){
+			run--;
+		}else{
+			b = fgetc(file);
+			if(b == EOF){
+				fprintf(stderr, "Error: \"%s\" is truncated\n", filename);
+				return 0;
+			}
+			if(b == 0xfe){	//RGB
+				px[0] = fgetc(file);
+				px[1] = fgetc(file);
+				px[2] = fgetc(file);
+			}else if(b == 0xff){	//RGBA
+				for(k = 0; k < 4; k++) px[k] = fgetc(file);
+			}else if((b & 0xc0) == 0x00){	//Index
+				memcpy(px, index[b], 4);
+			}else if((b & 0xc0) == 0x40){	//Small difference
+				px[0] += ((b >> 4) & 3) - 2;
+				px[1] += ((b >> 2) & 3) - 2;
+				px[2] += (b & 3) - 2;
+			}else if((b & 0xc0) == 0x80){	//Luma
+				vg = (b & 0x3f) - 32;
+				b = fgetc(file);
+				px[0] += vg - 8 + ((b >> 4) & 0xf);
+				px[1] += vg;
+				px[2] += vg - 8 + (b & 0xf);
+			}else{	//Run
+				run = b & 0x3f;
+			}
+			memcpy(index[(px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) % 64], px, 4);
+		}
+		memcpy(&image->data[3*i], px, 3);
+	}
+	return 1;
+}
+
+int load_image(const char* filename, Image* image){
+	FILE* file = fopen(filename, "rb");
+	char magic[3] = {0};
+	size_t size;
+	size_t i;
+	int value;
+	if(file == NULL){
+		fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+		return 0;
+	}
+	if(fread(magic, 1, 2, file) == 2 && magic[0] == 'q' && magic[1] == 'o'){
+		value = fgetc(file) == 'i' && fgetc(file) == 'f' && load_qoi(file, filename, image);
+		fclose(file);
+		return value;
+	}
+	if(magic[0] != 'P' || (magic[1] != '3' && magic[1] != '6')){
+		fprintf(stderr, "Error: \"%s\" is not a P3, P6 or QOI file\n", filename);
+		fclose(file);
+		return 0;
+	}
+	image->width = read_token(file);
+	image->height = read_token(file);
+	if(image->width < 0 || image->height < 0 || read_token(file) != 255){
+		fprintf(stderr, "Error: \"%s\" has an unsupported header\n", filename);
+		fclose(file);
+		return 0;
+	}
+	size = (size_t)image->width*image->height*3;
+	image->data = malloc(size + 1);
+	if(magic[1] == '6'){
+		if(fread(image->data, 1, size, file) != size){
+			fprintf(stderr, "Error: \"%s\" is truncated\n", filename);
+			fclose(file);
+			return 0;
+		}
+	}else{
+		for(i = 0; i < size; i++){
+			value = read_token(file);
+			if(value < 0){
+				fprintf(stderr, "Error: \"%s\" is truncated\n", filename);
+				fclose(file);
+				return 0;
+			}
+			image->data[i] = value;
+		}
+	}
+	fclose(file);
+	return 1;
+}
+
+int main(int c, char** argv){
+	Image a;
+	Image b;
+	int tolerance = 0;
+	double max_differing = 0;
+	int max_difference = 0;
+	long long differing = 0;
+	long long failing = 0;
+	size_t pixels;
+	size_t i;
+	int j;
+	int first = 1;
+	
+	while(first + 1 < c && strncmp(argv[first], "--", 2) == 0){
+		if(strcmp(argv[first], "--tolerance") == 0){
+			tolerance = atoi(argv[first + 1]);
+		}else if(strcmp(argv[first], "--max-differing") == 0){
+			max_differing = atof(argv[first + 1]);
+		}else{
+			break;
+		}
+		first += 2;
+	}
+	if(c - first != 2){
+		fprintf(stderr, "Usage: ppmdiff [--tolerance T] [--max-differing P] a.ppm b.ppm\n");
+		return 2;
+	}
+	if(!load_image(argv[first], &a) || !load_image(argv[first + 1], &b)) return 2;
+	if(a.width != b.width || a.height != b.height){
+		printf("size mismatch: %dx%d vs %dx%d\n", a.width, a.height, b.width, b.height);
+		return 1;
+	}
+	
+	pixels = (size_t)a.width*a.height;
+	for(i = 0; i < pixels; i++){
+		int pixel_difference = 0;
+		for(j = 0; j < 3; j++){
+			int difference = abs(a.data[3*i + j] - b.data[3*i + j]);
+			if(difference > pixel_difference) pixel_difference = difference;
+		}
+		if(pixel_difference > 0) differing++;
+		if(pixel_difference > tolerance) failing++;
+		if(pixel_difference > max_difference) max_difference = pixel_difference;
+	}
+	printf("%lld of %zu pixels differ, max channel difference %d\n", differing, pixels, max_difference);
+	return failing > max_differing/100*pixels;
+}
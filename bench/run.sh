@@ -0,0 +1,350 @@
+#!/bin/sh
+# Benchmark and regression run, started by "make bench".
+#
+# 1. Correctness gate: ExampleSet1 must match expected_result.ppm exactly, with every
+#    thread count and kernel set, and a scene of coincident spheres must match --kernel scalar.
+#    A render split into regions by bench/split_render.sh must merge back to the same bytes
+#    as a single process render, as must a --progressive render that is given all the time
+#    it needs. Every frame of a --frames render must match a full render of that frame's scene.
+#    --aa must give the same image with any threads, packets or --accel bins, and --aa-budget 0
+#    the image without --aa.
+#    .qoi output must decode to the .ppm pixels.
+#    A scene of instances must render like the same scene flattened into plain spheres, up
+#    to INSTANCE_MAX_DIFFERING percent of pixels where equally near spheres tie differently.
+#    Each view of a --cameras batch must match the scene rendered from that camera alone.
+#    Renders through raycast.h (bench/librender) from several threads at once must match too,
+#    and so must the jobs of a raycast --serve run and renders with the settings --autotune picks.
+# 2. Precision gate: --precision float is compared with the double path on both example
+#    sets and on generated scenes. The number of differing pixels and the largest channel
+#    difference are printed, and at most FLOAT_MAX_DIFFERING percent of pixels may differ.
+#    --fast-rays is compared the same way, within FAST_MAX_DIFFERING percent.
+# 3. Generates synthetic scenes (sphere count, plane count, uniform or clustered layout)
+#    and times them at several resolutions with bench/harness, in double and in float, and
+#    with --accel bins and --fast-rays. An instanced scene is timed against its flattened copy,
+#    a batch of camera views against one view, and --aa 4 against the plain render. Small
+#    jobs are timed as separate processes and through one raycast --serve. --autotune is timed once measuring and once reading
+#    the settings it stored with --tune-profile.
+#
+# Results go to bench/out/results.csv and bench/out/results.jsonl.
+# BENCH_QUICK=1 runs a smaller matrix, BENCH_REPEAT sets the runs per configuration.
+
+set -e
+cd "$(dirname "$0")/.."
+OUT=bench/out
+RAYCAST=./raycast
+REPEAT=${BENCH_REPEAT:-3}
+FLOAT_MAX_DIFFERING=${FLOAT_MAX_DIFFERING:-0.5}
+INSTANCE_MAX_DIFFERING=${INSTANCE_MAX_DIFFERING:-0.01}
+FAST_MAX_DIFFERING=${FAST_MAX_DIFFERING:-0.05}
+THREADS=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+mkdir -p $OUT
+rm -f $OUT/results.csv $OUT/results.jsonl
+
+echo "== correctness gate"
+for options in "" "--threads 4" "--kernel scalar" "--kernel sse" "--threads 3 --tile-size 7 --kernel scalar" "--packet 4" "--packet 8 --threads 2" "--band-rows 8 --threads 2" "--accel bins" "--accel bins --threads 2 --kernel sse"; do
+	$RAYCAST $options 100 100 ExampleSet1/example.json $OUT/gate.ppm
+	if ! bench/ppmdiff ExampleSet1/expected_result.ppm $OUT/gate.ppm > $OUT/gate.txt; then
+		echo "FAIL: ExampleSet1 with '$options' does not match expected_result.ppm: $(cat $OUT/gate.txt)"
+		exit 1
+	fi
+done
+$RAYCAST --compile ExampleSet1/example.json $OUT/gate.rcs
+$RAYCAST 100 100 $OUT/gate.rcs $OUT/gate.ppm
+if ! bench/ppmdiff ExampleSet1/expected_result.ppm $OUT/gate.ppm > $OUT/gate.txt; then
+	echo "FAIL: compiled ExampleSet1 does not match expected_result.ppm: $(cat $OUT/gate.txt)"
+	exit 1
+fi
+echo "ExampleSet1 matches expected_result.ppm"
+bench/scenegen --spheres 2000 --planes 2 --layout clustered --duplicates 8 --seed 7 $OUT/duplicates.json
+$RAYCAST --compile $OUT/duplicates.json $OUT/gate.rcs
+$RAYCAST --kernel scalar 320 240 $OUT/duplicates.json $OUT/split.ppm
+for options in "" "--kernel sse" "--threads 2 --tile-size 5" "--packet 4" "--packet 8 --kernel sse" "--accel bins" "--accel bins --kernel sse --threads 2"; do	# Coincident spheres go to the earliest in the file
+	for scene in $OUT/duplicates.json $OUT/gate.rcs; do
+		$RAYCAST $options 320 240 $scene $OUT/gate.ppm
+		if ! bench/ppmdiff $OUT/split.ppm $OUT/gate.ppm > $OUT/gate.txt; then
+			echo "FAIL: duplicated spheres in $scene with '$options' do not match --kernel scalar: $(cat $OUT/gate.txt)"
+			exit 1
+		fi
+	done
+done
+$RAYCAST --precision float --kernel scalar 320 240 $OUT/duplicates.json $OUT/split.ppm
+for options in "" "--kernel sse" "--packet 4" "--accel bins --kernel sse"; do
+	$RAYCAST --precision float $options 320 240 $OUT/duplicates.json $OUT/gate.ppm
+	if ! bench/ppmdiff $OUT/split.ppm $OUT/gate.ppm > $OUT/gate.txt; then
+		echo "FAIL: duplicated spheres with '--precision float $options' do not match --kernel scalar: $(cat $OUT/gate.txt)"
+		exit 1
+	fi
+done
+echo "duplicated spheres match --kernel scalar"
+bench/split_render.sh 3 2 100 100 ExampleSet1/example.json $OUT/split.ppm
+if ! bench/ppmdiff ExampleSet1/expected_result.ppm $OUT/split.ppm > $OUT/gate.txt; then
+	echo "FAIL: ExampleSet1 rendered as 3x2 regions does not match expected_result.ppm: $(cat $OUT/gate.txt)"
+	exit 1
+fi
+bench/scenegen --spheres 5000 --planes 2 --layout clustered --seed 7 $OUT/split.json
+$RAYCAST --packet 4 640 480 $OUT/split.json $OUT/gate.ppm
+bench/split_render.sh 2 3 640 480 $OUT/split.json $OUT/split.ppm --packet 4
+if ! cmp -s $OUT/gate.ppm $OUT/split.ppm; then
+	echo "FAIL: a render split into 2x3 regions does not match the single process render"
+	exit 1
+fi
+echo "region renders merge to the single process image"
+$RAYCAST --progressive 0 --threads 2 640 480 $OUT/split.json $OUT/split.ppm
+if ! cmp -s $OUT/gate.ppm $OUT/split.ppm; then
+	echo "FAIL: --progressive with no deadline does not match the normal render"
+	exit 1
+fi
+echo "progressive render matches the normal render"
+bench/scenegen --spheres 3000 --planes 2 --layout clustered --seed 7 $OUT/frame-0.json	# Every --frames frame is a full render of its scene
+changes='1 7 position [1, 0.5, 20]
+1 300 radius 3
+2 7 color [1, 0, 0]
+2 1200 position [-2, -1, 25]
+3 3001 color [0.2, 0.3, 0.9]
+4 0 width 1.4
+5 1500 radius 0.01
+5 7 position [30, 20, 60]'
+frames=6	# The last frame has no changes
+echo "$changes" | awk -v frames=$frames '{	# frame object key value, one change per line
+	value = $0
+	sub(/^[^ ]+ [^ ]+ [^ ]+ /, "", value)
+	list[$1] = list[$1] (list[$1] == "" ? "" : ", ") "{\"object\": " $2 ", \"" $3 "\": " value "}"
+}
+END {
+	printf "["
+	for(f = 1; f <= frames; f++) printf "%s[%s]", (f > 1 ? ",\n" : ""), list[f]
+	print "]"
+}' > $OUT/frames.json
+frame=1
+while [ $frame -le $frames ]; do	# Frame k's scene is frame k - 1's with the changes of frame k written in
+	echo "$changes" | awk -v frame=$frame 'NR == FNR {
+		if($1 == frame){
+			value[$2 + 2] = $0
+			sub(/^[^ ]+ [^ ]+ [^ ]+ /, "", value[$2 + 2])
+			key[$2 + 2] = $3
+		}
+		next
+	}
+	FNR in key {
+		sub("\"" key[FNR] "\": (\\[[^]]*\\]|[^,}]*)", "\"" key[FNR] "\": " value[FNR])
+	}
+	{ print }' - $OUT/frame-$((frame - 1)).json > $OUT/frame-$frame.json
+	frame=$((frame + 1))
+done
+for options in "" "--threads 3" "--packet 4" "--packet 8 --threads 2 --tile-size 8"; do
+	$RAYCAST $options --frames $OUT/frames.json 320 240 $OUT/frame-0.json $OUT/frames.ppm
+	frame=0
+	while [ $frame -le $frames ]; do
+		$RAYCAST $options 320 240 $OUT/frame-$frame.json $OUT/gate.ppm
+		if ! cmp -s $OUT/gate.ppm $OUT/frames-$(printf %04d $frame).ppm; then
+			echo "FAIL: frame $frame of --frames with '$options' does not match a full render of that frame's scene"
+			exit 1
+		fi
+		frame=$((frame + 1))
+	done
+done
+echo "--frames matches full renders of every frame"
+$RAYCAST 640 480 $OUT/split.json $OUT/gate.ppm	# --aa-budget 0 leaves the plain render
+$RAYCAST --aa 4 --aa-budget 0 640 480 $OUT/split.json $OUT/split.ppm
+if ! cmp -s $OUT/gate.ppm $OUT/split.ppm; then
+	echo "FAIL: --aa 4 --aa-budget 0 does not match the render without --aa"
+	exit 1
+fi
+for aa in "--aa 4" "--aa 4 --aa-budget 20000"; do	# The edge samples do not depend on how the first pass was traced
+	$RAYCAST $aa 640 480 $OUT/split.json $OUT/gate.ppm
+	for options in "--threads 3" "--packet 4" "--packet 8 --threads 2" "--accel bins" "--accel bins --threads 2 --kernel sse"; do
+		$RAYCAST $aa $options 640 480 $OUT/split.json $OUT/split.ppm
+		if ! cmp -s $OUT/gate.ppm $OUT/split.ppm; then
+			echo "FAIL: '$aa' with '$options' does not match '$aa' alone"
+			exit 1
+		fi
+	done
+done
+echo "--aa renders match across threads, packets and bins, --aa-budget 0 matches the plain render"
+for scene in ExampleSet2/example.json $OUT/split.json; do	# .qoi output must decode to the same pixels as .ppm
+	$RAYCAST --threads $THREADS 640 480 $scene $OUT/gate.ppm
+	$RAYCAST --threads $THREADS 640 480 $scene $OUT/gate.qoi
+	if ! bench/ppmdiff $OUT/gate.ppm $OUT/gate.qoi > $OUT/gate.txt; then
+		echo "FAIL: .qoi output of $scene does not match .ppm: $(cat $OUT/gate.txt)"
+		exit 1
+	fi
+	echo "$scene: .qoi matches .ppm, $(wc -c < $OUT/gate.qoi) bytes instead of $(wc -c < $OUT/gate.ppm)"
+done
+bench/scenegen --spheres 300 --instances 200 --layout clustered --seed 7 $OUT/instances.json
+bench/scenegen --spheres 300 --instances 200 --layout clustered --seed 7 --flatten $OUT/flattened.json
+for options in "" "--packet 4 --threads 2" "--accel bins --kernel scalar"; do	# An instance draws what its spheres would as plain objects
+	$RAYCAST $options 640 480 $OUT/instances.json $OUT/gate.ppm
+	$RAYCAST $options 640 480 $OUT/flattened.json $OUT/split.ppm
+	if ! bench/ppmdiff --max-differing $INSTANCE_MAX_DIFFERING $OUT/split.ppm $OUT/gate.ppm > $OUT/gate.txt; then
+		echo "FAIL: instanced scene with '$options' does not match the flattened scene: $(cat $OUT/gate.txt)"
+		exit 1
+	fi
+done
+echo "instanced scene matches the flattened scene: $(cat $OUT/gate.txt)"
+for generate in "--spheres 5000 --planes 2" "--spheres 300 --instances 200"; do	# A batch view is the same image as a render from its camera alone
+	bench/scenegen $generate --layout clustered --cameras 3 --seed 7 $OUT/cameras.json
+	for options in "--threads 3" "--packet 4 --threads 2" "--accel bins --fast-rays"; do
+		$RAYCAST $options --cameras all 640 480 $OUT/cameras.json $OUT/gate.ppm
+		for camera in 0 1 2; do
+			bench/scenegen $generate --layout clustered --cameras 3 --camera $camera --seed 7 $OUT/camera.json
+			$RAYCAST $options 640 480 $OUT/camera.json $OUT/split.ppm
+			if ! cmp -s $OUT/gate-cam$camera.ppm $OUT/split.ppm; then
+				echo "FAIL: view cam$camera of a --cameras batch with '$options' does not match a render from that camera"
+				exit 1
+			fi
+		done
+	done
+done
+echo "--cameras views match renders from each camera alone"
+for options in "" "--threads 3" "--precision float --accel bins --threads 2"; do	# Renders through raycast.h, several at once from one parsed scene
+	$RAYCAST $options 640 480 $OUT/cameras.json $OUT/gate.ppm
+	bench/librender $options 640 480 $OUT/cameras.json $OUT/split.ppm cam0 > $OUT/gate.txt
+	if ! cmp -s $OUT/gate.ppm $OUT/split.ppm; then
+		echo "FAIL: raycast_render() with '$options' does not match the command line render"
+		exit 1
+	fi
+done
+echo "$(cat $OUT/gate.txt)"
+echo "100 100 ExampleSet1/example.json $OUT/serve-0.ppm" > $OUT/jobs.txt	# raycast --serve writes the same images as raycast
+job=0
+for options in "" "--threads 2" "--precision float --accel bins" "--aa 4"; do
+	job=$((job + 1))
+	echo "$options 640 480 $OUT/cameras.json $OUT/serve-$job.qoi" >> $OUT/jobs.txt
+done
+$RAYCAST --serve - --threads 2 < $OUT/jobs.txt > $OUT/serve.txt 2> /dev/null
+if ! bench/ppmdiff ExampleSet1/expected_result.ppm $OUT/serve-0.ppm > $OUT/gate.txt; then
+	echo "FAIL: ExampleSet1 rendered by raycast --serve does not match expected_result.ppm: $(cat $OUT/gate.txt)"
+	exit 1
+fi
+job=0
+for options in "" "--threads 2" "--precision float --accel bins" "--aa 4"; do
+	job=$((job + 1))
+	$RAYCAST $options 640 480 $OUT/cameras.json $OUT/gate.qoi
+	if ! grep -q "^$job ok " $OUT/serve.txt || ! cmp -s $OUT/serve-$job.qoi $OUT/gate.qoi; then
+		echo "FAIL: raycast --serve job '$options' does not match the command line render"
+		exit 1
+	fi
+done
+echo "raycast --serve jobs match the command line renders"
+rm -f $OUT/profile.txt
+for options in "" "--precision float" "--accel bins --fast-rays" "--tune-profile $OUT/profile.txt" "--tune-profile $OUT/profile.txt"; do	# The settings --autotune picks do not change the image
+	$RAYCAST $(echo "$options" | sed 's/--tune-profile [^ ]*//') 640 480 $OUT/cameras.json $OUT/gate.ppm
+	$RAYCAST --autotune --stats $options 640 480 $OUT/cameras.json $OUT/split.ppm | grep "^autotune: tile" | tail -n 1 > $OUT/gate.txt	# The summary, after the settings it timed
+	if ! cmp -s $OUT/gate.ppm $OUT/split.ppm; then
+		echo "FAIL: --autotune with '$options' does not match the render without it"
+		exit 1
+	fi
+done
+if ! grep -q "from $OUT/profile.txt" $OUT/gate.txt; then
+	echo "FAIL: a second --tune-profile run did not use the settings of the first"
+	exit 1
+fi
+echo "--autotune renders match, $(cat $OUT/gate.txt)"
+
+if [ -n "$BENCH_QUICK" ]; then
+	SPHERES="1000 20000"
+	SIZES="320x240 1280x960"
+	INSTANCES="20"
+else
+	SPHERES="100 10000 200000"
+	SIZES="320x240 1280x960 3840x2880"
+	INSTANCES="100 1000"
+fi
+
+echo "== precision gate"
+scenes="ExampleSet1/example.json ExampleSet2/example.json"
+for spheres in $SPHERES; do
+	bench/scenegen --spheres $spheres --planes 2 --layout clustered --seed 7 $OUT/precision_$spheres.json
+	scenes="$scenes $OUT/precision_$spheres.json"
+done
+for scene in $scenes; do
+	$RAYCAST --precision double 640 480 $scene $OUT/double.ppm
+	$RAYCAST --precision float 640 480 $scene $OUT/float.ppm
+	if ! bench/ppmdiff --max-differing $FLOAT_MAX_DIFFERING $OUT/double.ppm $OUT/float.ppm > $OUT/gate.txt; then
+		echo "FAIL: --precision float on $scene: $(cat $OUT/gate.txt)"
+		exit 1
+	fi
+	echo "$scene: $(cat $OUT/gate.txt)"
+	$RAYCAST --fast-rays 640 480 $scene $OUT/float.ppm
+	if ! bench/ppmdiff --max-differing $FAST_MAX_DIFFERING $OUT/double.ppm $OUT/float.ppm > $OUT/gate.txt; then
+		echo "FAIL: --fast-rays on $scene: $(cat $OUT/gate.txt)"
+		exit 1
+	fi
+	echo "$scene --fast-rays: $(cat $OUT/gate.txt)"
+done
+
+echo "== performance"
+for spheres in $SPHERES; do
+	for layout in uniform clustered; do
+		for planes in 0 2; do
+			scene=$OUT/scene_${spheres}_${layout}_${planes}.json
+			bench/scenegen --spheres $spheres --planes $planes --layout $layout --seed 7 $scene
+			for size in $SIZES; do
+				w=${size%x*}
+				h=${size#*x}
+				thread_counts=$THREADS
+				if [ $THREADS != 1 ] && [ $size = ${SIZES%% *} ]; then	# serial baseline at the smallest size
+					thread_counts="1 $THREADS"
+				fi
+				for threads in $thread_counts; do
+					bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+						--label "${spheres}s/${planes}p/$layout/$size/t$threads" \
+						-- $RAYCAST --stats --threads $threads $w $h $scene $OUT/bench.ppm
+				done
+				bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+					--label "${spheres}s/${planes}p/$layout/$size/t$THREADS/float" \
+					-- $RAYCAST --stats --precision float --threads $THREADS $w $h $scene $OUT/bench.ppm
+				bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+					--label "${spheres}s/${planes}p/$layout/$size/t$THREADS/bins" \
+					-- $RAYCAST --stats --accel bins --threads $THREADS $w $h $scene $OUT/bench.ppm
+				bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+					--label "${spheres}s/${planes}p/$layout/$size/t$THREADS/bins/fast" \
+					-- $RAYCAST --stats --accel bins --fast-rays --threads $THREADS $w $h $scene $OUT/bench.ppm
+			done
+		done
+	done
+done
+size=${SIZES##* }
+w=${size%x*}
+h=${size#*x}
+for instances in $INSTANCES; do	# Instances share one group of 1000 spheres, the flattened copy stores every sphere
+	bench/scenegen --spheres 1000 --instances $instances --layout clustered --seed 7 $OUT/instances.json
+	bench/scenegen --spheres 1000 --instances $instances --layout clustered --seed 7 --flatten $OUT/flattened.json
+	for kind in instances flattened; do
+		bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+			--label "${instances}i/1000s/$kind/$size/t$THREADS" \
+			-- $RAYCAST --stats --threads $THREADS $w $h $OUT/$kind.json $OUT/bench.ppm
+	done
+done
+bench/scenegen --spheres 20000 --planes 2 --layout clustered --cameras 4 --seed 7 $OUT/cameras.json
+bench/scenegen --spheres 20000 --planes 2 --layout clustered --cameras 4 --camera 1 --seed 7 $OUT/camera.json
+bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+	--label "20000s/2p/1camera/$size/t$THREADS" \
+	-- $RAYCAST --stats --threads $THREADS $w $h $OUT/camera.json $OUT/bench.ppm
+bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+	--label "20000s/2p/4cameras/$size/t$THREADS" \
+	-- $RAYCAST --stats --threads $THREADS --cameras all $w $h $OUT/cameras.json $OUT/bench.ppm
+for aa in 0 4; do	# --aa 4 against the plain render, only edge pixels get the extra rays
+	bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+		--label "20000s/2p/aa$aa/$size/t$THREADS" \
+		-- $RAYCAST --stats --threads $THREADS --aa $aa $w $h $OUT/camera.json $OUT/bench.ppm
+done
+rm -f $OUT/profile.txt
+bench/harness --repeat 1 --csv $OUT/results.csv --json $OUT/results.jsonl \
+	--label "20000s/2p/autotune/$size" \
+	-- $RAYCAST --stats --tune-profile $OUT/profile.txt $w $h $OUT/camera.json $OUT/bench.ppm
+bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+	--label "20000s/2p/tuned/$size" \
+	-- $RAYCAST --stats --tune-profile $OUT/profile.txt $w $h $OUT/camera.json $OUT/bench.ppm
+bench/scenegen --spheres 20000 --planes 2 --layout clustered --seed 7 $OUT/serve.json
+: > $OUT/jobs.txt
+for job in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do	# Small renders, where starting up and parsing dominate
+	echo "80 60 $OUT/serve.json $OUT/serve-$job.ppm" >> $OUT/jobs.txt
+done
+bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+	--label "20jobs/20000s/80x60/processes" \
+	-- sh -c "while read w h scene output; do $RAYCAST \$w \$h \$scene \$output || exit 1; done < $OUT/jobs.txt"
+bench/harness --repeat $REPEAT --csv $OUT/results.csv --json $OUT/results.jsonl \
+	--label "20jobs/20000s/80x60/serve/t$THREADS" \
+	-- sh -c "$RAYCAST --serve - --threads $THREADS < $OUT/jobs.txt > $OUT/serve.txt 2> /dev/null"
+echo "results in $OUT/results.csv and $OUT/results.jsonl"
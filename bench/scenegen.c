@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//Writes a synthetic scene for the benchmarks:
+//scenegen [--spheres N] [--planes M] [--layout uniform|clustered] [--clusters K] [--instances I] [--flatten] [--cameras K [--camera I]] [--duplicates D] [--seed S] output.json
+//With --instances the spheres become one group, "cluster", around the origin, drawn by I instances spread through the
+//box in front of the camera. --flatten writes the same scene with every instance expanded into plain spheres, printed
+//exactly, so the two files render alike.
+//--cameras K writes K cameras, cam0 at the origin and the others spread around the front of the box, named for
+//raycast --cameras. Adding --camera I writes only camera I, unnamed, so the scene renders from it on its own.
+//--duplicates D places every sphere at the same position and radius as D - 1 others, each with its own color, spread
+//through the file: where they are hit, the earliest of the copies has to win whatever kernel or acceleration is used.
+
+static unsigned long long state = 88172645463325252ULL;
+
+double random_unit(){	//Uniform value in [0, 1), xorshift so scenes are the same on every platform
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (state >> 11)*(1.0/9007199254740992.0);
+}
+
+double random_range(double low, double high){
+	return low + (high - low)*random_unit();
+}
+
+double random_normal(){	//Box-Muller
+	double u = random_unit();
+	double v = random_unit();
+	if(u < 1e-300) u = 1e-300;
+	return sqrt(-2*log(u))*cos(2*M_PI*v);
+}
+
+double rounded(double v){	//The value raycast reads back from %.5f
+	char text[64];
+	snprintf(text, sizeof(text), "%.5f", v);
+	return strtod(text, NULL);
+}
+
+int main(int c, char** argv){
+	int spheres = 1000;
+	int planes = 2;
+	int clustered = 0;
+	int clusters = 16;
+	unsigned long long seed = 1;
+	int instances = 0;
+	int flatten = 0;
+	int cameras = 0;
+	int camera = -1;
+	int duplicates = 1;
+	int unique;
+	double (*shapes)[4] = NULL;	//Position and radius of the first unique spheres, for --duplicates
+	double (*eyes)[3] = NULL;
+	double (*centers)[3];
+	double (*group)[7];	//Color, position and radius of each sphere of the group
+	FILE* output;
+	int i;
+	int j;
+	
+	for(i = 1; i < c - 1; i++){
+		if(strcmp(argv[i], "--flatten") == 0){
+			flatten = 1;
+			continue;
+		}
+		if(i + 1 >= c - 1) break;
+		if(strcmp(argv[i], "--spheres") == 0){
+			spheres = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--planes") == 0){
+			planes = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--layout") == 0){
+			clustered = strcmp(argv[i + 1], "clustered") == 0;
+			if(!clustered && strcmp(argv[i + 1], "uniform") != 0){
+				fprintf(stderr, "Error: Layout must be uniform or clustered\n");
+				return 1;
+			}
+		}else if(strcmp(argv[i], "--clusters") == 0){
+			clusters = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--instances") == 0){
+			instances = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--cameras") == 0){
+			cameras = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--camera") == 0){
+			camera = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--duplicates") == 0){
+			duplicates = atoi(argv[i + 1]);
+		}else if(strcmp(argv[i], "--seed") == 0){
+			seed = strtoull(argv[i + 1], NULL, 10);
+		}else{
+			fprintf(stderr, "Error: Unknown option \"%s\"\n", argv[i]);
+			return 1;
+		}
+		i++;
+	}
+	if(i != c - 1 || argv[c - 1][0] == '-' || spheres < 0 || planes < 0 || planes > 6 || clusters < 1 || instances < 0 || (instances > 0 && spheres == 0)
+		|| cameras < 0 || camera >= cameras || (camera < -1) || duplicates < 1 || (duplicates > 1 && instances > 0)){
+		fprintf(stderr, "Usage: scenegen [--spheres N] [--planes 0-6] [--layout uniform|clustered] [--clusters K] [--instances I] [--flatten] [--cameras K [--camera I]] [--duplicates D] [--seed S] output.json\n");
+		return 1;
+	}
+	state += seed*0x9E3779B97F4A7C15ULL;
+	
+	output = fopen(argv[c - 1], "w");
+	if(output == NULL){
+		fprintf(stderr, "Error: Could not open output file \"%s\"\n", argv[c - 1]);
+		return 1;
+	}
+	
+	//The camera sits at the origin looking down +z, spheres fill a box in front of it
+	if(cameras == 0){
+		fprintf(output, "[\n{\"type\": \"camera\", \"width\": 1.6, \"height\": 1.2}");
+	}else{	//Every camera's position is drawn whichever is written, so the rest of the scene stays the same
+		eyes = malloc(sizeof(*eyes)*cameras);
+		for(i = 0; i < cameras; i++){
+			eyes[i][0] = i == 0 ? 0 : random_range(-20, 20);
+			eyes[i][1] = i == 0 ? 0 : random_range(-10, 10);
+			eyes[i][2] = i == 0 ? 0 : random_range(-10, 5);
+		}
+		fprintf(output, "[");
+		for(i = 0; i < cameras; i++){
+			if(camera >= 0 && i != camera) continue;
+			fprintf(output, "%s\n{\"type\": \"camera\", ", camera >= 0 || i == 0 ? "" : ",");
+			if(camera < 0) fprintf(output, "\"name\": \"cam%d\", ", i);
+			fprintf(output, "\"width\": 1.6, \"height\": 1.2, \"position\": [%.5f, %.5f, %.5f]}", eyes[i][0], eyes[i][1],
+				eyes[i][2]);
+		}
+		free(eyes);
+	}
+	centers = malloc(sizeof(*centers)*clusters);
+	for(i = 0; i < clusters; i++){
+		centers[i][0] = random_range(-30, 30);
+		centers[i][1] = random_range(-20, 20);
+		centers[i][2] = random_range(20, 60);
+	}
+	if(instances > 0){	//One group around the origin, a blob for clustered and a cube for uniform
+		group = malloc(sizeof(*group)*spheres);
+		for(i = 0; i < spheres; i++){
+			for(j = 0; j < 3; j++){
+				group[i][3 + j] = rounded(clustered ? 1.5*random_normal() : random_range(-3, 3));
+			}
+			group[i][6] = rounded(random_range(0.05, 0.3));
+			for(j = 0; j < 3; j++){
+				group[i][j] = random_unit();
+			}
+		}
+		if(!flatten){
+			fprintf(output, ",\n{\"type\": \"group\", \"name\": \"cluster\", \"objects\": [");
+			for(i = 0; i < spheres; i++){
+				fprintf(output, "%s\n  {\"type\": \"sphere\", \"color\": [%.4f, %.4f, %.4f], \"position\": [%.5f, %.5f, %.5f], \"radius\": %.5f}",
+					i > 0 ? "," : "", group[i][0], group[i][1], group[i][2], group[i][3], group[i][4], group[i][5], group[i][6]);
+			}
+			fprintf(output, "\n]}");
+		}
+		for(i = 0; i < instances; i++){
+			double x = random_range(-40, 40);
+			double y = random_range(-30, 30);
+			double z = random_range(15, 85);
+			double scale = random_range(0.5, 2);
+			if(!flatten){
+				fprintf(output, ",\n{\"type\": \"instance\", \"group\": \"cluster\", \"position\": [%.17g, %.17g, %.17g], \"scale\": %.17g}",
+					x, y, z, scale);
+				continue;
+			}
+			for(j = 0; j < spheres; j++){	//The same arithmetic raycast does to place an instanced sphere
+				fprintf(output, ",\n{\"type\": \"sphere\", \"color\": [%.4f, %.4f, %.4f], \"position\": [%.17g, %.17g, %.17g], \"radius\": %.17g}",
+					group[j][0], group[j][1], group[j][2], x + scale*group[j][3], y + scale*group[j][4], z + scale*group[j][5],
+					scale*group[j][6]);
+			}
+		}
+		free(group);
+		spheres = 0;
+	}
+	unique = (spheres + duplicates - 1)/duplicates;
+	if(duplicates > 1) shapes = malloc(sizeof(*shapes)*unique);
+	for(i = 0; i < spheres; i++){
+		double x, y, z, radius;
+		if(i >= unique){	//A copy of sphere i % unique
+			x = shapes[i % unique][0];
+			y = shapes[i % unique][1];
+			z = shapes[i % unique][2];
+			radius = shapes[i % unique][3];
+		}else if(clustered){	//Tight gaussian blobs, dense where they are and empty everywhere else
+			int k = (int)(random_unit()*clusters);
+			x = centers[k][0] + 1.5*random_normal();
+			y = centers[k][1] + 1.5*random_normal();
+			z = centers[k][2] + 1.5*random_normal();
+			radius = random_range(0.05, 0.3);
+		}else{
+			x = random_range(-40, 40);
+			y = random_range(-30, 30);
+			z = random_range(10, 80);
+			radius = random_range(0.05, 0.3)*pow(1000.0/(spheres + 1000), 1.0/3)*3;
+		}
+		if(shapes != NULL && i < unique){
+			shapes[i][0] = x;
+			shapes[i][1] = y;
+			shapes[i][2] = z;
+			shapes[i][3] = radius;
+		}
+		fprintf(output, ",\n{\"type\": \"sphere\", \"color\": [%.4f, %.4f, %.4f], \"position\": [%.5f, %.5f, %.5f], \"radius\": %.5f}",
+			random_unit(), random_unit(), random_unit(), x, y, z, radius);
+	}
+	free(shapes);
+	{	//Floor, back wall, ceiling, left, right and a tilted plane, in that order
+		static const double plane_data[6][6] = {
+			{0, -25, 0, 0, 1, 0}, {0, 0, 90, 0, 0, -1}, {0, 25, 0, 0, -1, 0},
+			{-45, 0, 0, 1, 0, 0}, {45, 0, 0, -1, 0, 0}, {0, -10, 100, 0, 1, -0.3}
+		};
+		for(i = 0; i < planes; i++){
+			fprintf(output, ",\n{\"type\": \"plane\", \"color\": [%.4f, %.4f, %.4f], \"position\": [%g, %g, %g], \"normal\": [%g, %g, %g]}",
+				random_unit(), random_unit(), random_unit(), plane_data[i][0], plane_data[i][1], plane_data[i][2],
+				plane_data[i][3], plane_data[i][4], plane_data[i][5]);
+		}
+	}
+	fprintf(output, "\n]\n");
+	free(centers);
+	if(fclose(output) != 0){
+		fprintf(stderr, "Error: Could not write output file \"%s\"\n", argv[c - 1]);
+		return 1;
+	}
+	return 0;
+}
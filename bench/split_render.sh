@@ -0,0 +1,47 @@
+#!/bin/sh
+# Renders an image as a grid of --region parts in separate processes and merges them.
+#
+# usage: bench/split_render.sh cols rows width height scene output [raycast options]
+#
+# Each part is written next to the output as output.part.<n>.ppm and removed after
+# raycast --merge has put them together. RAYCAST picks the binary (default ./raycast).
+
+set -e
+if [ $# -lt 6 ]; then
+	echo "usage: $0 cols rows width height scene output [raycast options]" >&2
+	exit 1
+fi
+RAYCAST=${RAYCAST:-./raycast}
+COLS=$1
+ROWS=$2
+WIDTH=$3
+HEIGHT=$4
+SCENE=$5
+OUTPUT=$6
+shift 6
+
+parts=""
+pids=""
+n=0
+row=0
+while [ $row -lt $ROWS ]; do
+	y0=$((HEIGHT*row/ROWS))
+	y1=$((HEIGHT*(row + 1)/ROWS))
+	col=0
+	while [ $col -lt $COLS ]; do
+		x0=$((WIDTH*col/COLS))
+		x1=$((WIDTH*(col + 1)/COLS))
+		part=$OUTPUT.part.$n.ppm
+		$RAYCAST "$@" --region $x0 $y0 $x1 $y1 $WIDTH $HEIGHT $SCENE $part > /dev/null &
+		pids="$pids $!"
+		parts="$parts $part"
+		n=$((n + 1))
+		col=$((col + 1))
+	done
+	row=$((row + 1))
+done
+for pid in $pids; do	# wait on each pid so a failed part fails the script
+	wait $pid
+done
+$RAYCAST --merge $OUTPUT $parts
+rm -f $parts
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "tool.h"
+
+//The raycast command line tool. It reads the options and arguments, and leaves everything else to the library.
+
+__attribute__((format(printf, 2, 3)))
+static int option_error(RaycastError* error, const char* format, ...){	//Fills in error for parse_options() and returns -1
+	va_list args;
+	va_start(args, format);
+	error->code = RAYCAST_ERROR_ARGUMENT;
+	vsnprintf(error->message, sizeof(error->message), format, args);
+	va_end(args);
+	return -1;
+}
+
+//Reads the optional flags in front of the positional arguments. Returns the number of arguments they take up, or -1
+//with the reason in error.
+int parse_options(int c, char** argv, RenderOptions* options, RaycastError* error){
+	int i = 1;
+	long cores;
+	raycast_default_options(options);
+	
+	while(i < c && strncmp(argv[i], "--", 2) == 0){
+		if(strcmp(argv[i], "--threads") == 0 && i + 1 < c){	//--threads N, 0 picks one thread per core
+			options->threads = atoi(argv[i + 1]);
+			if(options->threads == 0){
+				cores = sysconf(_SC_NPROCESSORS_ONLN);
+				options->threads = cores > 0 ? (int)cores : 1;
+			}
+			if(options->threads < 0){
+				return option_error(error, "Thread count may not be negative");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--tile-size") == 0 && i + 1 < c){	//--tile-size S, tiles are S by S pixels
+			options->tile_size = atoi(argv[i + 1]);
+			if(options->tile_size <= 0){
+				return option_error(error, "Tile size must be greater than 0");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--kernel") == 0 && i + 1 < c){	//--kernel scalar|sse|avx2|auto
+			options->kernel = argv[i + 1];
+			i += 2;
+		}else if(strcmp(argv[i], "--format") == 0 && i + 1 < c){	//--format rgb8|float|double
+			if(strcmp(argv[i + 1], "rgb8") == 0){
+				options->format = FORMAT_RGB8;
+			}else if(strcmp(argv[i + 1], "float") == 0){
+				options->format = FORMAT_FLOAT;
+			}else if(strcmp(argv[i + 1], "double") == 0){
+				options->format = FORMAT_DOUBLE;
+			}else{
+				return option_error(error, "Unknown pixel format \"%s\"", argv[i + 1]);
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--precision") == 0 && i + 1 < c){	//--precision double|float
+			if(strcmp(argv[i + 1], "double") == 0){
+				options->precision = PRECISION_DOUBLE;
+			}else if(strcmp(argv[i + 1], "float") == 0){
+				options->precision = PRECISION_FLOAT;
+			}else{
+				return option_error(error, "Unknown precision \"%s\"", argv[i + 1]);
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--accel") == 0 && i + 1 < c){	//--accel bvh|bins
+			if(strcmp(argv[i + 1], "bvh") == 0){
+				options->accel = ACCEL_BVH;
+			}else if(strcmp(argv[i + 1], "bins") == 0){
+				options->accel = ACCEL_BINS;
+			}else{
+				return option_error(error, "Unknown acceleration structure \"%s\"", argv[i + 1]);
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--packet") == 0 && i + 1 < c){	//--packet 2|4|8, 0 turns packets off
+			options->packet_size = atoi(argv[i + 1]);
+			if(options->packet_size != 0 && options->packet_size != 2 && options->packet_size != 4 && options->packet_size != 8){
+				return option_error(error, "Packet size must be 2, 4 or 8");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--band-rows") == 0 && i + 1 < c){	//--band-rows R, stream R rows at a time
+			options->band_rows = atoi(argv[i + 1]);
+			if(options->band_rows <= 0){
+				return option_error(error, "Band rows must be greater than 0");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--frames") == 0 && i + 1 < c){	//--frames changes.json, render an animation
+			options->frames = argv[i + 1];
+			i += 2;
+		}else if(strcmp(argv[i], "--heatmap") == 0 && i + 1 < c){	//--heatmap cost.ppm
+			options->heatmap = argv[i + 1];
+			if(strrchr(options->heatmap, '.') == NULL || strcmp(strrchr(options->heatmap, '.'), ".ppm") != 0){
+				return option_error(error, "Heatmap file is not of type PPM");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--region") == 0 && i + 4 < c){	//--region x0 y0 x1 y1, checked against the size in main()
+			options->region[0] = atoi(argv[i + 1]);
+			options->region[1] = atoi(argv[i + 2]);
+			options->region[2] = atoi(argv[i + 3]);
+			options->region[3] = atoi(argv[i + 4]);
+			if(options->region[0] < 0 || options->region[1] < 0 || options->region[2] <= options->region[0]
+				|| options->region[3] <= options->region[1]){
+				return option_error(error, "Region must have 0 <= x0 < x1 and 0 <= y0 < y1");
+			}
+			i += 5;
+		}else if(strcmp(argv[i], "--aa") == 0 && i + 1 < c){	//--aa K, up to K extra rays for each edge pixel
+			options->aa_samples = atoi(argv[i + 1]);
+			if(options->aa_samples < 0 || options->aa_samples > 256){
+				return option_error(error, "Anti-aliasing samples must be between 0 and 256");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--aa-budget") == 0 && i + 1 < c){	//--aa-budget R, at most R extra rays in total
+			options->aa_budget = atoll(argv[i + 1]);
+			if(options->aa_budget < 0){
+				return option_error(error, "Anti-aliasing budget may not be negative");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--progressive") == 0 && i + 1 < c){	//--progressive MS, coarse to fine with a deadline
+			options->progressive = 1;
+			options->deadline = atof(argv[i + 1])/1000;
+			if(options->deadline < 0){
+				return option_error(error, "Deadline may not be negative");
+			}
+			i += 2;
+		}else if(strcmp(argv[i], "--snapshots") == 0){	//Write the image after each --progressive level
+			options->snapshots = 1;
+			i += 1;
+		}else if(strcmp(argv[i], "--fast-rays") == 0){	//Incremental rays and planes, close to but not exactly the same image
+			options->fast_rays = 1;
+			i += 1;
+		}else if(strcmp(argv[i], "--cameras") == 0 && i + 1 < c){	//--cameras all|name,name,... render several views
+			options->cameras = argv[i + 1];
+			i += 2;
+		}else if(strcmp(argv[i], "--autotune") == 0){	//Time settings on a sample of the image and render with the fastest
+			options->autotune = 1;
+			i += 1;
+		}else if(strcmp(argv[i], "--tune-profile") == 0 && i + 1 < c){	//--tune-profile file, reuse what --autotune found
+			options->autotune = 1;
+			options->tune_profile = argv[i + 1];
+			i += 2;
+		}else if(strcmp(argv[i], "--stats") == 0){
+			options->stats = 1;
+			i += 1;
+		}else{
+			return option_error(error, "Unknown option \"%s\"", argv[i]);
+		}
+	}
+	return i - 1;	//Number of arguments used up by options
+}
+
+void argument_checker(int c, char** argv){
+	int i = 0;
+	int j = 0;
+	if(c != 5){	//Ensure that five arguments are passed in through command line
+		fprintf(stderr, "Error: Incorrect amount of arguments\n");
+		exit(1);
+	}
+	
+	while(1){	//Ensure that both the width and height arguments are numbers
+		if(*(argv[1] + i) == NULL && *(argv[2] + j) == NULL){
+			break;
+		}
+		else if(*(argv[1] + i) == NULL){
+			i--;
+		}
+		else if(*(argv[2] + j) == NULL){
+			j--;
+		}
+		
+		if(!isdigit(*(argv[1] + i)) || !isdigit(*(argv[2] + j))){
+			fprintf(stderr, "Error: Width or Height field is not a number\n");
+			exit(1);
+		}
+		i++;
+		j++;
+	}
+}
+
+int main(int c, char** argv) {	//This recieves our input.json and runs functions on it to create an output.ppm
+	RenderOptions options;
+	RaycastError error;
+	int status;
+	int num_options;
+	char* periodPointer;
+	
+	if(c > 1 && strcmp(argv[1], "--compile") == 0){	//Turn a .json scene into a .rcs file and stop
+		if(c != 4){
+			fprintf(stderr, "Error: Incorrect amount of arguments\n");
+			exit(1);
+		}
+		periodPointer = strrchr(argv[2], '.');
+		if(periodPointer == NULL || strcmp(periodPointer, ".json") != 0){
+			fprintf(stderr, "Error: Input scene file is not of type JSON\n");
+			exit(1);
+		}
+		periodPointer = strrchr(argv[3], '.');
+		if(periodPointer == NULL || strcmp(periodPointer, ".rcs") != 0){
+			fprintf(stderr, "Error: Compiled scene file is not of type RCS\n");
+			exit(1);
+		}
+		status = raycast_compile(argv[2], argv[3], &error);
+	}else if(c > 1 && strcmp(argv[1], "--merge") == 0){	//Put the parts of a --region render back together and stop
+		if(c < 4){
+			fprintf(stderr, "Error: Incorrect amount of arguments\n");
+			exit(1);
+		}
+		status = raycast_merge(argv[2], argv + 3, c - 3, &error);
+	}else if(c > 1 && strcmp(argv[1], "--serve") == 0){	//Render jobs from stdin or a socket until told to stop
+		int workers = 1;
+		long long cache_mb = 512;
+		int i = 3;
+		if(c < 3){
+			fprintf(stderr, "Error: Incorrect amount of arguments\n");
+			exit(1);
+		}
+		while(i < c){
+			if(strcmp(argv[i], "--threads") == 0 && i + 1 < c){	//--threads W worker threads, 0 for one per core
+				workers = atoi(argv[i + 1]);
+				if(workers == 0){
+					long cores = sysconf(_SC_NPROCESSORS_ONLN);
+					workers = cores > 0 ? (int)cores : 1;
+				}
+				if(workers < 0){
+					fprintf(stderr, "Error: Thread count may not be negative\n");
+					exit(1);
+				}
+			}else if(strcmp(argv[i], "--cache-mb") == 0 && i + 1 < c){	//--cache-mb M keeps up to M MB of scenes
+				cache_mb = atoll(argv[i + 1]);
+				if(cache_mb < 0){
+					fprintf(stderr, "Error: Cache size may not be negative\n");
+					exit(1);
+				}
+			}else{
+				fprintf(stderr, "Error: Unknown option \"%s\"\n", argv[i]);
+				exit(1);
+			}
+			i += 2;
+		}
+		status = serve(argv[2], workers, (size_t)cache_mb*1000000, &error);
+	}else{
+		num_options = parse_options(c, argv, &options, &error);	//Pull off any options, so the positional arguments are checked as before
+		if(num_options < 0){
+			fprintf(stderr, "Error: %s\n", error.message);
+			exit(1);
+		}
+		argv[num_options] = argv[0];
+		argv += num_options;
+		c -= num_options;
+		argument_checker(c, argv);	//Check our arguments to make sure they written correctly
+		status = raycast_run(atoi(argv[1]), atoi(argv[2]), argv[3], argv[4], &options, &error);
+	}
+	if(status != RAYCAST_OK){
+		fprintf(stderr, "Error: %s\n", error.message);
+		exit(1);
+	}
+	return 0;
+}
@@ -3,13 +3,26 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include "raycast.h"
 
-typedef struct {	//Create structure to be used for our object_array
-  int kind; // 0 = camera, 1 = sphere, 2 = plane
+typedef struct Object {	//Create structure to be used for our object_array
+  int kind; // 0 = camera, 1 = sphere, 2 = plane, 3 = group, 4 = instance
   union {
-    struct {
+    struct {	//Looks down +z from position, a scene may have several, told apart by name
       double width;
       double height;
+      double position[3];
+      char* name;	//NULL unless the scene file gives one
     } camera;
     struct {
       double color[3];
@@ -21,24 +34,307 @@ typedef struct {	//Create structure to be used for our object_array
 	  double position[3];
 	  double normal[3];
     } plane;
+    struct {	//Spheres drawn wherever an instance names the group
+      char* name;
+      struct Object** spheres;
+      int num_spheres;
+      int index;	//Position in Scene.groups, set by build_scene()
+    } group;
+    struct {	//A copy of a group, scaled by scale and then moved to position
+      double position[3];
+      double scale;
+      struct Object* group;
+    } instance;
   };
 } Object;
 
-int line = 1;
+typedef struct {	//Wall clock time spent in each phase of main(), in seconds, for --stats
+	double read_scene;
+	double move_camera_to_front;
+	double build_scene;
+	double raycast_scene;
+	double create_image;
+	double autotune;	//0 unless --autotune
+} PhaseTimes;
+
+//Errors. Library code calls fail(), which unwinds to the innermost trap on its thread: every raycast_ function of
+//raycast.h sets one up around its work with setjmp(), and so does every thread the library starts (see Thread).
+//A function that holds memory or files while something it calls may fail records them on the trap with own(), and
+//fail() releases them before it unwinds, while the frames they live in are still there. disown() takes them back once
+//the function frees them itself, and leave_trap() releases whatever its trap still owns.
+typedef struct Owned {	//One thing the innermost trap releases if the function holding it does not get to
+	void (*release)(void* data);
+	void* data;
+	struct Owned* next;
+} Owned;
+
+typedef struct ErrorTrap {
+	jmp_buf jump;
+	RaycastError error;
+	Owned* owned;	//Newest first
+	struct ErrorTrap* outer;
+} ErrorTrap;
+
+static __thread ErrorTrap* error_trap;	//Innermost trap of this thread, NULL outside of the library
+
+static void enter_trap(ErrorTrap* trap){	//Call right after setjmp(trap->jump) returned 0
+	trap->error.code = RAYCAST_OK;
+	trap->error.message[0] = '\0';
+	trap->owned = NULL;
+	trap->outer = error_trap;
+	error_trap = trap;
+}
+
+static void own(Owned* owned, void (*release)(void*), void* data){	//Has the innermost trap release data if fail() is called
+	owned->release = release;
+	owned->data = data;
+	owned->next = NULL;
+	if(error_trap == NULL) return;	//fail() exits the process
+	owned->next = error_trap->owned;
+	error_trap->owned = owned;
+}
+
+static void disown(Owned* owned){	//The caller frees it again, usually the newest of the trap
+	Owned** link;
+	if(error_trap == NULL) return;
+	for(link = &error_trap->owned; *link != NULL; link = &(*link)->next){
+		if(*link == owned){
+			*link = owned->next;
+			return;
+		}
+	}
+}
+
+static void release_owned(ErrorTrap* trap){	//Releases everything trap owns, newest first
+	Owned* owned;
+	while(trap->owned != NULL){
+		owned = trap->owned;
+		trap->owned = owned->next;
+		owned->release(owned->data);
+	}
+}
+
+static int leave_trap(ErrorTrap* trap, RaycastError* error){	//Releases what the trap owns, removes it and returns its error code
+	release_owned(trap);
+	error_trap = trap->outer;
+	if(error != NULL) *error = trap->error;
+	return trap->error.code;
+}
+
+__attribute__((noreturn, format(printf, 2, 3)))
+static void fail(int code, const char* format, ...){	//Reports an error, code is one of the RAYCAST_ERROR_ values
+	ErrorTrap* trap = error_trap;
+	va_list args;
+	va_start(args, format);
+	if(trap == NULL){	//Not called through raycast.h, nobody to report to
+		fprintf(stderr, "Error: ");
+		vfprintf(stderr, format, args);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
+	vsnprintf(trap->error.message, sizeof(trap->error.message), format, args);
+	va_end(args);
+	trap->error.code = code;
+	release_owned(trap);
+	longjmp(trap->jump, 1);
+}
+
+typedef struct {	//A thread started by start_thread(), its errors are passed on by join_threads()
+	pthread_t thread;
+	int started;
+	void* (*body)(void*);
+	void* input;
+	RaycastError error;
+} Thread;
+
+static void* thread_main(void* argument){	//Runs a thread's body inside a trap of its own
+	Thread* thread = argument;
+	ErrorTrap trap;
+	if(setjmp(trap.jump) == 0){
+		enter_trap(&trap);
+		thread->body(thread->input);
+	}
+	leave_trap(&trap, &thread->error);
+	return NULL;
+}
+
+static void start_thread(Thread* thread, void* (*body)(void*), void* input){	//Runs body(input) on a new thread
+	thread->body = body;
+	thread->input = input;
+	thread->error.code = RAYCAST_OK;
+	thread->started = pthread_create(&thread->thread, NULL, thread_main, thread) == 0;
+	if(!thread->started){	//Reported by join_threads(), the threads already running have to be waited for first
+		thread->error.code = RAYCAST_ERROR_SYSTEM;
+		snprintf(thread->error.message, sizeof(thread->error.message), "Could not create a thread");
+	}
+}
+
+static void join_threads(Thread* threads, int count){	//Waits for every thread, then fails with the first error
+	int i;
+	for(i = 0; i < count; i++){
+		if(threads[i].started) pthread_join(threads[i].thread, NULL);
+		threads[i].started = 0;
+	}
+	for(i = 0; i < count; i++){
+		if(threads[i].error.code != RAYCAST_OK) fail(threads[i].error.code, "%s", threads[i].error.message);
+	}
+}
+
+typedef struct {	//Groups read so far, instances name the group they draw
+	Object** list;
+	int count;
+	int capacity;
+} GroupList;
+
+typedef struct {	//The scene file, mapped (or read) into memory in one piece, and the parser's position in it
+  const char* data;
+  size_t size;
+  size_t pos;
+  int line;	//Line of the file at pos, for error messages
+  int mapped;	//1 if data came from mmap(), 0 if it was read into a malloc'd buffer
+  int borrowed;	//1 if data belongs to the caller of raycast_parse_scene(), close_scene() leaves it alone
+  GroupList groups;	//Everything the parser allocates outside of the arena hangs off the reader, so close_scene()
+  Object** members;	//frees it after an error as well
+  int members_capacity;
+} SceneReader;
+
+typedef struct ArenaBlock {	//One block of memory handed out by an Arena
+  struct ArenaBlock* next;
+  size_t used;
+  size_t size;
+  double data[];	//double so that every allocation is suitably aligned
+} ArenaBlock;
+
+typedef struct {	//Bump allocator that holds every object of a scene, so parsing does no per-object malloc
+  ArenaBlock* head;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+static void* arena_alloc(Arena* arena, size_t size) {	//Returns size bytes from the arena, adding a block when the current one is full
+  ArenaBlock* block = arena->head;
+  size = (size + sizeof(double) - 1)/sizeof(double)*sizeof(double);
+  if (block == NULL || block->used + size > block->size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(ArenaBlock) + block_size);
+    if (block == NULL) {
+      fail(RAYCAST_ERROR_MEMORY, "Out of memory reading objects");
+    }
+    block->next = arena->head;
+    block->used = 0;
+    block->size = block_size;
+    arena->head = block;
+  }
+  block->used += size;
+  return (char*)block->data + block->used - size;
+}
+
+static void free_arena(Arena* arena) {
+  ArenaBlock* block = arena->head;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+}
+
+// borrow_scene() sets json up to parse size bytes at data, which stay the
+// caller's.
+static void borrow_scene(SceneReader* json, const char* data, size_t size) {
+  json->data = data;
+  json->size = size;
+  json->pos = 0;
+  json->line = 1;
+  json->mapped = 0;
+  json->borrowed = 1;
+  json->groups.list = NULL;
+  json->groups.count = json->groups.capacity = 0;
+  json->members = NULL;
+  json->members_capacity = 0;
+}
+
+// open_scene() maps the whole file into memory, falling back to reading it
+// into a buffer when it can not be mapped.
+static int open_scene(SceneReader* json, const char* filename) {
+  struct stat info;
+  int fd = open(filename, O_RDONLY);
+  void* data;
+  borrow_scene(json, NULL, 0);
+  json->borrowed = 0;
+  if (fd < 0) return 0;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    json->size = info.st_size;
+    if (json->size == 0) {	//Nothing to map, the parser reports the end of file
+      close(fd);
+      return 1;
+    }
+    data = mmap(NULL, json->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, json->size, MADV_SEQUENTIAL);
+      json->data = data;
+      json->mapped = 1;
+      close(fd);
+      return 1;
+    }
+  }
+  {	//Not a regular file, or mmap() failed, read it in large chunks instead
+    size_t capacity = 1 << 20;
+    ssize_t got;
+    char* buffer = malloc(capacity);
+    json->size = 0;
+    while (buffer != NULL && (got = read(fd, buffer + json->size, capacity - json->size)) > 0) {
+      json->size += got;
+      if (json->size == capacity) {
+        char* grown = realloc(buffer, capacity*2);
+        if (grown == NULL) {
+          free(buffer);
+        }
+        capacity *= 2;
+        buffer = grown;
+      }
+    }
+    close(fd);
+    if (buffer == NULL) {
+      fail(RAYCAST_ERROR_MEMORY, "Out of memory reading \"%s\"", filename);
+    }
+    json->data = buffer;
+  }
+  return 1;
+}
 
-// next_c() wraps the getc() function and provides error checking and line
-// number maintenance
-int next_c(FILE* json) {
-  int c = fgetc(json);
+static void close_scene(SceneReader* json) {
+  if (json->borrowed) {
+    // noop
+  } else if (json->mapped) {
+    munmap((void*)json->data, json->size);
+  } else {
+    free((void*)json->data);
+  }
+  json->data = NULL;
+  free(json->groups.list);
+  free(json->members);
+  json->groups.list = NULL;
+  json->members = NULL;
+}
+
+static void release_reader(void* json){	//close_scene() for own()
+  close_scene(json);
+}
+
+// next_c() returns the next character of the file and provides error checking
+// and line number maintenance
+static inline int next_c(SceneReader* json) {
+  int c;
+  if (json->pos >= json->size) {
+    fail(RAYCAST_ERROR_INPUT, "Unexpected end of file on line number %d.", json->line);
+  }
+  c = (unsigned char)json->data[json->pos++];
 #ifdef DEBUG
   printf("next_c: '%c'\n", c);
 #endif
   if (c == '\n') {
-    line += 1;
-  }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
+    json->line += 1;
   }
   return c;
 }
@@ -46,69 +342,120 @@ int next_c(FILE* json) {
 
 // expect_c() checks that the next character is d.  If it is not it emits
 // an error.
-void expect_c(FILE* json, int d) {
+static void expect_c(SceneReader* json, int d) {
   int c = next_c(json);
   if (c == d) return;
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-  exit(1);    
+  fail(RAYCAST_ERROR_INPUT, "Expected '%c' on line %d.", d, json->line);    
 }
 
 
 // skip_ws() skips white space in the file.
-void skip_ws(FILE* json) {
+static inline void skip_ws(SceneReader* json) {
   int c = next_c(json);
   while (isspace(c)) {
     c = next_c(json);
   }
-  ungetc(c, json);
+  json->pos--;	//Put the character back, it is never a newline
 }
 
 
-// next_string() gets the next string from the file handle and emits an error
-// if a string can not be obtained.
-char* next_string(FILE* json) {
-  char buffer[129];
+// next_string() reads the next string from the file into buffer, which must
+// hold 129 characters, and emits an error if a string can not be obtained.
+static void next_string(SceneReader* json, char* buffer) {
   int c = next_c(json);
   if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
-    exit(1);
+    fail(RAYCAST_ERROR_INPUT, "Expected string on line %d.", json->line);
   }  
   c = next_c(json);
   int i = 0;
   while (c != '"') {
     if (i >= 128) {	//Strings must be shorter than 128 characters
-      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-      exit(1);      
+      fail(RAYCAST_ERROR_INPUT, "Strings longer than 128 characters in length are not supported.");      
     }
     if (c == '\\') {	//No escape characters allowed
-      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-      exit(1);      
+      fail(RAYCAST_ERROR_INPUT, "Strings with escape codes are not supported.");      
     }
     if (c < 32 || c > 126) {	//String characters must be ascii
-      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-      exit(1);
+      fail(RAYCAST_ERROR_INPUT, "Strings may contain only ascii characters.");
     }
     buffer[i] = c;
     i += 1;
     c = next_c(json);
   }
   buffer[i] = 0;
-  return strdup(buffer);	//Return the string in a duplicated buffer
 }
 
-double next_number(FILE* json) {	//Parse the next number and return it as a double
+static const double exact_powers[] = {	//Every power of ten that a double holds exactly
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double next_number(SceneReader* json) {	//Parse the next number and return it as a double
+	//Like fscanf("%lf"), leading white space is skipped without counting lines
+	const char* p;
+	const char* end = json->data + json->size;
+	const char* start;
+	unsigned long long mantissa = 0;
+	int digits = 0;	//Significant digits in mantissa
+	int any_digit = 0;
+	int exponent = 0;
+	int negative = 0;
+	int too_long = 0;
+	char copy[4097];	//Longest number strtod() is given, and its terminator
+	char* stop;
 	double value;
-	int numDigits = 0;
-	numDigits = fscanf(json, "%lf", &value);
-	if(numDigits == 0){
-		fprintf(stderr, "Error: Expected number at line %d\n", line);
-		exit(1);
+	size_t length;
+	
+	while (json->pos < json->size && isspace((unsigned char)json->data[json->pos])) json->pos++;
+	start = p = json->data + json->pos;
+	
+	//Fast path: plain decimals with up to 19 significant digits and a small exponent are exact
+	//when computed as mantissa * 10^exponent in double precision (Clinger's fast path)
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	while (p < end && isdigit((unsigned char)*p)) {
+		if (mantissa != 0 || *p != '0') {
+			if (digits < 19) mantissa = mantissa*10 + (*p - '0'); else too_long = 1;
+			digits++;
+		}
+		any_digit = 1;
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isdigit((unsigned char)*p)) {
+			if (mantissa != 0 || *p != '0') {
+				if (digits < 19) mantissa = mantissa*10 + (*p - '0'); else too_long = 1;
+				digits++;
+			}
+			exponent--;
+			any_digit = 1;
+			p++;
+		}
 	}
+	if (any_digit && isdigit((unsigned char)p[-1]) && (p >= end || (*p != 'e' && *p != 'E' && *p != 'x' && *p != 'X'))
+		&& !too_long && mantissa < (1ULL << 53) && exponent >= -22) {
+		value = (double)mantissa;
+		if (exponent < 0) value /= exact_powers[-exponent];
+		json->pos = p - json->data;
+		return negative ? -value : value;
+	}
+	
+	//Everything else (exponents, long mantissas, hex, inf, nan) goes through strtod() on a terminated copy
+	p = start;
+	while (p < end && (size_t)(p - start) < sizeof(copy) - 1 && !isspace((unsigned char)*p) && *p != ',' && *p != ']'
+		&& *p != '}') p++;
+	length = p - start;
+	memcpy(copy, start, length);
+	copy[length] = 0;
+	value = strtod(copy, &stop);
+	if (stop == copy) {
+		fail(RAYCAST_ERROR_INPUT, "Expected number at line %d", json->line);
+	}
+	json->pos += stop - copy;
 	return value;
 }
 
-double* next_vector(FILE* json) {	//parse the next vector, and return it in double form
-	double* v = malloc(3*sizeof(double));
+static void next_vector(SceneReader* json, double* v) {	//parse the next vector into v
 	expect_c(json, '[');
 	skip_ws(json);
 	v[0] = next_number(json);
@@ -122,7 +469,6 @@ double* next_vector(FILE* json) {	//parse the next vector, and return it in doub
 	v[2] = next_number(json);
 	skip_ws(json);
 	expect_c(json, ']');
-	return v;
 }
 
 static inline double sqr(double v) {	//Return the square of the number passed in
@@ -136,37 +482,36 @@ static inline void normalize(double* v) {	//Normalize any vectors passed into th
 	v[2] /= len;
 }
 
-void store_value(Object* input_object, int type_of_field, double input_value, double* input_vector){
-	//type_of_field values: 0 = width, 1 = height, 2 = radius, 3 = color, 4 = position, 5 = normal
-	//if input_value or input_vector aren't used, a 0 or NULL value should be passed in
+static void store_value(Object* input_object, int type_of_field, double input_value, double* input_vector, int line){
+	//type_of_field values: 0 = width, 1 = height, 2 = radius, 3 = color, 4 = position, 5 = normal, 6 = scale
+	//if input_value or input_vector aren't used, a 0 or NULL value should be passed in, line is for error messages
 	if(input_object->kind == 0){	//If the object is a camera, store the input into its width or height fields
 		if(type_of_field == 0){
 			if(input_value <= 0){
-				fprintf(stderr, "Error: Camera width must be greater than 0, line:%d\n", line);
-				exit(1);
+				fail(RAYCAST_ERROR_INPUT, "Camera width must be greater than 0, line:%d", line);
 			}
 			input_object->camera.width = input_value;
 		}else if(type_of_field == 1){
 			if(input_value <= 0){
-				fprintf(stderr, "Error: Camera height must be greater than 0, line:%d\n", line);
-				exit(1);
+				fail(RAYCAST_ERROR_INPUT, "Camera height must be greater than 0, line:%d", line);
 			}
 			input_object->camera.height = input_value;
+		}else if(type_of_field == 4){
+			input_object->camera.position[0] = input_vector[0];
+			input_object->camera.position[1] = input_vector[1];
+			input_object->camera.position[2] = input_vector[2];
 		}else{
-			fprintf(stderr, "Error: Camera may only have 'width' or 'height' fields, line:%d\n", line);
-			exit(1);
+			fail(RAYCAST_ERROR_INPUT, "Camera may only have 'width', 'height', 'position' or 'name' fields, line:%d", line);
 		}
 	}else if(input_object->kind == 1){	//If the object is a sphere, store input in the radius, color, or position fields
 		if(type_of_field == 2){
 			input_object->sphere.radius = input_value;
 		}else if(type_of_field == 3){
 			if(input_vector[0] > 1 || input_vector[1] > 1 || input_vector[2] > 1){
-				fprintf(stderr, "Error: Color values must be between 0 and 1, line:%d\n", line);
-				exit(1);
+				fail(RAYCAST_ERROR_INPUT, "Color values must be between 0 and 1, line:%d", line);
 			}
 			if(input_vector[0] < 0 || input_vector[1] < 0 || input_vector[2] < 0){
-				fprintf(stderr, "Error: Color values may not be negative, line:%d\n", line);
-				exit(1);
+				fail(RAYCAST_ERROR_INPUT, "Color values may not be negative, line:%d", line);
 			}
 			input_object->sphere.color[0] = input_vector[0];
 			input_object->sphere.color[1] = input_vector[1];
@@ -176,18 +521,15 @@ void store_value(Object* input_object, int type_of_field, double input_value, do
 			input_object->sphere.position[1] = input_vector[1];
 			input_object->sphere.position[2] = input_vector[2];
 		}else{
-			fprintf(stderr, "Error: Spheres only have 'radius', 'color', or 'position' fields, line:%d\n", line);
-			exit(1);
+			fail(RAYCAST_ERROR_INPUT, "Spheres only have 'radius', 'color', or 'position' fields, line:%d", line);
 		}
 	}else if(input_object->kind == 2){	//If the object is a plane, store input in the radius, color, or normal fields
 		if(type_of_field == 3){
 			if(input_vector[0] > 1 || input_vector[1] > 1 || input_vector[2] > 1){
-				fprintf(stderr, "Error: Color values must be between 0 and 1, line:%d\n", line);
-				exit(1);
+				fail(RAYCAST_ERROR_INPUT, "Color values must be between 0 and 1, line:%d", line);
 			}
 			if(input_vector[0] < 0 || input_vector[1] < 0 || input_vector[2] < 0){
-				fprintf(stderr, "Error: Color values may not be negative, line:%d\n", line);
-				exit(1);
+				fail(RAYCAST_ERROR_INPUT, "Color values may not be negative, line:%d", line);
 			}
 			input_object->plane.color[0] = input_vector[0];
 			input_object->plane.color[1] = input_vector[1];
@@ -202,60 +544,87 @@ void store_value(Object* input_object, int type_of_field, double input_value, do
 			input_object->plane.normal[2] = input_vector[2];
 			normalize(input_object->plane.normal);
 		}else{
-			fprintf(stderr, "Error: Planes only have 'radius', 'color', or 'normal' fields, line:%d\n", line);
-			exit(1);
+			fail(RAYCAST_ERROR_INPUT, "Planes only have 'radius', 'color', or 'normal' fields, line:%d", line);
+		}
+	}else if(input_object->kind == 3){	//Groups hold no numbers of their own, read_object() parses their fields
+		fail(RAYCAST_ERROR_INPUT, "Groups only have 'name' or 'objects' fields, line:%d", line);
+	}else if(input_object->kind == 4){	//If the object is an instance, store input in the position or scale fields
+		if(type_of_field == 4){
+			input_object->instance.position[0] = input_vector[0];
+			input_object->instance.position[1] = input_vector[1];
+			input_object->instance.position[2] = input_vector[2];
+		}else if(type_of_field == 6){
+			if(input_value <= 0){
+				fail(RAYCAST_ERROR_INPUT, "Instance scale must be greater than 0, line:%d", line);
+			}
+			input_object->instance.scale = input_value;
+		}else{
+			fail(RAYCAST_ERROR_INPUT, "Instances only have 'group', 'position', or 'scale' fields, line:%d", line);
 		}
 	}else{
-		fprintf(stderr, "Error: Undefined object type, line:%d\n", line);
-		exit(1);
+		fail(RAYCAST_ERROR_INPUT, "Undefined object type, line:%d", line);
 	}
 }
 
-int read_scene(char* filename, Object** object_array) {	//Parses json file, and stores object information into object_array
-  int c;
-  int num_objects = 0;
-  int object_counter = -1;
-  int height = 0, width = 0, radius = 0, color = 0, position = 0, normal = 0;	//These will serve as boolean operators
-  FILE* json = fopen(filename, "r");	//Open our json file
+static void read_object(SceneReader* json, Object* object, Arena* arena, GroupList* groups);
 
-  if (json == NULL) {	//If the file does not exist, throw an error
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-    exit(1);
-  }
-  
-  skip_ws(json);
-  
-  // Find the beginning of the list
+//Reads the objects list of a group, which may only hold spheres, into the arena
+static void read_group_spheres(SceneReader* json, Object* group, Arena* arena, GroupList* groups){
+  int c;
+  Object* member;
+  group->group.num_spheres = 0;
   expect_c(json, '[');
-
   skip_ws(json);
-
-  // Find the objects
+  if (json->pos < json->size && json->data[json->pos] == ']') {	//An empty group would have no bounds for the BVH
+    fail(RAYCAST_ERROR_INPUT, "A group needs at least one sphere, line:%d", json->line);
+  }
   while (1) {
-    c = fgetc(json);
-    if (c == ']' && num_objects != 0) {		//A ',' must be read before getting here, which means we are expecting more objects
-      fprintf(stderr, "Error: End of file reached when expecting more objects, line:%d\n", line);
-      exit(1);
+    expect_c(json, '{');
+    member = arena_alloc(arena, sizeof(Object));
+    read_object(json, member, arena, groups);
+    if (member->kind != 1) {	//Checked before members is used again, a group inside of a group would have reused it
+      fail(RAYCAST_ERROR_INPUT, "Groups may only hold spheres, line:%d", json->line);
     }
-	else if(c == ']'){	//If no objects have been parsed and a bracket is found, our file is empty, throw an error
-		fprintf(stderr, "Error: JSON file contains no objects\n");
-		fclose(json);
-		exit(1);
-	}
-	
-    if (c == '{') {	//Start object parsing
-	  if(object_counter >= 128){	//If 128 objects have already been scanned, throw an error
-		  fprintf(stderr, "Error: Maximum amount of objects allowed (not including the camera) is 128, line:%d\n", line);
-		  exit(1);
-	  }
-	  object_array[++object_counter] = malloc(sizeof(Object)); //Make space for the new object in object_array
+    if (group->group.num_spheres >= json->members_capacity) {	//The members list is reused by every group of the file
+      int capacity = json->members_capacity > 0 ? json->members_capacity*2 : 16;
+      Object** members = realloc(json->members, sizeof(Object*)*capacity);
+      if (members == NULL) {	//The old list is still the reader's, close_scene() frees it
+        fail(RAYCAST_ERROR_MEMORY, "Out of memory reading objects, line:%d", json->line);
+      }
+      json->members = members;
+      json->members_capacity = capacity;
+    }
+    json->members[group->group.num_spheres++] = member;
+    skip_ws(json);
+    c = next_c(json);
+    if (c == ']') break;
+    if (c != ',') {
+      fail(RAYCAST_ERROR_INPUT, "Expecting ',' or ']' on line %d.", json->line);
+    }
+    skip_ws(json);
+  }
+  group->group.spheres = arena_alloc(arena, sizeof(Object*)*group->group.num_spheres);
+  memcpy(group->group.spheres, json->members, sizeof(Object*)*group->group.num_spheres);
+}
+
+// read_object() parses one object, starting just after its '{' and ending
+// just after its '}', into object.
+static void read_object(SceneReader* json, Object* object, Arena* arena, GroupList* groups) {
+  int c;
+  int height = 0, width = 0, radius = 0, color = 0, position = 0, normal = 0;	//These will serve as boolean operators
+  int name = 0, objects = 0, group = 0;
+  char key[129];
+  char value[129];
+  double number;
+  double vector[3];
+  int i;
+
       skip_ws(json);
     
       // Parse object type
-      char* key = next_string(json);
+      next_string(json, key);
       if (strcmp(key, "type") != 0) {
-	fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-	exit(1);
+	fail(RAYCAST_ERROR_INPUT, "Expected \"type\" key on line number %d.", json->line);
       }
 
       skip_ws(json);
@@ -264,25 +633,35 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 
       skip_ws(json);
 
-      char* value = next_string(json);
+      next_string(json, value);
 
       if (strcmp(value, "camera") == 0) {
-		  object_array[object_counter]->kind = 0;	//If camera, set object kind to 0
+		  object->kind = 0;	//If camera, set object kind to 0, the position and name are optional
+		  object->camera.position[0] = object->camera.position[1] = object->camera.position[2] = 0;
+		  object->camera.name = NULL;
 		  width = 1;
 		  height = 1;
       } else if (strcmp(value, "sphere") == 0) {
-		  object_array[object_counter]->kind = 1;	//If sphere, set object kind to 1
+		  object->kind = 1;	//If sphere, set object kind to 1
 		  position = 1;
 		  radius = 1;
 		  color = 1;
       } else if (strcmp(value, "plane") == 0) {
-		  object_array[object_counter]->kind = 2;	//If plane, set object kind to 2
+		  object->kind = 2;	//If plane, set object kind to 2
 		  position = 1;
 		  normal = 1;
 		  color = 1;
+      } else if (strcmp(value, "group") == 0) {
+		  object->kind = 3;	//If group, set object kind to 3
+		  name = 1;
+		  objects = 1;
+      } else if (strcmp(value, "instance") == 0) {
+		  object->kind = 4;	//If instance, set object kind to 4, the scale is optional
+		  object->instance.scale = 1;
+		  group = 1;
+		  position = 1;
       } else {
-	fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-	exit(1);
+	fail(RAYCAST_ERROR_INPUT, "Unknown type, \"%s\", on line number %d.", value, json->line);
       }
 
       skip_ws(json);
@@ -293,53 +672,142 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 		if (c == '}') {
 		  // stop parsing this object
 		  //If a required field is missing from an object, throw an error
-		  if(height == 1 || width == 1 || position == 1 || normal == 1 || color == 1 || radius == 1){
-			  fprintf(stderr, "Error: Required field missing from object at line:%d\n", line);
-			  exit(1);
+		  if(height == 1 || width == 1 || position == 1 || normal == 1 || color == 1 || radius == 1 || name == 1
+		     || objects == 1 || group == 1){
+			  fail(RAYCAST_ERROR_INPUT, "Required field missing from object at line:%d", json->line);
 		  }
 		  break;
 		} else if (c == ',') {
 		  // read another field
 		  skip_ws(json);
-		  char* key = next_string(json);
+		  next_string(json, key);
 		  skip_ws(json);
 		  expect_c(json, ':');
 		  skip_ws(json);
 		  if (strcmp(key, "width") == 0){	//Based on the field, parse a number or vector
-			  double value = next_number(json);
-			  store_value(object_array[object_counter], 0, value, NULL);	//And store the value in the object_array
+			  number = next_number(json);
+			  store_value(object, 0, number, NULL, json->line);	//And store the value in the object_array
 			  width = 0;
 		  }else if(strcmp(key, "height") == 0){
-			  double value = next_number(json);
-			  store_value(object_array[object_counter], 1, value, NULL);
+			  number = next_number(json);
+			  store_value(object, 1, number, NULL, json->line);
 			  height = 0;
 		  }else if(strcmp(key, "radius") == 0) {
-			  double value = next_number(json);
-			  store_value(object_array[object_counter], 2, value, NULL);
+			  number = next_number(json);
+			  store_value(object, 2, number, NULL, json->line);
 			  radius = 0;
 		  } else if (strcmp(key, "color") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 3, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 3, 0, vector, json->line);
 			  color = 0;
 		  }else if(strcmp(key, "position") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 4, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 4, 0, vector, json->line);
 			  position = 0;
 		  }else if(strcmp(key, "normal") == 0) {
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 5, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 5, 0, vector, json->line);
 			  normal = 0;
+		  }else if(strcmp(key, "scale") == 0) {
+			  number = next_number(json);
+			  store_value(object, 6, number, NULL, json->line);
+		  }else if(strcmp(key, "name") == 0 && object->kind == 3) {
+			  next_string(json, value);
+			  for(i = 0; i < groups->count; i++){
+				  if(strcmp(groups->list[i]->group.name, value) == 0){
+					  fail(RAYCAST_ERROR_INPUT, "Group \"%s\" is defined twice, line:%d", value, json->line);
+				  }
+			  }
+			  object->group.name = arena_alloc(arena, strlen(value) + 1);
+			  strcpy(object->group.name, value);
+			  name = 0;
+		  }else if(strcmp(key, "name") == 0 && object->kind == 0) {	//Duplicates are caught by find_cameras()
+			  next_string(json, value);
+			  object->camera.name = arena_alloc(arena, strlen(value) + 1);
+			  strcpy(object->camera.name, value);
+		  }else if(strcmp(key, "objects") == 0 && object->kind == 3) {
+			  read_group_spheres(json, object, arena, groups);
+			  objects = 0;
+		  }else if(strcmp(key, "group") == 0 && object->kind == 4) {
+			  next_string(json, value);
+			  object->instance.group = NULL;
+			  for(i = 0; i < groups->count; i++){	//Groups must come before the instances that draw them
+				  if(strcmp(groups->list[i]->group.name, value) == 0) object->instance.group = groups->list[i];
+			  }
+			  if(object->instance.group == NULL){
+				  fail(RAYCAST_ERROR_INPUT, "Unknown group \"%s\", line:%d", value, json->line);
+			  }
+			  group = 0;
 		  } else {
-			fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-				key, line);
-				exit(1);
+			fail(RAYCAST_ERROR_INPUT, "Unknown property, \"%s\", on line %d.",
+				key, json->line);
 		  }
 		  skip_ws(json);
 		} else {
-		  fprintf(stderr, "Error: Unexpected value on line %d\n", line);
-		  exit(1);
+		  fail(RAYCAST_ERROR_INPUT, "Unexpected value on line %d", json->line);
 		}
       }
+      if (object->kind == 3 && groups != NULL) {	//Remember the group for the instances after it
+		  if (groups->count >= groups->capacity) {
+			  int capacity = groups->capacity > 0 ? groups->capacity*2 : 16;
+			  Object** list = realloc(groups->list, sizeof(Object*)*capacity);
+			  if (list == NULL) {	//The old list is still the reader's, close_scene() frees it
+				  fail(RAYCAST_ERROR_MEMORY, "Out of memory reading objects, line:%d", json->line);
+			  }
+			  groups->list = list;
+			  groups->capacity = capacity;
+		  }
+		  groups->list[groups->count++] = object;
+      }
+}
+
+// parse_objects() parses the list of objects json holds into a growing
+// object_array, returned through object_list, and returns the index of the
+// last object. object_list is kept up to date while parsing, so it can be
+// freed after an error.
+static int parse_objects(SceneReader* json, Object*** object_list, Arena* arena) {
+  int c;
+  int num_objects = 0;
+  int object_counter = -1;
+  int capacity = 128;
+  Object** object_array = malloc(sizeof(Object*)*capacity);
+
+  *object_list = object_array;
+  if (object_array == NULL) {
+    fail(RAYCAST_ERROR_MEMORY, "Out of memory reading objects");
+  }
+  skip_ws(json);
+  
+  // Find the beginning of the list
+  expect_c(json, '[');
+
+  skip_ws(json);
+
+  // Find the objects
+  while (1) {
+    if (json->pos >= json->size) {	//Ran out of file while looking for the next object
+      fail(RAYCAST_ERROR_INPUT, "Unexpected end of file on line number %d.", json->line);
+    }
+    c = (unsigned char)json->data[json->pos++];
+    if (c == ']' && num_objects != 0) {		//A ',' must be read before getting here, which means we are expecting more objects
+      fail(RAYCAST_ERROR_INPUT, "End of file reached when expecting more objects, line:%d", json->line);
+    }
+	else if(c == ']'){	//If no objects have been parsed and a bracket is found, our file is empty, throw an error
+		fail(RAYCAST_ERROR_INPUT, "JSON file contains no objects");
+	}
+	
+    if (c == '{') {	//Start object parsing
+	  if(object_counter + 1 >= capacity){	//If object_array is full, double its size
+		  Object** grown = realloc(object_array, sizeof(Object*)*capacity*2);
+		  if(grown == NULL){	//*object_list still holds the old array for the caller to free
+			  fail(RAYCAST_ERROR_MEMORY, "Out of memory reading objects, line:%d", json->line);
+		  }
+		  capacity *= 2;
+		  object_array = grown;
+		  *object_list = object_array;
+	  }
+	  object_array[++object_counter] = arena_alloc(arena, sizeof(Object)); //Make space for the new object in the arena
+	  read_object(json, object_array[object_counter], arena, &json->groups);
       skip_ws(json);
 	  num_objects++;
       c = next_c(json);
@@ -347,257 +815,5115 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 	// noop
 	skip_ws(json);
       } else if (c == ']') {	//If there is an ending bracket, it is the end JSON file
-	fclose(json);
 	return object_counter;
       } else {
-	fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
-	exit(1);
+	fail(RAYCAST_ERROR_INPUT, "Expecting ',' or ']' on line %d.", json->line);
       }
     }
   }
 }
 
-void argument_checker(int c, char** argv){
-	int i = 0;
-	int j = 0;
-	char* periodPointer;
-	if(c != 5){	//Ensure that five arguments are passed in through command line
-		fprintf(stderr, "Error: Incorrect amount of arguments\n");
-		exit(1);
-	}
-	
-	while(1){	//Ensure that both the width and height arguments are numbers
-		if(*(argv[1] + i) == NULL && *(argv[2] + j) == NULL){
-			break;
-		}
-		else if(*(argv[1] + i) == NULL){
-			i--;
-		}
-		else if(*(argv[2] + j) == NULL){
-			j--;
-		}
-		
-		if(!isdigit(*(argv[1] + i)) || !isdigit(*(argv[2] + j))){
-			fprintf(stderr, "Error: Width or Height field is not a number\n");
-			exit(1);
-		}
-		i++;
-		j++;
-	}
-	
-	periodPointer = strrchr(argv[3], '.');	//Ensure that the input scene file has an extension .json
-	if(periodPointer == NULL){
-		fprintf(stderr, "Error: Input scene file does not have a file extension\n");
-		exit(1);
-	}
-	if(strcmp(periodPointer, ".json") != 0){
-		fprintf(stderr, "Error: Input scene file is not of type JSON\n");
-		exit(1);
-	}
-	
-	periodPointer = strrchr(argv[4], '.');	//Ensure that the output picture file has an extension .ppm
-	if(periodPointer == NULL){
-		fprintf(stderr, "Error: Output picture file does not have a file extension\n");
-		exit(1);
+static int read_scene(const char* filename, Object*** object_list, Arena* arena, size_t* file_size) {	//Parses a .json file with parse_objects()
+  SceneReader reader;
+  Owned owned;
+  int object_counter;
+  if (!open_scene(&reader, filename)) {	//Map our json file, if the file does not exist, throw an error
+    fail(RAYCAST_ERROR_IO, "Could not open file \"%s\"", filename);
+  }
+  own(&owned, release_reader, &reader);
+  object_counter = parse_objects(&reader, object_list, arena);
+  *file_size = reader.size;
+  disown(&owned);
+  close_scene(&reader);
+  return object_counter;
+}
+
+typedef struct {	//One change read from a --frames file
+	int frame;	//Frame the change belongs to, frame 0 is the scene file itself
+	int object;	//Index of the changed object in the scene file
+	int field;	//Same type_of_field values as store_value()
+	double value;
+	double vector[3];
+} Delta;
+
+//Reads a --frames file. It holds a list with one entry per frame after the first, and each entry is a list of changes
+//to objects of the scene file, for example [[{"object": 2, "position": [0, 1, 5]}], [{"object": 2, "radius": 3}]].
+//Objects are numbered by their place in the scene file, starting at 0. Returns the number of changes, and the number
+//of frames (including frame 0) through num_frames. delta_list is kept up to date like parse_objects() does.
+static int read_frames(const char* filename, Object** file_objects, int object_counter, Delta** delta_list, int* num_frames) {
+  int c;
+  int count = 0;
+  int capacity = 64;
+  int frame = 0;
+  Delta* deltas = malloc(sizeof(Delta)*capacity);
+  Object probe;
+  char key[129];
+  double number;
+  SceneReader reader;
+  SceneReader* json = &reader;
+  Owned owned;
+
+  *delta_list = deltas;
+  if (deltas == NULL) {
+    fail(RAYCAST_ERROR_MEMORY, "Out of memory reading frames");
+  }
+  if (!open_scene(json, filename)) {
+    fail(RAYCAST_ERROR_IO, "Could not open file \"%s\"", filename);
+  }
+  own(&owned, release_reader, json);
+  skip_ws(json);
+  expect_c(json, '[');
+  skip_ws(json);
+  if (json->pos < json->size && json->data[json->pos] == ']') {	//No frames past the first
+    json->pos++;
+  } else {
+    while (1) {	//Parse one frame
+      frame++;
+      expect_c(json, '[');
+      skip_ws(json);
+      if (json->pos < json->size && json->data[json->pos] == ']') {	//A frame without changes
+        json->pos++;
+      } else {
+        while (1) {	//Parse one change
+          expect_c(json, '{');
+          skip_ws(json);
+          next_string(json, key);
+          if (strcmp(key, "object") != 0) {
+            fail(RAYCAST_ERROR_INPUT, "Expected \"object\" key on line number %d.", json->line);
+          }
+          skip_ws(json);
+          expect_c(json, ':');
+          number = next_number(json);
+          if (number != (int)number || number < 0 || number > object_counter) {
+            fail(RAYCAST_ERROR_INPUT, "Object %g is not in the scene, line:%d", number, json->line);
+          }
+          probe = *file_objects[(int)number];	//Changes are checked against a copy, they are applied frame by frame
+          skip_ws(json);
+          while ((c = next_c(json)) == ',') {
+            if (count >= capacity) {
+              Delta* grown = realloc(deltas, sizeof(Delta)*capacity*2);
+              if (grown == NULL) {	//*delta_list still holds the old array for the caller to free
+                fail(RAYCAST_ERROR_MEMORY, "Out of memory reading frames, line:%d", json->line);
+              }
+              capacity *= 2;
+              deltas = grown;
+              *delta_list = deltas;
+            }
+            deltas[count].frame = frame;
+            deltas[count].object = (int)number;
+            deltas[count].value = 0;
+            skip_ws(json);
+            next_string(json, key);
+            skip_ws(json);
+            expect_c(json, ':');
+            skip_ws(json);
+            if (strcmp(key, "width") == 0) {	//Same fields as read_scene()
+              deltas[count].field = 0;
+            } else if (strcmp(key, "height") == 0) {
+              deltas[count].field = 1;
+            } else if (strcmp(key, "radius") == 0) {
+              deltas[count].field = 2;
+            } else if (strcmp(key, "color") == 0) {
+              deltas[count].field = 3;
+            } else if (strcmp(key, "position") == 0) {
+              deltas[count].field = 4;
+            } else if (strcmp(key, "normal") == 0) {
+              deltas[count].field = 5;
+            } else {
+              fail(RAYCAST_ERROR_INPUT, "Unknown property, \"%s\", on line %d.", key, json->line);
+            }
+            if (deltas[count].field < 3) {
+              deltas[count].value = next_number(json);
+            } else {
+              next_vector(json, deltas[count].vector);
+            }
+            store_value(&probe, deltas[count].field, deltas[count].value, deltas[count].vector, json->line);
+            if (probe.kind == 0 && deltas[count].field == 4) {	//Frames retrace in the camera's own coordinates
+              fail(RAYCAST_ERROR_INPUT, "Frames can not move the camera, line:%d", json->line);
+            }
+            count++;
+            skip_ws(json);
+          }
+          if (c != '}') {
+            fail(RAYCAST_ERROR_INPUT, "Unexpected value on line %d", json->line);
+          }
+          skip_ws(json);
+          c = next_c(json);
+          if (c == ']') break;
+          if (c != ',') {
+            fail(RAYCAST_ERROR_INPUT, "Expecting ',' or ']' on line %d.", json->line);
+          }
+          skip_ws(json);
+        }
+      }
+      skip_ws(json);
+      c = next_c(json);
+      if (c == ']') break;
+      if (c != ',') {
+        fail(RAYCAST_ERROR_INPUT, "Expecting ',' or ']' on line %d.", json->line);
+      }
+      skip_ws(json);
+    }
+  }
+  disown(&owned);
+  close_scene(json);
+  *num_frames = frame + 1;
+  return count;
+}
+
+typedef struct {	//Deque of tile indices owned by one render thread, always a contiguous run so it needs no array
+	int head;	//Other threads steal from the head
+	int tail;	//The owning thread pops from the tail, one past the last tile left
+	pthread_mutex_t lock;
+} TileQueue;
+
+static void init_tile_queue(TileQueue* queue, int first, int last){	//Fills a queue with the tiles first through last - 1
+	queue->head = first;
+	queue->tail = last;
+	pthread_mutex_init(&queue->lock, NULL);
+}
+
+static void free_tile_queue(TileQueue* queue){
+	pthread_mutex_destroy(&queue->lock);
+}
+
+static int pop_tile(TileQueue* queue){	//Takes the last tile from our own queue, returns -1 if it is empty
+	int tile = -1;
+	pthread_mutex_lock(&queue->lock);
+	if(queue->head < queue->tail){
+		tile = --queue->tail;
 	}
-	if(strcmp(periodPointer, ".ppm") != 0){
-		fprintf(stderr, "Error: Output picture file is not of type PPM\n");
-		exit(1);
+	pthread_mutex_unlock(&queue->lock);
+	return tile;
+}
+
+static int steal_tile(TileQueue* queue){	//Takes the first tile from another thread's queue, returns -1 if it is empty
+	int tile = -1;
+	pthread_mutex_lock(&queue->lock);
+	if(queue->head < queue->tail){
+		tile = queue->head++;
 	}
+	pthread_mutex_unlock(&queue->lock);
+	return tile;
 }
 
-double sphere_intersection(double* Ro, double* Rd, double* C, double radius){ //Calculates the solutions to a sphere intersection
-	//Sphere equation is x^2 + y^2 + z^2 = r^2
-	//Parameterize: (x-Cx)^2 + (y-Cy)^2 + (z-Cz)^2 - r^2 = 0
-	//Substitute with ray:
-	//(Rox + t*Rdx - Cx)^2 + (Roy + t*Rdy - Cy)^2 + (Roz + t*Rdz - Cz)^2 - r^2 = 0
-	//Solve for t:
-	//a = Rdx^2 + Rdy^2 + Rdz^2
-	double a = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
-	//b = (2RdxRox - 2RdxCx) + (2RdyRoy - 2RdyCy) + (2RdzRoz - 2RdzCz)
-	double b = (2*Rd[0]*Ro[0] - 2*Rd[0]*C[0]) + (2*Rd[1]*Ro[1] - 2*Rd[1]*C[1]) + (2*Rd[2]*Ro[2] - 2*Rd[2]*C[2]);
-	//c = (Rox^2 - 2RoxCx + Cx^2) + (Roy^2 - 2RoyCy + Cy^2) + (Roz^2 - 2RozCz + Cz^2) - r^2
-	double c = (sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0])) + (sqr(Ro[1]) - 2*Ro[1]*C[1] + sqr(C[1])) + (sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2])) - sqr(radius);
-	
-	double t0;
-	double t1;
-	double det = sqr(b) - 4*a*c;
+//Every ray starts at the camera, which sits at the origin, and has a normalized direction. The parts of the
+//intersection equations that only depend on the object are baked into the scene by bake_sphere() and bake_plane(),
+//so the per ray work is a dot product and, for spheres, one square root.
+
+static double sphere_intersection(const double* Rd, const double* C, double c){ //Calculates the closest solution of a sphere intersection
+	//Sphere equation is (x-Cx)^2 + (y-Cy)^2 + (z-Cz)^2 - r^2 = 0
+	//Substitute with a ray from the origin:
+	//(t*Rdx - Cx)^2 + (t*Rdy - Cy)^2 + (t*Rdz - Cz)^2 - r^2 = 0
+	//Expand, Rdx^2 + Rdy^2 + Rdz^2 = 1 since Rd is normalized:
+	//t^2 - 2t(RdxCx + RdyCy + RdzCz) + (Cx^2 + Cy^2 + Cz^2 - r^2) = 0
+	//With b = Rd.C and the baked c = Cx^2 + Cy^2 + Cz^2 - r^2:
+	//t = b -+ sqrt(b^2 - c)
+	double b = Rd[0]*C[0] + Rd[1]*C[1] + Rd[2]*C[2];
+	double det = b*b - c;
+	double root;
+	double t;
 	if(det < 0) return 0;	//If there are no real solutions return 0
 	
-	t0 = (-b - det)/(2*a);	//Calculate both solutions
-	t1 = (-b + det)/(2*a);
-	if(t0 <= 0 && t1 <= 0) return 0; //If both solutions are less than 0, return 0
-	if(t0 <= 0 && t1 > 0) return t1; //If only t1 is greater than 0, return t1
-	if(t1 <= 0 && t0 > 0) return t0; //If only t0 is greater than 0, return t0
-	if(t0 > t1) return t1;	//If t0 is greater than t1, return t1
-	if(t1 > t0) return t0;	//If t1 is greater than t0, return t0
-	
-	return t0;	//If both solutions are equal, just return t0
-	
+	root = sqrt(det);
+	t = b - root;	//The nearer solution, unless it is behind the camera
+	if(t > 0) return t;
+	t = b + root;	//The camera is inside of the sphere
+	if(t > 0) return t;
+	return 0;	//Both solutions are behind the camera
 }
 
-double plane_intersection(double* Ro, double* Rd, double* C, double* N){ //Calculates the solution of a plane intersection
+static double plane_intersection(const double* Rd, const double* N, double num){ //Calculates the solution of a plane intersection
 	//Solve for Plane Equation:
 	//Nx(x - Cx) + Ny(y - Cy) + Nz(z - Cz) = 0
-	//Plug in our Ray:
-	//Nx(Rox + t*Rdx - Cx) + Ny(Roy + t*Rdy - Cy) + Nz(Roz + t*Rdz - Cz) = 0
-	//Solve for t:
-	//t = ((NxCx - NxRox) + (NyCy - NyRoy) + (NzCz - NzRoz))/(RdxNx + RdyNy + RdzNz)
-	double t = ((N[0]*C[0] - N[0]*Ro[0]) + (N[1]*C[1] - N[1]*Ro[1]) + (N[2]*C[2] - N[2]*Ro[2]))/(Rd[0]*N[0] + Rd[1]*N[1] + Rd[2]*N[2]);
+	//Plug in a ray from the origin:
+	//Nx(t*Rdx - Cx) + Ny(t*Rdy - Cy) + Nz(t*Rdz - Cz) = 0
+	//Solve for t, the numerator is the baked num = NxCx + NyCy + NzCz:
+	//t = (NxCx + NyCy + NzCz)/(RdxNx + RdyNy + RdzNz)
+	double t = num/(Rd[0]*N[0] + Rd[1]*N[1] + Rd[2]*N[2]);
 	if(t > 0) return t;	//Return solution if it is greater than 0
 	return 0;	//else just return 0
 }
 
-void raycast_scene(Object** object_array, int object_counter, double** pixel_buffer, int N, int M){	//This raycasts our object_array
-	int parse_count = 0;
-	int pixel_count = 0;
-	int i;
-	int x;
-	int y;
-	double Ro[3];
-	double Rd[3];
-	double cx = 0;
-	double cy = 0;
-	double w;
-	double h;
-	double pixwidth;
-	double pixheight;
+typedef struct {	//Closest intersection found so far for one ray
 	double t;
-	double best_t = INFINITY;
-	int best_index;
-	
-	if(object_array[parse_count]->kind != 0){	//If camera is not present, throw an error
-		fprintf(stderr, "Error: You must have one object of type camera\n");
-		exit(1);
+	int order;	//Position of the object in object_array, ties go to the earlier object like the original loop
+	const double* color;
+} Hit;
+
+typedef struct {	//Flattened BVH node, 32 bytes so two fit in a cache line
+	float min[3];
+	int offset;	//Interior nodes: index of the right child, the left child follows this node. Leaves: first sphere
+	float max[3];
+	int count;	//Number of spheres in a leaf, 0 for interior nodes
+} BVHNode;
+
+typedef struct Scene {	//Packed structure-of-arrays copy of object_array that the raycaster works from
+	double camera_width;
+	double camera_height;
+	int num_spheres;	//Spheres are stored in BVH leaf order
+	double* sphere_x;
+	double* sphere_y;
+	double* sphere_z;
+	double* sphere_radius;
+	double* sphere_c;	//Cx^2 + Cy^2 + Cz^2 - r^2, from bake_sphere()
+	double* sphere_color;	//Three values per sphere
+	int* sphere_order;
+	BVHNode* bvh_nodes;
+	int num_nodes;
+	int bvh_depth;
+	int bvh_leaves;
+	double bvh_build_time;	//Seconds
+	int num_planes;	//Plane arrays are padded to a multiple of SIMD_WIDTH with planes that never hit
+	int plane_objects;	//Number of planes before padding
+	double* plane_x;
+	double* plane_y;
+	double* plane_z;
+	double* plane_nx;
+	double* plane_ny;
+	double* plane_nz;
+	double* plane_num;	//N.C, from bake_plane()
+	double* plane_color;
+	int* plane_order;
+	float* sphere_xf;	//Single precision copies of what the kernels read, NULL unless bake_float_scene() made them
+	float* sphere_yf;
+	float* sphere_zf;
+	float* sphere_r2f;	//r^2, the float kernels do not use sphere_c
+	float* plane_nxf;
+	float* plane_nyf;
+	float* plane_nzf;
+	float* plane_numf;
+	struct Bins* bins;	//Screen tiles from build_bins() for --accel bins, NULL walks the BVH
+	int num_groups;
+	struct Scene* groups;	//The spheres and BVH of each group, in the group's own coordinates
+	int num_instances;	//Instances are stored in the leaf order of their own BVH
+	double* instance_x;	//Translation
+	double* instance_y;
+	double* instance_z;
+	double* instance_scale;
+	int* instance_group;	//Index into groups
+	int* instance_order;
+	BVHNode* instance_nodes;
+	int num_instance_nodes;
+	double instance_build_time;	//Seconds to build every group's BVH and the instance BVH
+	void* mapping;	//The .rcs file the arrays point into, NULL unless load_compiled_scene() made the scene
+	size_t mapping_size;
+} Scene;
+
+typedef struct {	//Counters kept by each render thread
+	long long rays;
+	long long nodes_visited;	//Only counted when built with RAYCAST_STATS, like sphere_calls, they sit in the traversal loops
+	long long sphere_tests;
+	long long packets;
+	long long packet_culled;	//Spheres rejected for a whole packet by the frustum test
+	long long sphere_calls;	//Only counted when built with RAYCAST_STATS
+	long long sphere_hits;
+	long long plane_calls;
+	long long plane_hits;
+} RayStats;
+
+#ifdef RAYCAST_STATS	//make STATS=1 counts every intersection test in the kernels, otherwise the counting compiles away
+#define COUNT(statement) statement
+#else
+#define COUNT(statement)
+#endif
+
+#define SIMD_WIDTH 4
+#define FLOAT_WIDTH 8	//Lanes of the widest float kernel
+
+typedef struct {	//Intersection kernels, picked at runtime by select_kernels()
+	const char* name;
+	//Tests spheres first through last - 1 against a ray from the camera
+	void (*spheres)(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats);
+	void (*planes)(const Scene* scene, const double* Rd, Hit* best, RayStats* stats);
+	//Tests spheres first through last - 1 of a group, scaled by s and then moved by T, as object order
+	void (*instanced)(const Scene* group, int first, int last, const double* T, double s, int order, const double* Rd, Hit* best,
+						RayStats* stats);
+} Kernels;
+
+static inline int closer_hit(double t, int order, const Hit* best){	//True if t at object order beats the current best hit
+	return t < best->t || (t == best->t && order < best->order);
+}
+
+static void* allocate(size_t size){	//malloc() that fails instead of returning NULL
+	void* memory = malloc(size);
+	if(memory == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
 	}
-	
-	//Grab camera width and height, and calculate our pixel widths and pixel heights
-	w = object_array[parse_count]->camera.width;
-	pixwidth = w/N;
-	h = object_array[parse_count]->camera.height;
-	pixheight = h/M;
-	parse_count++;
-	
-	//Create origin point for our vector
-	Ro[0] = 0;
-	Ro[1] = 0;
-	Ro[2] = 0;
-	
-	for(y = 0; y < M; y += 1){	//Raycast every shape for each pixel
-		for(x = 0; x < N; x += 1){
-			Rd[0] = cx - (w/2) + pixwidth * (x + .5);	//Create direction vector
-			Rd[1] = cy - (h/2) + pixheight * (y + .5);
-			Rd[2] = 1;
-			normalize(Rd);
-			while(parse_count < object_counter + 1){	//Iterate through object array and test for intersections
-				if(object_array[parse_count]->kind == 1){	//If sphere, test for sphere intersections
-					t = sphere_intersection(Ro, Rd, object_array[parse_count]->sphere.position,
-											object_array[parse_count]->sphere.radius);
-				}else if(object_array[parse_count]->kind == 2){	//If plane, test for a plane intersection
-					t = plane_intersection(Ro, Rd, object_array[parse_count]->plane.position,
-											object_array[parse_count]->plane.normal);
-				}else{
-					fprintf(stderr,"Error: Unknown Object");
-					exit(1);
-				}
-				
-				if(t < best_t && t > 0){	//Store object index with the closest intersection
-					best_t = t;
-					best_index = parse_count;
-				}
-				parse_count++;
-			}
-			
-			if(best_t > 0 && best_t != INFINITY){	//If if our closest intersection is valid...
-				if(object_array[best_index]->kind == 1){	//Store the associated object color into our pixel array
-					pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][0] = object_array[best_index]->sphere.color[0];
-					pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][1] = object_array[best_index]->sphere.color[1];
-					pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][2] = object_array[best_index]->sphere.color[2];
-				}else if(object_array[best_index]->kind == 2){
-					pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][0] = object_array[best_index]->plane.color[0];
-					pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][1] = object_array[best_index]->plane.color[1];
-					pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][2] = object_array[best_index]->plane.color[2];
-				}	//Storage occurs from the last row to the first row, from left to right
-				else{
-					fprintf(stderr,"Error: Unknown Object");
-					exit(1);
-				}
-				parse_count = 1;
-			}else{
-				parse_count = 1;
-			}
-			pixel_count++;
-			best_t = INFINITY;
-		}
+	return memory;
+}
+
+static double* aligned_array(int count){	//Allocates count doubles on a 32 byte boundary, with room for a vector load past the end
+	double* array = aligned_alloc(32, sizeof(double)*((count + SIMD_WIDTH - 1)/SIMD_WIDTH*SIMD_WIDTH + SIMD_WIDTH));
+	if(array == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
 	}
+	return array;
 }
 
-void create_image(double** pixel_buffer, char* output, int width, int height){	//Stores pixel array info into a .ppm file
-	FILE *output_pointer = fopen(output, "wb");	/*Open the output file*/
-	char buffer[width*height*3];
-	int counter = 0;
-	
-	while(counter < width*height){	//Iterate through pixel array, and store values into a character buffer
-		buffer[counter*3] = (int)(255*pixel_buffer[counter][0]);
-		buffer[counter*3 + 1] = (int)(255*pixel_buffer[counter][1]);
-		buffer[counter*3 + 2] = (int)(255*pixel_buffer[counter][2]);
-		counter++;
+static float* aligned_floats(int count){	//Allocates count floats and padding to a multiple of FLOAT_WIDTH and one vector more, all NaN
+	int size = (count + FLOAT_WIDTH - 1)/FLOAT_WIDTH*FLOAT_WIDTH + FLOAT_WIDTH;
+	float* array = aligned_alloc(32, sizeof(float)*size);
+	int i;
+	if(array == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
 	}
-	fprintf(output_pointer, "P6\n%d %d\n255\n", width, height);	//Write P6 header to output.ppm
-	fwrite(buffer, sizeof(char), width*height*3, output_pointer);	//Write buffer to output.ppm
-	
-	fclose(output_pointer);
+	//NaN never counts as a hit, and unlike leftover bytes it can not be a denormal, which costs a microcode assist
+	//in every lane that touches it
+	for(i = 0; i < size; i++){
+		array[i] = NAN;
+	}
+	return array;
 }
 
-void move_camera_to_front(Object** object_array, int object_count){	//Moves camera object to the front of object_array
-	Object* temp_object;
-	int counter = 0;
-	int num_cameras = 0;
-	while(counter < object_count + 1){	//Iterate through all objects in object_array
-		if(object_array[counter]->kind == 0 && counter == 0){	//If first object is a camera, do nothing
-			num_cameras++;
-		}else if(object_array[counter]->kind == 0){		//If a camera is found further in the array, switch first object with it
-			if((++num_cameras) > 1){	//But, if two cameras are ever found, throw an error
-				fprintf(stderr, "Error: You may only have one camera in your .json file\n");
-				exit(1);
-			}
-			temp_object = object_array[0];
-			object_array[0] = object_array[counter];
-			object_array[counter] = temp_object;
+static void spheres_scalar(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats){	//Tests the ray against each sphere one at a time
+	double C[3];
+	double t;
+	int i;
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i++){
+		C[0] = scene->sphere_x[i];
+		C[1] = scene->sphere_y[i];
+		C[2] = scene->sphere_z[i];
+		t = sphere_intersection(Rd, C, scene->sphere_c[i]);
+		COUNT(stats->sphere_hits += t > 0);
+		if(t > 0 && closer_hit(t, scene->sphere_order[i], best)){
+			best->t = t;
+			best->order = scene->sphere_order[i];
+			best->color = &scene->sphere_color[3*i];
 		}
-		counter++;
 	}
 }
 
-int main(int c, char** argv) {	//This recieves our input.json and runs functions on it to create an output.ppm
-	Object** object_array = malloc(sizeof(Object*)*130);	//Create array of object pointers
-	int width;
-	int height;
-	double** pixel_buffer;
-	int object_counter;
-	int counter = 0;
-	object_array[129] = NULL;	//Indicate end of object pointer array with a NULL
-	
-	argument_checker(c, argv);	//Check our arguments to make sure they written correctly
-	
-	width = atoi(argv[1]);
-	height = atoi(argv[2]);
-	
-	pixel_buffer = malloc(sizeof(double*)*(width*height + 1));	//Create our pixel array to hold color values
-	pixel_buffer[width*height] = NULL;
-	
-	while(counter < width*height){	//Reserve space for each pixel in our pixel array
-		pixel_buffer[counter] = malloc(sizeof(double)*3);
-		pixel_buffer[counter][0] = 0;
-		pixel_buffer[counter][1] = 0;
-		pixel_buffer[counter][2] = 0;
-		counter++;
+static void planes_scalar(const Scene* scene, const double* Rd, Hit* best, RayStats* stats){	//Tests the ray against every plane one at a time
+	double N[3];
+	double t;
+	int i;
+	COUNT(stats->plane_calls += scene->plane_objects);
+	for(i = 0; i < scene->num_planes; i++){
+		N[0] = scene->plane_nx[i];
+		N[1] = scene->plane_ny[i];
+		N[2] = scene->plane_nz[i];
+		t = plane_intersection(Rd, N, scene->plane_num[i]);
+		COUNT(stats->plane_hits += t > 0);
+		if(t > 0 && closer_hit(t, scene->plane_order[i], best)){
+			best->t = t;
+			best->order = scene->plane_order[i];
+			best->color = &scene->plane_color[3*i];
+		}
 	}
+}
+
+//Instanced spheres are moved into place per ray, with the same expressions bake_sphere() uses on a sphere stored at
+//T + s*position with radius s*radius, so an instance finds the hits its spheres would as plain objects
+static void instanced_scalar(const Scene* group, int first, int last, const double* T, double s, int order, const double* Rd,
+						Hit* best, RayStats* stats){	//Tests the ray against each sphere of a group one at a time
+	double C[3];
+	double r;
+	double t;
+	int i;
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i++){
+		C[0] = T[0] + s*group->sphere_x[i];
+		C[1] = T[1] + s*group->sphere_y[i];
+		C[2] = T[2] + s*group->sphere_z[i];
+		r = s*group->sphere_radius[i];
+		t = sphere_intersection(Rd, C, (C[0]*C[0] + C[1]*C[1] + C[2]*C[2]) - r*r);
+		COUNT(stats->sphere_hits += t > 0);
+		if(t > 0 && closer_hit(t, order, best)){
+			best->t = t;
+			best->order = order;
+			best->color = &group->sphere_color[3*i];
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+//The vector kernels evaluate exactly the same expressions, in the same order, as sphere_intersection() and
+//plane_intersection(), so every lane produces the same t as the scalar code. Each lane keeps the object with the
+//smallest t it has seen, a tie going to the lower object order like closer_hit(): the BVH, packets and bins store
+//spheres in other orders, so a lower index is not an earlier object. The lanes are merged with closer_hit() at the end.
+//Object indices and orders are carried in double lanes so they can be blended with the same masks as t.
+
+static void merge_lanes(const double* lane_t, const double* lane_i, int lanes, const int* order, const double* color,
+						Hit* best){	//Min-reduction of the per lane results
+	int i;
+	int index;
+	for(i = 0; i < lanes; i++){
+		index = (int)lane_i[i];
+		if(index >= 0 && closer_hit(lane_t[i], order[index], best)){
+			best->t = lane_t[i];
+			best->order = order[index];
+			best->color = &color[3*index];
+		}
+	}
+}
+
+//merge_lanes() for the spheres of one instance, which share its order. Like instanced_scalar(), a tie between them
+//goes to the lower index, so the nearest lane is picked first and then offered to closer_hit().
+static void merge_instance_lanes(const double* lane_t, const double* lane_i, int lanes, int order, const double* color,
+								Hit* best){
+	int nearest = -1;
+	int i;
+	for(i = 0; i < lanes; i++){
+		if(lane_i[i] >= 0 && (nearest < 0 || lane_t[i] < lane_t[nearest]
+			|| (lane_t[i] == lane_t[nearest] && lane_i[i] < lane_i[nearest]))){
+			nearest = i;
+		}
+	}
+	if(nearest >= 0 && closer_hit(lane_t[nearest], order, best)){
+		best->t = lane_t[nearest];
+		best->order = order;
+		best->color = &color[3*(int)lane_i[nearest]];
+	}
+}
+
+__attribute__((target("sse2")))
+static void spheres_sse(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats){	//Tests two spheres per instruction
+	__m128d zero = _mm_setzero_pd();
+	__m128d rd0 = _mm_set1_pd(Rd[0]), rd1 = _mm_set1_pd(Rd[1]), rd2 = _mm_set1_pd(Rd[2]);
+	__m128d end = _mm_set1_pd(last);
+	__m128d best_t = _mm_set1_pd(INFINITY);
+	__m128d best_i = _mm_set1_pd(-1);
+	__m128d best_o = _mm_set1_pd(INFINITY);
+	double lane_t[2];
+	double lane_i[2];
+	int i;
+	
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i += 2){
+		__m128d index = _mm_set_pd(i + 1, i);
+		__m128d order = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)&scene->sphere_order[i]));
+		__m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(rd0, _mm_loadu_pd(&scene->sphere_x[i])), _mm_mul_pd(rd1, _mm_loadu_pd(&scene->sphere_y[i]))),
+								_mm_mul_pd(rd2, _mm_loadu_pd(&scene->sphere_z[i])));
+		__m128d det = _mm_sub_pd(_mm_mul_pd(b, b), _mm_loadu_pd(&scene->sphere_c[i]));
+		__m128d root = _mm_sqrt_pd(det);	//NaN when there is no solution
+		__m128d t0 = _mm_sub_pd(b, root);
+		__m128d t1 = _mm_add_pd(b, root);
+		__m128d m0 = _mm_cmpgt_pd(t0, zero);
+		//The nearer solution, unless it is behind the camera
+		__m128d t = _mm_or_pd(_mm_and_pd(m0, t0), _mm_andnot_pd(m0, t1));
+		__m128d valid = _mm_and_pd(_mm_cmpgt_pd(t, zero), _mm_cmplt_pd(index, end));
+		__m128d hit = _mm_and_pd(valid, _mm_or_pd(_mm_cmplt_pd(t, best_t), _mm_and_pd(_mm_cmpeq_pd(t, best_t), _mm_cmplt_pd(order, best_o))));
+		COUNT(stats->sphere_hits += __builtin_popcount(_mm_movemask_pd(valid)));
+		best_t = _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, best_t));
+		best_i = _mm_or_pd(_mm_and_pd(hit, index), _mm_andnot_pd(hit, best_i));
+		best_o = _mm_or_pd(_mm_and_pd(hit, order), _mm_andnot_pd(hit, best_o));
+	}
+	_mm_storeu_pd(lane_t, best_t);
+	_mm_storeu_pd(lane_i, best_i);
+	merge_lanes(lane_t, lane_i, 2, scene->sphere_order, scene->sphere_color, best);
+}
+
+__attribute__((target("sse2")))
+static void planes_sse(const Scene* scene, const double* Rd, Hit* best, RayStats* stats){	//Tests two planes per instruction
+	__m128d zero = _mm_setzero_pd();
+	__m128d rd0 = _mm_set1_pd(Rd[0]), rd1 = _mm_set1_pd(Rd[1]), rd2 = _mm_set1_pd(Rd[2]);
+	__m128d best_t = _mm_set1_pd(INFINITY);
+	__m128d best_i = _mm_set1_pd(-1);
+	double lane_t[2];
+	double lane_i[2];
+	int i;
+	
+	COUNT(stats->plane_calls += scene->plane_objects);
+	for(i = 0; i < scene->num_planes; i += 2){
+		__m128d den = _mm_add_pd(_mm_add_pd(_mm_mul_pd(rd0, _mm_load_pd(&scene->plane_nx[i])), _mm_mul_pd(rd1, _mm_load_pd(&scene->plane_ny[i]))),
+								_mm_mul_pd(rd2, _mm_load_pd(&scene->plane_nz[i])));
+		__m128d t = _mm_div_pd(_mm_load_pd(&scene->plane_num[i]), den);
+		__m128d hit = _mm_and_pd(_mm_cmpgt_pd(t, zero), _mm_cmplt_pd(t, best_t));
+		COUNT(stats->plane_hits += __builtin_popcount(_mm_movemask_pd(_mm_cmpgt_pd(t, zero))));
+		best_t = _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, best_t));
+		best_i = _mm_or_pd(_mm_and_pd(hit, _mm_set_pd(i + 1, i)), _mm_andnot_pd(hit, best_i));
+	}
+	_mm_storeu_pd(lane_t, best_t);
+	_mm_storeu_pd(lane_i, best_i);
+	merge_lanes(lane_t, lane_i, 2, scene->plane_order, scene->plane_color, best);
+}
+
+__attribute__((target("sse2")))
+static void instanced_sse(const Scene* group, int first, int last, const double* T, double s, int order, const double* Rd,
+					Hit* best, RayStats* stats){	//Tests two spheres of a group per instruction
+	__m128d zero = _mm_setzero_pd();
+	__m128d rd0 = _mm_set1_pd(Rd[0]), rd1 = _mm_set1_pd(Rd[1]), rd2 = _mm_set1_pd(Rd[2]);
+	__m128d t0 = _mm_set1_pd(T[0]), t1 = _mm_set1_pd(T[1]), t2 = _mm_set1_pd(T[2]);
+	__m128d scale = _mm_set1_pd(s);
+	__m128d end = _mm_set1_pd(last);
+	__m128d best_t = _mm_set1_pd(INFINITY);
+	__m128d best_i = _mm_set1_pd(-1);
+	double lane_t[2];
+	double lane_i[2];
+	int i;
+	
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i += 2){
+		__m128d index = _mm_set_pd(i + 1, i);
+		__m128d cx = _mm_add_pd(t0, _mm_mul_pd(scale, _mm_loadu_pd(&group->sphere_x[i])));
+		__m128d cy = _mm_add_pd(t1, _mm_mul_pd(scale, _mm_loadu_pd(&group->sphere_y[i])));
+		__m128d cz = _mm_add_pd(t2, _mm_mul_pd(scale, _mm_loadu_pd(&group->sphere_z[i])));
+		__m128d r = _mm_mul_pd(scale, _mm_loadu_pd(&group->sphere_radius[i]));
+		__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(cx, cx), _mm_mul_pd(cy, cy)), _mm_mul_pd(cz, cz)), _mm_mul_pd(r, r));
+		__m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(rd0, cx), _mm_mul_pd(rd1, cy)), _mm_mul_pd(rd2, cz));
+		__m128d det = _mm_sub_pd(_mm_mul_pd(b, b), c);
+		__m128d root = _mm_sqrt_pd(det);	//NaN when there is no solution
+		__m128d near = _mm_sub_pd(b, root);
+		__m128d far = _mm_add_pd(b, root);
+		__m128d m0 = _mm_cmpgt_pd(near, zero);
+		//The nearer solution, unless it is behind the camera
+		__m128d t = _mm_or_pd(_mm_and_pd(m0, near), _mm_andnot_pd(m0, far));
+		__m128d valid = _mm_and_pd(_mm_cmpgt_pd(t, zero), _mm_cmplt_pd(index, end));
+		__m128d hit = _mm_and_pd(valid, _mm_cmplt_pd(t, best_t));
+		COUNT(stats->sphere_hits += __builtin_popcount(_mm_movemask_pd(valid)));
+		best_t = _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, best_t));
+		best_i = _mm_or_pd(_mm_and_pd(hit, index), _mm_andnot_pd(hit, best_i));
+	}
+	_mm_storeu_pd(lane_t, best_t);
+	_mm_storeu_pd(lane_i, best_i);
+	merge_instance_lanes(lane_t, lane_i, 2, order, group->sphere_color, best);
+}
+
+__attribute__((target("avx2")))
+static void spheres_avx2(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats){	//Tests four spheres per instruction
+	__m256d zero = _mm256_setzero_pd();
+	__m256d rd0 = _mm256_set1_pd(Rd[0]), rd1 = _mm256_set1_pd(Rd[1]), rd2 = _mm256_set1_pd(Rd[2]);
+	__m256d lane = _mm256_set_pd(3, 2, 1, 0);
+	__m256d end = _mm256_set1_pd(last);
+	__m256d best_t = _mm256_set1_pd(INFINITY);
+	__m256d best_i = _mm256_set1_pd(-1);
+	__m256d best_o = _mm256_set1_pd(INFINITY);
+	double lane_t[4];
+	double lane_i[4];
+	int i;
+	
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i += 4){
+		__m256d index = _mm256_add_pd(lane, _mm256_set1_pd(i));
+		__m256d order = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)&scene->sphere_order[i]));
+		__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rd0, _mm256_loadu_pd(&scene->sphere_x[i])),
+									_mm256_mul_pd(rd1, _mm256_loadu_pd(&scene->sphere_y[i]))), _mm256_mul_pd(rd2, _mm256_loadu_pd(&scene->sphere_z[i])));
+		__m256d det = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_loadu_pd(&scene->sphere_c[i]));
+		__m256d root = _mm256_sqrt_pd(det);	//NaN when there is no solution
+		__m256d t0 = _mm256_sub_pd(b, root);
+		__m256d t1 = _mm256_add_pd(b, root);
+		//The nearer solution, unless it is behind the camera
+		__m256d t = _mm256_blendv_pd(t1, t0, _mm256_cmp_pd(t0, zero, _CMP_GT_OQ));
+		__m256d valid = _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ), _mm256_cmp_pd(index, end, _CMP_LT_OQ));
+		__m256d hit = _mm256_and_pd(valid, _mm256_or_pd(_mm256_cmp_pd(t, best_t, _CMP_LT_OQ),
+									_mm256_and_pd(_mm256_cmp_pd(t, best_t, _CMP_EQ_OQ), _mm256_cmp_pd(order, best_o, _CMP_LT_OQ))));
+		COUNT(stats->sphere_hits += __builtin_popcount(_mm256_movemask_pd(valid)));
+		best_t = _mm256_blendv_pd(best_t, t, hit);
+		best_i = _mm256_blendv_pd(best_i, index, hit);
+		best_o = _mm256_blendv_pd(best_o, order, hit);
+	}
+	_mm256_storeu_pd(lane_t, best_t);
+	_mm256_storeu_pd(lane_i, best_i);
+	merge_lanes(lane_t, lane_i, 4, scene->sphere_order, scene->sphere_color, best);
+}
+
+__attribute__((target("avx2")))
+static void planes_avx2(const Scene* scene, const double* Rd, Hit* best, RayStats* stats){	//Tests four planes per instruction
+	__m256d zero = _mm256_setzero_pd();
+	__m256d rd0 = _mm256_set1_pd(Rd[0]), rd1 = _mm256_set1_pd(Rd[1]), rd2 = _mm256_set1_pd(Rd[2]);
+	__m256d lane = _mm256_set_pd(3, 2, 1, 0);
+	__m256d best_t = _mm256_set1_pd(INFINITY);
+	__m256d best_i = _mm256_set1_pd(-1);
+	double lane_t[4];
+	double lane_i[4];
+	int i;
+	
+	COUNT(stats->plane_calls += scene->plane_objects);
+	for(i = 0; i < scene->num_planes; i += 4){
+		__m256d den = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rd0, _mm256_load_pd(&scene->plane_nx[i])),
+									_mm256_mul_pd(rd1, _mm256_load_pd(&scene->plane_ny[i]))), _mm256_mul_pd(rd2, _mm256_load_pd(&scene->plane_nz[i])));
+		__m256d t = _mm256_div_pd(_mm256_load_pd(&scene->plane_num[i]), den);
+		__m256d hit = _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ), _mm256_cmp_pd(t, best_t, _CMP_LT_OQ));
+		COUNT(stats->plane_hits += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ))));
+		best_t = _mm256_blendv_pd(best_t, t, hit);
+		best_i = _mm256_blendv_pd(best_i, _mm256_add_pd(lane, _mm256_set1_pd(i)), hit);
+	}
+	_mm256_storeu_pd(lane_t, best_t);
+	_mm256_storeu_pd(lane_i, best_i);
+	merge_lanes(lane_t, lane_i, 4, scene->plane_order, scene->plane_color, best);
+}
+
+__attribute__((target("avx2")))
+static void instanced_avx2(const Scene* group, int first, int last, const double* T, double s, int order, const double* Rd,
+					Hit* best, RayStats* stats){	//Tests four spheres of a group per instruction
+	__m256d zero = _mm256_setzero_pd();
+	__m256d rd0 = _mm256_set1_pd(Rd[0]), rd1 = _mm256_set1_pd(Rd[1]), rd2 = _mm256_set1_pd(Rd[2]);
+	__m256d t0 = _mm256_set1_pd(T[0]), t1 = _mm256_set1_pd(T[1]), t2 = _mm256_set1_pd(T[2]);
+	__m256d scale = _mm256_set1_pd(s);
+	__m256d lane = _mm256_set_pd(3, 2, 1, 0);
+	__m256d end = _mm256_set1_pd(last);
+	__m256d best_t = _mm256_set1_pd(INFINITY);
+	__m256d best_i = _mm256_set1_pd(-1);
+	double lane_t[4];
+	double lane_i[4];
+	int i;
+	
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i += 4){
+		__m256d index = _mm256_add_pd(lane, _mm256_set1_pd(i));
+		__m256d cx = _mm256_add_pd(t0, _mm256_mul_pd(scale, _mm256_loadu_pd(&group->sphere_x[i])));
+		__m256d cy = _mm256_add_pd(t1, _mm256_mul_pd(scale, _mm256_loadu_pd(&group->sphere_y[i])));
+		__m256d cz = _mm256_add_pd(t2, _mm256_mul_pd(scale, _mm256_loadu_pd(&group->sphere_z[i])));
+		__m256d r = _mm256_mul_pd(scale, _mm256_loadu_pd(&group->sphere_radius[i]));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cx, cx), _mm256_mul_pd(cy, cy)), _mm256_mul_pd(cz, cz)),
+									_mm256_mul_pd(r, r));
+		__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rd0, cx), _mm256_mul_pd(rd1, cy)), _mm256_mul_pd(rd2, cz));
+		__m256d det = _mm256_sub_pd(_mm256_mul_pd(b, b), c);
+		__m256d root = _mm256_sqrt_pd(det);	//NaN when there is no solution
+		__m256d near = _mm256_sub_pd(b, root);
+		__m256d far = _mm256_add_pd(b, root);
+		//The nearer solution, unless it is behind the camera
+		__m256d t = _mm256_blendv_pd(far, near, _mm256_cmp_pd(near, zero, _CMP_GT_OQ));
+		__m256d valid = _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ), _mm256_cmp_pd(index, end, _CMP_LT_OQ));
+		__m256d hit = _mm256_and_pd(valid, _mm256_cmp_pd(t, best_t, _CMP_LT_OQ));
+		COUNT(stats->sphere_hits += __builtin_popcount(_mm256_movemask_pd(valid)));
+		best_t = _mm256_blendv_pd(best_t, t, hit);
+		best_i = _mm256_blendv_pd(best_i, index, hit);
+	}
+	_mm256_storeu_pd(lane_t, best_t);
+	_mm256_storeu_pd(lane_i, best_i);
+	merge_instance_lanes(lane_t, lane_i, 4, order, group->sphere_color, best);
+}
+#endif
+
+//Single precision kernels for --precision float. They read the float copies of the scene that bake_float_scene()
+//makes, with twice the lanes per instruction of the double kernels. In float, b^2 - c cancels badly for a small
+//sphere far from the camera (|C|^2 can be a million times r^2), so the discriminant is taken as r^2 - |C - b*Rd|^2,
+//the squared distance from the center to the ray subtracted from r^2, which stays accurate at any distance.
+//The scalar kernels evaluate the same expressions in the same order, so every set finds the same hits.
+
+static void spheres_scalar_float(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats){	//Tests the ray against each sphere one at a time
+	float rd0 = Rd[0], rd1 = Rd[1], rd2 = Rd[2];
+	float b;
+	float dx;
+	float dy;
+	float dz;
+	float det;
+	float root;
+	float t;
+	int i;
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i++){	//Same steps as sphere_intersection()
+		b = rd0*scene->sphere_xf[i] + rd1*scene->sphere_yf[i] + rd2*scene->sphere_zf[i];
+		dx = scene->sphere_xf[i] - b*rd0;	//Center to the closest point of the ray
+		dy = scene->sphere_yf[i] - b*rd1;
+		dz = scene->sphere_zf[i] - b*rd2;
+		det = scene->sphere_r2f[i] - (dx*dx + dy*dy + dz*dz);
+		if(det < 0) continue;
+		root = sqrtf(det);
+		t = b - root;
+		if(!(t > 0)) t = b + root;
+		COUNT(stats->sphere_hits += t > 0);
+		if(t > 0 && closer_hit(t, scene->sphere_order[i], best)){
+			best->t = t;
+			best->order = scene->sphere_order[i];
+			best->color = &scene->sphere_color[3*i];
+		}
+	}
+}
+
+static void planes_scalar_float(const Scene* scene, const double* Rd, Hit* best, RayStats* stats){	//Tests the ray against every plane one at a time
+	float rd0 = Rd[0], rd1 = Rd[1], rd2 = Rd[2];
+	float t;
+	int i;
+	COUNT(stats->plane_calls += scene->plane_objects);
+	for(i = 0; i < scene->num_planes; i++){	//Same steps as plane_intersection()
+		t = scene->plane_numf[i]/(rd0*scene->plane_nxf[i] + rd1*scene->plane_nyf[i] + rd2*scene->plane_nzf[i]);
+		COUNT(stats->plane_hits += t > 0);
+		if(t > 0 && closer_hit(t, scene->plane_order[i], best)){
+			best->t = t;
+			best->order = scene->plane_order[i];
+			best->color = &scene->plane_color[3*i];
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//Like the double kernels, each lane breaks a tie in t by object order, which is kept in an integer lane next to the index
+static void merge_float_lanes(const float* lane_t, const int* lane_i, int lanes, const int* order, const double* color,
+								Hit* best){	//Min-reduction of the per lane results, object indices are kept in integer lanes
+	int i;
+	for(i = 0; i < lanes; i++){
+		if(lane_i[i] >= 0 && closer_hit(lane_t[i], order[lane_i[i]], best)){
+			best->t = lane_t[i];
+			best->order = order[lane_i[i]];
+			best->color = &color[3*lane_i[i]];
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void spheres_sse_float(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats){	//Tests four spheres per instruction
+	__m128 zero = _mm_setzero_ps();
+	__m128 rd0 = _mm_set1_ps(Rd[0]), rd1 = _mm_set1_ps(Rd[1]), rd2 = _mm_set1_ps(Rd[2]);
+	__m128i lane = _mm_set_epi32(3, 2, 1, 0);
+	__m128i end = _mm_set1_epi32(last);
+	__m128 best_t = _mm_set1_ps(INFINITY);
+	__m128i best_i = _mm_set1_epi32(-1);
+	__m128i best_o = _mm_set1_epi32(INT_MAX);
+	float lane_t[4];
+	int lane_i[4];
+	int i;
+	
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i += 4){
+		__m128i index = _mm_add_epi32(lane, _mm_set1_epi32(i));
+		__m128i order = _mm_loadu_si128((const __m128i*)&scene->sphere_order[i]);
+		__m128 cx = _mm_loadu_ps(&scene->sphere_xf[i]);
+		__m128 cy = _mm_loadu_ps(&scene->sphere_yf[i]);
+		__m128 cz = _mm_loadu_ps(&scene->sphere_zf[i]);
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rd0, cx), _mm_mul_ps(rd1, cy)), _mm_mul_ps(rd2, cz));
+		__m128 dx = _mm_sub_ps(cx, _mm_mul_ps(b, rd0));
+		__m128 dy = _mm_sub_ps(cy, _mm_mul_ps(b, rd1));
+		__m128 dz = _mm_sub_ps(cz, _mm_mul_ps(b, rd2));
+		__m128 det = _mm_sub_ps(_mm_loadu_ps(&scene->sphere_r2f[i]),
+								_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+		__m128 root = _mm_sqrt_ps(det);	//NaN when there is no solution
+		__m128 t0 = _mm_sub_ps(b, root);
+		__m128 t1 = _mm_add_ps(b, root);
+		__m128 m0 = _mm_cmpgt_ps(t0, zero);
+		__m128 t = _mm_or_ps(_mm_and_ps(m0, t0), _mm_andnot_ps(m0, t1));
+		__m128 valid = _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_castsi128_ps(_mm_cmpgt_epi32(end, index)));
+		__m128 hit = _mm_and_ps(valid, _mm_or_ps(_mm_cmplt_ps(t, best_t),
+								_mm_and_ps(_mm_cmpeq_ps(t, best_t), _mm_castsi128_ps(_mm_cmplt_epi32(order, best_o)))));
+		COUNT(stats->sphere_hits += __builtin_popcount(_mm_movemask_ps(valid)));
+		best_t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best_t));
+		best_i = _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), index), _mm_andnot_si128(_mm_castps_si128(hit), best_i));
+		best_o = _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), order), _mm_andnot_si128(_mm_castps_si128(hit), best_o));
+	}
+	_mm_storeu_ps(lane_t, best_t);
+	_mm_storeu_si128((__m128i*)lane_i, best_i);
+	merge_float_lanes(lane_t, lane_i, 4, scene->sphere_order, scene->sphere_color, best);
+}
+
+__attribute__((target("sse2")))
+static void planes_sse_float(const Scene* scene, const double* Rd, Hit* best, RayStats* stats){	//Tests four planes per instruction
+	__m128 zero = _mm_setzero_ps();
+	__m128 rd0 = _mm_set1_ps(Rd[0]), rd1 = _mm_set1_ps(Rd[1]), rd2 = _mm_set1_ps(Rd[2]);
+	__m128i lane = _mm_set_epi32(3, 2, 1, 0);
+	__m128 best_t = _mm_set1_ps(INFINITY);
+	__m128i best_i = _mm_set1_epi32(-1);
+	float lane_t[4];
+	int lane_i[4];
+	int i;
+	
+	COUNT(stats->plane_calls += scene->plane_objects);
+	for(i = 0; i < scene->num_planes; i += 4){
+		__m128 den = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rd0, _mm_load_ps(&scene->plane_nxf[i])), _mm_mul_ps(rd1, _mm_load_ps(&scene->plane_nyf[i]))),
+							_mm_mul_ps(rd2, _mm_load_ps(&scene->plane_nzf[i])));
+		__m128 t = _mm_div_ps(_mm_load_ps(&scene->plane_numf[i]), den);
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, best_t));
+		COUNT(stats->plane_hits += __builtin_popcount(_mm_movemask_ps(_mm_cmpgt_ps(t, zero))));
+		best_t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best_t));
+		best_i = _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), _mm_add_epi32(lane, _mm_set1_epi32(i))),
+							_mm_andnot_si128(_mm_castps_si128(hit), best_i));
+	}
+	_mm_storeu_ps(lane_t, best_t);
+	_mm_storeu_si128((__m128i*)lane_i, best_i);
+	merge_float_lanes(lane_t, lane_i, 4, scene->plane_order, scene->plane_color, best);
+}
+
+__attribute__((target("avx2")))
+static void spheres_avx2_float(const Scene* scene, int first, int last, const double* Rd, Hit* best, RayStats* stats){	//Tests eight spheres per instruction
+	__m256 zero = _mm256_setzero_ps();
+	__m256 rd0 = _mm256_set1_ps(Rd[0]), rd1 = _mm256_set1_ps(Rd[1]), rd2 = _mm256_set1_ps(Rd[2]);
+	__m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i end = _mm256_set1_epi32(last);
+	__m256 best_t = _mm256_set1_ps(INFINITY);
+	__m256i best_i = _mm256_set1_epi32(-1);
+	__m256i best_o = _mm256_set1_epi32(INT_MAX);
+	float lane_t[8];
+	int lane_i[8];
+	int i;
+	
+	COUNT(stats->sphere_calls += last - first);
+	for(i = first; i < last; i += 8){
+		__m256i index = _mm256_add_epi32(lane, _mm256_set1_epi32(i));
+		__m256i order = _mm256_loadu_si256((const __m256i*)&scene->sphere_order[i]);
+		__m256 cx = _mm256_loadu_ps(&scene->sphere_xf[i]);
+		__m256 cy = _mm256_loadu_ps(&scene->sphere_yf[i]);
+		__m256 cz = _mm256_loadu_ps(&scene->sphere_zf[i]);
+		__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rd0, cx), _mm256_mul_ps(rd1, cy)), _mm256_mul_ps(rd2, cz));
+		__m256 dx = _mm256_sub_ps(cx, _mm256_mul_ps(b, rd0));
+		__m256 dy = _mm256_sub_ps(cy, _mm256_mul_ps(b, rd1));
+		__m256 dz = _mm256_sub_ps(cz, _mm256_mul_ps(b, rd2));
+		__m256 det = _mm256_sub_ps(_mm256_loadu_ps(&scene->sphere_r2f[i]),
+								_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+		__m256 root = _mm256_sqrt_ps(det);	//NaN when there is no solution
+		__m256 t0 = _mm256_sub_ps(b, root);
+		__m256 t1 = _mm256_add_ps(b, root);
+		__m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, zero, _CMP_GT_OQ));
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+		__m256 hit = _mm256_and_ps(valid, _mm256_or_ps(_mm256_cmp_ps(t, best_t, _CMP_LT_OQ),
+									_mm256_and_ps(_mm256_cmp_ps(t, best_t, _CMP_EQ_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(best_o, order)))));
+		COUNT(stats->sphere_hits += __builtin_popcount(_mm256_movemask_ps(valid)));
+		best_t = _mm256_blendv_ps(best_t, t, hit);
+		best_i = _mm256_blendv_epi8(best_i, index, _mm256_castps_si256(hit));
+		best_o = _mm256_blendv_epi8(best_o, order, _mm256_castps_si256(hit));
+	}
+	_mm256_storeu_ps(lane_t, best_t);
+	_mm256_storeu_si256((__m256i*)lane_i, best_i);
+	merge_float_lanes(lane_t, lane_i, 8, scene->sphere_order, scene->sphere_color, best);
+}
+
+__attribute__((target("avx2")))
+static void planes_avx2_float(const Scene* scene, const double* Rd, Hit* best, RayStats* stats){	//Tests eight planes per instruction
+	__m256 zero = _mm256_setzero_ps();
+	__m256 rd0 = _mm256_set1_ps(Rd[0]), rd1 = _mm256_set1_ps(Rd[1]), rd2 = _mm256_set1_ps(Rd[2]);
+	__m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256 best_t = _mm256_set1_ps(INFINITY);
+	__m256i best_i = _mm256_set1_epi32(-1);
+	float lane_t[8];
+	int lane_i[8];
+	int i;
+	
+	COUNT(stats->plane_calls += scene->plane_objects);
+	for(i = 0; i < scene->num_planes; i += 8){	//The float plane arrays are padded to a multiple of FLOAT_WIDTH
+		__m256 den = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rd0, _mm256_load_ps(&scene->plane_nxf[i])),
+								_mm256_mul_ps(rd1, _mm256_load_ps(&scene->plane_nyf[i]))), _mm256_mul_ps(rd2, _mm256_load_ps(&scene->plane_nzf[i])));
+		__m256 t = _mm256_div_ps(_mm256_load_ps(&scene->plane_numf[i]), den);
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, best_t, _CMP_LT_OQ));
+		COUNT(stats->plane_hits += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ))));
+		best_t = _mm256_blendv_ps(best_t, t, hit);
+		best_i = _mm256_blendv_epi8(best_i, _mm256_add_epi32(lane, _mm256_set1_epi32(i)), _mm256_castps_si256(hit));
+	}
+	_mm256_storeu_ps(lane_t, best_t);
+	_mm256_storeu_si256((__m256i*)lane_i, best_i);
+	merge_float_lanes(lane_t, lane_i, 8, scene->plane_order, scene->plane_color, best);
+}
+#endif
+
+static const Kernels kernel_table[] = {	//Every kernel set this build has, fastest last
+	{"scalar", spheres_scalar, planes_scalar, instanced_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+	{"sse", spheres_sse, planes_sse, instanced_sse},
+	{"avx2", spheres_avx2, planes_avx2, instanced_avx2},
+#endif
+};
+
+//The same sets for --precision float, in the same order. Instanced spheres stay in double: they are moved into place
+//per ray, and rounding T + s*position to float would shift them by more than the float kernels' error budget
+static const Kernels float_kernel_table[] = {
+	{"scalar", spheres_scalar_float, planes_scalar_float, instanced_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+	{"sse", spheres_sse_float, planes_sse_float, instanced_sse},
+	{"avx2", spheres_avx2_float, planes_avx2_float, instanced_avx2},
+#endif
+};
+
+static int kernel_supported(const Kernels* kernels){	//Checks that the CPU we are running on can execute a kernel set
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(strcmp(kernels->name, "sse") == 0) return __builtin_cpu_supports("sse2");
+	if(strcmp(kernels->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+	return strcmp(kernels->name, "scalar") == 0;
+}
+
+static const Kernels* select_kernels(const char* name, int precision){	//Returns the named kernel set, or the fastest supported one for "auto"
+	const Kernels* table = precision == PRECISION_FLOAT ? float_kernel_table : kernel_table;
+	int count = sizeof(kernel_table)/sizeof(kernel_table[0]);
+	int i;
+	if(strcmp(name, "auto") == 0){
+		for(i = count - 1; i > 0; i--){
+			if(kernel_supported(&table[i])) return &table[i];
+		}
+		return &table[0];
+	}
+	for(i = 0; i < count; i++){
+		if(strcmp(table[i].name, name) == 0){
+			if(!kernel_supported(&table[i])){
+				fail(RAYCAST_ERROR_ARGUMENT, "This CPU does not support the %s kernels", name);
+			}
+			return &table[i];
+		}
+	}
+	fail(RAYCAST_ERROR_ARGUMENT, "Unknown kernel \"%s\"", name);
+}
+
+static double now_seconds(){	//Monotonic wall clock time, used for the --stats timings
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 8
+#define BVH_SAH_DEPTH 64	//Past this depth the builder falls back to median splits, which bounds the traversal stack
+#define BVH_STACK 128
+
+typedef struct {	//Axis aligned box used while building the BVH
+	double min[3];
+	double max[3];
+} Box;
+
+typedef struct {	//Working state of build_bvh()
+	double* bounds_min;	//Three values per sphere
+	double* bounds_max;
+	double* centroid;
+	int* index;	//Permutation of the spheres, partitioned in place as the tree is built
+	BVHNode* nodes;
+	int num_nodes;
+	int max_depth;
+	int num_leaves;
+	Owned owned;	//The arrays, until finish_bvh_builder()
+} BVHBuilder;
+
+static void box_empty(Box* box){
+	int i;
+	for(i = 0; i < 3; i++){
+		box->min[i] = INFINITY;
+		box->max[i] = -INFINITY;
+	}
+}
+
+static void box_grow(Box* box, const double* min, const double* max){	//Grows box to enclose min and max
+	int i;
+	for(i = 0; i < 3; i++){
+		if(min[i] < box->min[i]) box->min[i] = min[i];
+		if(max[i] > box->max[i]) box->max[i] = max[i];
+	}
+}
+
+static double box_area(const Box* box){	//Half of the surface area, which is all the SAH needs
+	double dx = box->max[0] - box->min[0];
+	double dy = box->max[1] - box->min[1];
+	double dz = box->max[2] - box->min[2];
+	if(dx < 0) return 0;
+	return dx*dy + dy*dz + dz*dx;
+}
+
+static float round_down(double v){	//Nearest float at or below v, so float node bounds never shrink a box
+	float f = (float)v;
+	if(f > v) f = nextafterf(f, -INFINITY);
+	return f;
+}
+
+static float round_up(double v){
+	float f = (float)v;
+	if(f < v) f = nextafterf(f, INFINITY);
+	return f;
+}
+
+static void sphere_bounds(double x, double y, double z, double radius, double* min, double* max){	//Box around one sphere
+	//Pad each box a little so rounding in sphere_intersection() can never find a hit outside of it
+	double pad = (fabs(x) + fabs(y) + fabs(z) + fabs(radius))*1e-6;
+	min[0] = x - fabs(radius) - pad;
+	min[1] = y - fabs(radius) - pad;
+	min[2] = z - fabs(radius) - pad;
+	max[0] = x + fabs(radius) + pad;
+	max[1] = y + fabs(radius) + pad;
+	max[2] = z + fabs(radius) + pad;
+}
+
+static int build_bvh_node(BVHBuilder* builder, int first, int count, int depth){	//Builds the subtree for index[first..first+count), returns its node
+	int node = builder->num_nodes++;
+	int* index = builder->index;
+	Box bounds;
+	Box centroids;
+	Box bin_bounds[BVH_BINS];
+	int bin_count[BVH_BINS];
+	double left_area[BVH_BINS];
+	int left_count[BVH_BINS];
+	double best_cost = INFINITY;
+	int best_split = -1;
+	int axis = 0;
+	int mid;
+	int i;
+	int j;
+	
+	box_empty(&bounds);
+	box_empty(&centroids);
+	for(i = first; i < first + count; i++){
+		box_grow(&bounds, &builder->bounds_min[3*index[i]], &builder->bounds_max[3*index[i]]);
+		box_grow(&centroids, &builder->centroid[3*index[i]], &builder->centroid[3*index[i]]);
+	}
+	for(i = 0; i < 3; i++){
+		builder->nodes[node].min[i] = round_down(bounds.min[i]);
+		builder->nodes[node].max[i] = round_up(bounds.max[i]);
+	}
+	if(depth > builder->max_depth) builder->max_depth = depth;
+	
+	for(i = 1; i < 3; i++){	//Split along the axis where the centroids are spread the furthest
+		if(centroids.max[i] - centroids.min[i] > centroids.max[axis] - centroids.min[axis]) axis = i;
+	}
+	
+	if(count > 2 && centroids.max[axis] > centroids.min[axis] && depth < BVH_SAH_DEPTH){	//Binned SAH split
+		double scale = BVH_BINS/(centroids.max[axis] - centroids.min[axis]);
+		Box sweep;
+		int running = 0;
+		for(i = 0; i < BVH_BINS; i++){
+			box_empty(&bin_bounds[i]);
+			bin_count[i] = 0;
+		}
+		for(i = first; i < first + count; i++){
+			int bin = (int)((builder->centroid[3*index[i] + axis] - centroids.min[axis])*scale);
+			if(bin >= BVH_BINS) bin = BVH_BINS - 1;
+			bin_count[bin]++;
+			box_grow(&bin_bounds[bin], &builder->bounds_min[3*index[i]], &builder->bounds_max[3*index[i]]);
+		}
+		box_empty(&sweep);
+		for(i = 0; i < BVH_BINS - 1; i++){	//Sweep from the left, then score each split while sweeping from the right
+			box_grow(&sweep, bin_bounds[i].min, bin_bounds[i].max);
+			running += bin_count[i];
+			left_area[i] = box_area(&sweep);
+			left_count[i] = running;
+		}
+		box_empty(&sweep);
+		running = 0;
+		for(i = BVH_BINS - 1; i > 0; i--){
+			double cost;
+			box_grow(&sweep, bin_bounds[i].min, bin_bounds[i].max);
+			running += bin_count[i];
+			if(left_count[i - 1] == 0 || running == 0) continue;
+			cost = left_area[i - 1]*left_count[i - 1] + box_area(&sweep)*running;
+			if(cost < best_cost){
+				best_cost = cost;
+				best_split = i;
+			}
+		}
+		//Traversing a node costs about as much as one sphere test
+		best_cost = box_area(&bounds) + best_cost;
+		if(count <= BVH_MAX_LEAF && best_cost >= box_area(&bounds)*count){
+			best_split = -1;
+		}
+	}
+	
+	if(best_split < 0 && count <= BVH_MAX_LEAF){	//Make a leaf
+		builder->nodes[node].offset = first;
+		builder->nodes[node].count = count;
+		builder->num_leaves++;
+		return node;
+	}
+	
+	if(best_split >= 0){	//Partition the spheres around the chosen bin boundary
+		double scale = BVH_BINS/(centroids.max[axis] - centroids.min[axis]);
+		i = first;
+		j = first + count - 1;
+		while(i <= j){
+			int bin = (int)((builder->centroid[3*index[i] + axis] - centroids.min[axis])*scale);
+			if(bin >= BVH_BINS) bin = BVH_BINS - 1;
+			if(bin < best_split){
+				i++;
+			}else{
+				int temp = index[i];
+				index[i] = index[j];
+				index[j--] = temp;
+			}
+		}
+		mid = i;
+	}else{	//Too many spheres for a leaf but no useful SAH split, split at the median index instead
+		mid = first + count/2;
+	}
+	
+	build_bvh_node(builder, first, mid - first, depth + 1);	//The left child is always the next node
+	builder->nodes[node].offset = build_bvh_node(builder, mid, first + count - mid, depth + 1);
+	builder->nodes[node].count = 0;
+	return node;
+}
+
+static void release_bvh_builder(void* input){	//Frees the builder's arrays, nodes included, when the build failed
+	BVHBuilder* builder = input;
+	free(builder->bounds_min);
+	free(builder->bounds_max);
+	free(builder->centroid);
+	free(builder->nodes);
+}
+
+//Allocates the builder for n boxes, filled in by the caller. The arrays belong to the innermost trap until
+//finish_bvh_builder(), so the builder must live in the caller's frame.
+static void init_bvh_builder(BVHBuilder* builder, int n, int* permutation){
+	int i;
+	builder->bounds_min = malloc(sizeof(double)*3*n + 1);
+	builder->bounds_max = malloc(sizeof(double)*3*n + 1);
+	builder->centroid = malloc(sizeof(double)*3*n + 1);
+	builder->index = permutation;
+	builder->nodes = malloc(sizeof(BVHNode)*(2*n + 1));
+	builder->num_nodes = 0;
+	builder->max_depth = 0;
+	builder->num_leaves = 0;
+	if(builder->bounds_min == NULL || builder->bounds_max == NULL || builder->centroid == NULL || builder->nodes == NULL){
+		release_bvh_builder(builder);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory building the BVH");
+	}
+	own(&builder->owned, release_bvh_builder, builder);
+	for(i = 0; i < n; i++){
+		permutation[i] = i;
+	}
+}
+
+static void finish_bvh_builder(BVHBuilder* builder, int n){	//Builds the tree over the n boxes and frees the working arrays
+	if(n > 0){
+		build_bvh_node(builder, 0, n, 0);
+	}
+	disown(&builder->owned);	//The caller takes the nodes
+	free(builder->bounds_min);
+	free(builder->bounds_max);
+	free(builder->centroid);
+}
+
+static void build_bvh(Scene* scene, double* x, double* y, double* z, double* radius, int* permutation){	//Builds the BVH and returns the leaf order of the spheres
+	BVHBuilder builder;
+	int n = scene->num_spheres;
+	double start = now_seconds();
+	int i;
+	
+	init_bvh_builder(&builder, n, permutation);
+	for(i = 0; i < n; i++){
+		sphere_bounds(x[i], y[i], z[i], radius[i], &builder.bounds_min[3*i], &builder.bounds_max[3*i]);
+		builder.centroid[3*i] = x[i];
+		builder.centroid[3*i + 1] = y[i];
+		builder.centroid[3*i + 2] = z[i];
+	}
+	finish_bvh_builder(&builder, n);
+	
+	scene->bvh_nodes = builder.nodes;
+	scene->num_nodes = builder.num_nodes;
+	scene->bvh_depth = builder.max_depth;
+	scene->bvh_leaves = builder.num_leaves;
+	scene->bvh_build_time = now_seconds() - start;
+}
+
+static void bake_sphere(Scene* scene, int i){	//Precomputes the part of sphere_intersection() that no ray changes
+	double x = scene->sphere_x[i];
+	double y = scene->sphere_y[i];
+	double z = scene->sphere_z[i];
+	scene->sphere_c[i] = (x*x + y*y + z*z) - scene->sphere_radius[i]*scene->sphere_radius[i];
+	if(scene->sphere_r2f != NULL){
+		scene->sphere_xf[i] = x;
+		scene->sphere_yf[i] = y;
+		scene->sphere_zf[i] = z;
+		scene->sphere_r2f[i] = scene->sphere_radius[i]*scene->sphere_radius[i];
+	}
+}
+
+static void bake_plane(Scene* scene, int i){	//Precomputes the numerator of plane_intersection()
+	scene->plane_num[i] = scene->plane_nx[i]*scene->plane_x[i] + scene->plane_ny[i]*scene->plane_y[i]
+						+ scene->plane_nz[i]*scene->plane_z[i];
+	if(scene->plane_numf != NULL){
+		scene->plane_nxf[i] = scene->plane_nx[i];
+		scene->plane_nyf[i] = scene->plane_ny[i];
+		scene->plane_nzf[i] = scene->plane_nz[i];
+		scene->plane_numf[i] = scene->plane_num[i];
+	}
+}
+
+//Makes the single precision arrays --precision float renders from. The baked values are computed in double and
+//rounded once. Padding stays NaN like in the double arrays.
+static void bake_float_scene(Scene* scene){
+	int i;
+	scene->sphere_xf = aligned_floats(scene->num_spheres);
+	scene->sphere_yf = aligned_floats(scene->num_spheres);
+	scene->sphere_zf = aligned_floats(scene->num_spheres);
+	scene->sphere_r2f = aligned_floats(scene->num_spheres);
+	for(i = 0; i < scene->num_spheres; i++){
+		scene->sphere_xf[i] = scene->sphere_x[i];
+		scene->sphere_yf[i] = scene->sphere_y[i];
+		scene->sphere_zf[i] = scene->sphere_z[i];
+		scene->sphere_r2f[i] = scene->sphere_radius[i]*scene->sphere_radius[i];
+	}
+	scene->plane_nxf = aligned_floats(scene->num_planes);
+	scene->plane_nyf = aligned_floats(scene->num_planes);
+	scene->plane_nzf = aligned_floats(scene->num_planes);
+	scene->plane_numf = aligned_floats(scene->num_planes);
+	for(i = 0; i < scene->num_planes; i++){
+		scene->plane_nxf[i] = scene->plane_nx[i];
+		scene->plane_nyf[i] = scene->plane_ny[i];
+		scene->plane_nzf[i] = scene->plane_nz[i];
+		scene->plane_numf[i] = scene->plane_num[i];
+	}
+}
+
+//Builds the BVH over num_spheres spheres and stores them in its leaf order. Sphere k is objects[source[k]], and its order
+//is source[k].
+static void pack_spheres(Scene* scene, Object** objects, const int* source, int num_spheres){
+	double* x = malloc(sizeof(double)*4*num_spheres + 1);	//x, y, z and radius in one block
+	double* y;
+	double* z;
+	double* radius;
+	int* permutation = malloc(sizeof(int)*num_spheres + 1);
+	Owned owned[2];
+	int i;
+	
+	if(x == NULL || permutation == NULL){
+		free(x);
+		free(permutation);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	own(&owned[0], free, x);
+	own(&owned[1], free, permutation);
+	y = x + num_spheres;
+	z = y + num_spheres;
+	radius = z + num_spheres;
+	for(i = 0; i < num_spheres; i++){
+		x[i] = objects[source[i]]->sphere.position[0];
+		y[i] = objects[source[i]]->sphere.position[1];
+		z[i] = objects[source[i]]->sphere.position[2];
+		radius[i] = objects[source[i]]->sphere.radius;
+	}
+	scene->num_spheres = num_spheres;
+	build_bvh(scene, x, y, z, radius, permutation);
+	
+	scene->sphere_x = aligned_array(num_spheres);
+	scene->sphere_y = aligned_array(num_spheres);
+	scene->sphere_z = aligned_array(num_spheres);
+	scene->sphere_radius = aligned_array(num_spheres);
+	scene->sphere_c = aligned_array(num_spheres);
+	scene->sphere_color = aligned_array(3*num_spheres);
+	scene->sphere_order = allocate(sizeof(int)*(num_spheres + FLOAT_WIDTH));
+	for(i = 0; i < num_spheres; i++){
+		int from = permutation[i];
+		scene->sphere_x[i] = x[from];
+		scene->sphere_y[i] = y[from];
+		scene->sphere_z[i] = z[from];
+		scene->sphere_radius[i] = radius[from];
+		memcpy(&scene->sphere_color[3*i], objects[source[from]]->sphere.color, sizeof(double)*3);
+		scene->sphere_order[i] = source[from];
+		bake_sphere(scene, i);
+	}
+	for(i = num_spheres; i < num_spheres + SIMD_WIDTH; i++){	//Vector loads may read just past the last sphere
+		scene->sphere_x[i] = scene->sphere_y[i] = scene->sphere_z[i] = NAN;
+		scene->sphere_radius[i] = 0;
+		scene->sphere_c[i] = NAN;
+	}
+	for(i = num_spheres; i < num_spheres + FLOAT_WIDTH; i++){	//The orders are read a vector at a time too, by the float kernels as well
+		scene->sphere_order[i] = 0;
+	}
+	disown(&owned[1]);
+	disown(&owned[0]);
+	free(x);
+	free(permutation);
+}
+
+//Builds each group once, in its own coordinates, and a BVH over the boxes of the instances that place copies of it.
+//Memory grows with the spheres of the groups plus a few values per instance, not with the spheres that get drawn.
+static void build_instances(Object** object_array, int object_counter, Scene* scene){
+	BVHBuilder builder;
+	double start = now_seconds();
+	double* x;
+	double* y;
+	double* z;
+	double* scale;
+	int* group;
+	int* source;
+	int* permutation;
+	Owned owned[2];
+	int num_instances = 0;
+	int i;
+	int j;
+	int k;
+	
+	for(i = 1; i < object_counter + 1; i++){
+		if(object_array[i]->kind == 3){
+			object_array[i]->group.index = scene->num_groups++;
+		}else if(object_array[i]->kind == 4){
+			num_instances++;
+		}
+	}
+	scene->groups = calloc(scene->num_groups + 1, sizeof(Scene));
+	if(scene->groups == NULL){
+		scene->num_groups = 0;	//So free_scene() does not look for them
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	for(i = 1; i < object_counter + 1; i++){	//A group's spheres are ordered by their place in its objects list
+		if(object_array[i]->kind == 3){
+			Object* object = object_array[i];
+			int* members = allocate(sizeof(int)*object->group.num_spheres + 1);
+			own(&owned[0], free, members);
+			for(j = 0; j < object->group.num_spheres; j++){
+				members[j] = j;
+			}
+			pack_spheres(&scene->groups[object->group.index], object->group.spheres, members, object->group.num_spheres);
+			disown(&owned[0]);
+			free(members);
+		}
+	}
+	
+	x = malloc(sizeof(double)*4*num_instances + 1);	//x, y, z and scale in one block
+	group = malloc(sizeof(int)*3*num_instances + 1);	//group, source and permutation in another
+	if(x == NULL || group == NULL){
+		free(x);
+		free(group);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	own(&owned[0], free, x);
+	own(&owned[1], free, group);
+	y = x + num_instances;
+	z = y + num_instances;
+	scale = z + num_instances;
+	source = group + num_instances;
+	permutation = source + num_instances;
+	init_bvh_builder(&builder, num_instances, permutation);
+	num_instances = 0;
+	for(i = 1; i < object_counter + 1; i++){
+		if(object_array[i]->kind == 4){
+			Object* object = object_array[i];
+			const BVHNode* root = &scene->groups[object->instance.group->group.index].bvh_nodes[0];
+			double* min = &builder.bounds_min[3*num_instances];
+			double* max = &builder.bounds_max[3*num_instances];
+			double pad;
+			x[num_instances] = object->instance.position[0];
+			y[num_instances] = object->instance.position[1];
+			z[num_instances] = object->instance.position[2];
+			scale[num_instances] = object->instance.scale;
+			group[num_instances] = object->instance.group->group.index;
+			source[num_instances] = i;
+			//The group's root box, scaled and moved, padded like sphere_bounds() for the rounding in doing so
+			pad = (fabs(object->instance.position[0]) + fabs(object->instance.position[1]) + fabs(object->instance.position[2]))*1e-6;
+			for(k = 0; k < 3; k++){
+				min[k] = object->instance.position[k] + object->instance.scale*root->min[k];
+				max[k] = object->instance.position[k] + object->instance.scale*root->max[k];
+				pad += (fabs(min[k]) + fabs(max[k]))*1e-6;
+			}
+			for(k = 0; k < 3; k++){
+				min[k] -= pad;
+				max[k] += pad;
+				builder.centroid[3*num_instances + k] = (min[k] + max[k])/2;
+			}
+			num_instances++;
+		}
+	}
+	finish_bvh_builder(&builder, num_instances);
+	scene->instance_nodes = builder.nodes;
+	scene->num_instance_nodes = builder.num_nodes;
+	
+	scene->num_instances = num_instances;
+	scene->instance_x = allocate(sizeof(double)*num_instances + 1);
+	scene->instance_y = allocate(sizeof(double)*num_instances + 1);
+	scene->instance_z = allocate(sizeof(double)*num_instances + 1);
+	scene->instance_scale = allocate(sizeof(double)*num_instances + 1);
+	scene->instance_group = allocate(sizeof(int)*num_instances + 1);
+	scene->instance_order = allocate(sizeof(int)*num_instances + 1);
+	for(i = 0; i < num_instances; i++){	//Store the instances in leaf order
+		int from = permutation[i];
+		scene->instance_x[i] = x[from];
+		scene->instance_y[i] = y[from];
+		scene->instance_z[i] = z[from];
+		scene->instance_scale[i] = scale[from];
+		scene->instance_group[i] = group[from];
+		scene->instance_order[i] = source[from];
+	}
+	disown(&owned[1]);
+	disown(&owned[0]);
+	free(x);
+	free(group);
+	scene->instance_build_time = now_seconds() - start;
+}
+
+static void build_scene(Object** object_array, int object_counter, Scene* scene){	//Packs object_array into the structure-of-arrays scene
+	int num_spheres = 0;
+	int num_planes = 0;
+	int padded_planes;
+	int* source;
+	Owned owned;
+	int i;
+	
+	memset(scene, 0, sizeof(Scene));
+	if(object_array[0]->kind != 0){	//If camera is not present, throw an error
+		fail(RAYCAST_ERROR_INPUT, "You must have one object of type camera");
+	}
+	scene->camera_width = object_array[0]->camera.width;
+	scene->camera_height = object_array[0]->camera.height;
+	
+	for(i = 1; i < object_counter + 1; i++){	//Count each kind so the arrays can be sized up front
+		if(object_array[i]->kind == 1){
+			num_spheres++;
+		}else if(object_array[i]->kind == 2){
+			num_planes++;
+		}else if(object_array[i]->kind != 0 && object_array[i]->kind != 3 && object_array[i]->kind != 4){	//Other cameras are skipped
+			fail(RAYCAST_ERROR_INPUT, "Unknown Object");
+		}
+	}
+	padded_planes = (num_planes + SIMD_WIDTH - 1)/SIMD_WIDTH*SIMD_WIDTH;
+	scene->plane_objects = num_planes;
+	
+	//Gather the spheres in file order, build the BVH over them, then store them in leaf order
+	source = allocate(sizeof(int)*num_spheres + 1);
+	own(&owned, free, source);
+	num_spheres = 0;
+	for(i = 1; i < object_counter + 1; i++){
+		if(object_array[i]->kind == 1){
+			source[num_spheres++] = i;
+		}
+	}
+	pack_spheres(scene, object_array, source, num_spheres);
+	disown(&owned);
+	free(source);
+	build_instances(object_array, object_counter, scene);
+	
+	scene->plane_x = aligned_array(padded_planes);
+	scene->plane_y = aligned_array(padded_planes);
+	scene->plane_z = aligned_array(padded_planes);
+	scene->plane_nx = aligned_array(padded_planes);
+	scene->plane_ny = aligned_array(padded_planes);
+	scene->plane_nz = aligned_array(padded_planes);
+	scene->plane_num = aligned_array(padded_planes);
+	scene->plane_color = aligned_array(3*padded_planes);
+	scene->plane_order = allocate(sizeof(int)*(padded_planes + 1));
+	num_planes = 0;
+	for(i = 1; i < object_counter + 1; i++){
+		if(object_array[i]->kind == 2){
+			scene->plane_x[num_planes] = object_array[i]->plane.position[0];
+			scene->plane_y[num_planes] = object_array[i]->plane.position[1];
+			scene->plane_z[num_planes] = object_array[i]->plane.position[2];
+			scene->plane_nx[num_planes] = object_array[i]->plane.normal[0];
+			scene->plane_ny[num_planes] = object_array[i]->plane.normal[1];
+			scene->plane_nz[num_planes] = object_array[i]->plane.normal[2];
+			memcpy(&scene->plane_color[3*num_planes], object_array[i]->plane.color, sizeof(double)*3);
+			scene->plane_order[num_planes] = i;
+			bake_plane(scene, num_planes++);
+		}
+	}
+	//Padding planes have NaN positions and normals, so their t is NaN and never counts as a hit
+	for(; num_planes < padded_planes; num_planes++){
+		scene->plane_x[num_planes] = scene->plane_y[num_planes] = scene->plane_z[num_planes] = NAN;
+		scene->plane_nx[num_planes] = scene->plane_ny[num_planes] = scene->plane_nz[num_planes] = NAN;
+		scene->plane_num[num_planes] = NAN;
+		scene->plane_order[num_planes] = 0;
+	}
+	scene->num_planes = padded_planes;
+}
+
+static void translate_nodes(BVHNode* nodes, const BVHNode* from, int num_nodes, const double* position){	//Moves boxes by -position
+	//Hits are now found in the moved coordinates, so pad the boxes for rounding at the size of the move as well
+	double pad = (fabs(position[0]) + fabs(position[1]) + fabs(position[2]))*1e-6;
+	int i;
+	int k;
+	for(i = 0; i < num_nodes; i++){
+		nodes[i] = from[i];
+		for(k = 0; k < 3; k++){
+			nodes[i].min[k] = round_down(from[i].min[k] - position[k] - pad);
+			nodes[i].max[k] = round_up(from[i].max[k] - position[k] + pad);
+		}
+	}
+}
+
+//Makes view, a copy of a built scene as seen from a camera at position, so the ray origin is the origin again. Only
+//the arrays that hold positions are copied and moved, the rest (colors, orders, the groups and the BVH layout) are
+//shared with scene. The float copy and bins are not made, see bake_float_scene() and build_bins().
+static void translate_scene(const Scene* scene, const double* position, Scene* view){
+	int i;
+	
+	*view = *scene;
+	view->sphere_xf = view->sphere_yf = view->sphere_zf = view->sphere_r2f = NULL;
+	view->plane_nxf = view->plane_nyf = view->plane_nzf = view->plane_numf = NULL;
+	view->bins = NULL;
+	view->sphere_x = view->sphere_y = view->sphere_z = view->sphere_c = NULL;	//So a view that failed part way can be freed
+	view->plane_x = view->plane_y = view->plane_z = view->plane_num = NULL;
+	view->instance_x = view->instance_y = view->instance_z = NULL;
+	view->bvh_nodes = view->instance_nodes = NULL;
+	
+	view->sphere_x = aligned_array(scene->num_spheres);
+	view->sphere_y = aligned_array(scene->num_spheres);
+	view->sphere_z = aligned_array(scene->num_spheres);
+	view->sphere_c = aligned_array(scene->num_spheres);
+	for(i = 0; i < scene->num_spheres; i++){
+		view->sphere_x[i] = scene->sphere_x[i] - position[0];
+		view->sphere_y[i] = scene->sphere_y[i] - position[1];
+		view->sphere_z[i] = scene->sphere_z[i] - position[2];
+		bake_sphere(view, i);
+	}
+	for(i = scene->num_spheres; i < scene->num_spheres + SIMD_WIDTH; i++){
+		view->sphere_x[i] = view->sphere_y[i] = view->sphere_z[i] = view->sphere_c[i] = NAN;
+	}
+	view->bvh_nodes = allocate(sizeof(BVHNode)*scene->num_nodes + 1);
+	translate_nodes(view->bvh_nodes, scene->bvh_nodes, scene->num_nodes, position);
+	
+	view->plane_x = aligned_array(scene->num_planes);
+	view->plane_y = aligned_array(scene->num_planes);
+	view->plane_z = aligned_array(scene->num_planes);
+	view->plane_num = aligned_array(scene->num_planes);
+	for(i = 0; i < scene->num_planes; i++){	//Padding planes stay NaN
+		view->plane_x[i] = scene->plane_x[i] - position[0];
+		view->plane_y[i] = scene->plane_y[i] - position[1];
+		view->plane_z[i] = scene->plane_z[i] - position[2];
+		bake_plane(view, i);
+	}
+	
+	view->instance_x = allocate(sizeof(double)*scene->num_instances + 1);
+	view->instance_y = allocate(sizeof(double)*scene->num_instances + 1);
+	view->instance_z = allocate(sizeof(double)*scene->num_instances + 1);
+	for(i = 0; i < scene->num_instances; i++){	//Groups keep their own coordinates, only the instances move
+		view->instance_x[i] = scene->instance_x[i] - position[0];
+		view->instance_y[i] = scene->instance_y[i] - position[1];
+		view->instance_z[i] = scene->instance_z[i] - position[2];
+	}
+	view->instance_nodes = allocate(sizeof(BVHNode)*scene->num_instance_nodes + 1);
+	translate_nodes(view->instance_nodes, scene->instance_nodes, scene->num_instance_nodes, position);
+}
+
+static void free_float_scene(Scene* scene){	//Frees what bake_float_scene() made
+	free(scene->sphere_xf);
+	free(scene->sphere_yf);
+	free(scene->sphere_zf);
+	free(scene->sphere_r2f);
+	free(scene->plane_nxf);
+	free(scene->plane_nyf);
+	free(scene->plane_nzf);
+	free(scene->plane_numf);
+}
+
+static void free_translated_scene(Scene* view){	//Frees what translate_scene() and bake_float_scene() made for a view
+	free(view->sphere_x);
+	free(view->sphere_y);
+	free(view->sphere_z);
+	free(view->sphere_c);
+	free(view->bvh_nodes);
+	free(view->plane_x);
+	free(view->plane_y);
+	free(view->plane_z);
+	free(view->plane_num);
+	free(view->instance_x);
+	free(view->instance_y);
+	free(view->instance_z);
+	free(view->instance_nodes);
+	free_float_scene(view);
+}
+
+//Frees what build_scene() made, or unmaps the file of a compiled scene. Also takes a scene build_scene() failed part
+//way through, it clears the scene before allocating anything. Views, float copies and bins belong to whoever made them.
+static void free_scene(Scene* scene){
+	int i;
+	if(scene->mapping != NULL){
+		munmap(scene->mapping, scene->mapping_size);
+		return;
+	}
+	free(scene->sphere_x);
+	free(scene->sphere_y);
+	free(scene->sphere_z);
+	free(scene->sphere_radius);
+	free(scene->sphere_c);
+	free(scene->sphere_color);
+	free(scene->sphere_order);
+	free(scene->bvh_nodes);
+	free(scene->plane_x);
+	free(scene->plane_y);
+	free(scene->plane_z);
+	free(scene->plane_nx);
+	free(scene->plane_ny);
+	free(scene->plane_nz);
+	free(scene->plane_num);
+	free(scene->plane_color);
+	free(scene->plane_order);
+	free(scene->instance_x);
+	free(scene->instance_y);
+	free(scene->instance_z);
+	free(scene->instance_scale);
+	free(scene->instance_group);
+	free(scene->instance_order);
+	free(scene->instance_nodes);
+	for(i = 0; scene->groups != NULL && i < scene->num_groups; i++){
+		free_scene(&scene->groups[i]);
+	}
+	free(scene->groups);
+}
+
+//A .rcs file is a compiled scene: the arrays of a built Scene, BVH included, written out as they are in memory so
+//load_compiled_scene() can map the file and render from it without parsing or copying anything. Produce one with
+//raycast --compile scene.json scene.rcs. The layout depends on the Scene arrays, so RCS_VERSION changes with them.
+#define RCS_MAGIC "RAYCAST"
+#define RCS_VERSION 3
+#define RCS_BYTE_ORDER 0x01020304
+#define RCS_ALIGN 64	//Every array starts on a cache line, the plane kernels need at least 32 bytes
+#define RCS_ARRAYS 17
+
+typedef struct {	//Start of a .rcs file, the arrays follow at the given offsets
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;	//RCS_BYTE_ORDER as the compiling machine stores it
+	uint64_t file_size;
+	double camera_width;
+	double camera_height;
+	int32_t num_objects;
+	int32_t num_spheres;
+	int32_t num_planes;
+	int32_t plane_objects;
+	int32_t num_nodes;
+	int32_t bvh_depth;
+	int32_t bvh_leaves;
+	int32_t reserved;
+	uint64_t offset[RCS_ARRAYS];
+} RcsHeader;
+
+static void scene_arrays(Scene* scene, void*** arrays, size_t* sizes){	//Lists every array of a scene and its size in bytes
+	int n = scene->num_spheres + SIMD_WIDTH;	//Sphere arrays include the NaN padding the vector loads read
+	int i = 0;
+	arrays[i] = (void**)&scene->sphere_x;	sizes[i++] = sizeof(double)*n;
+	arrays[i] = (void**)&scene->sphere_y;	sizes[i++] = sizeof(double)*n;
+	arrays[i] = (void**)&scene->sphere_z;	sizes[i++] = sizeof(double)*n;
+	arrays[i] = (void**)&scene->sphere_radius;	sizes[i++] = sizeof(double)*n;
+	arrays[i] = (void**)&scene->sphere_c;	sizes[i++] = sizeof(double)*n;
+	arrays[i] = (void**)&scene->sphere_color;	sizes[i++] = sizeof(double)*3*scene->num_spheres;
+	arrays[i] = (void**)&scene->sphere_order;	sizes[i++] = sizeof(int)*(scene->num_spheres + FLOAT_WIDTH);
+	arrays[i] = (void**)&scene->bvh_nodes;	sizes[i++] = sizeof(BVHNode)*scene->num_nodes;
+	arrays[i] = (void**)&scene->plane_x;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_y;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_z;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_nx;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_ny;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_nz;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_num;	sizes[i++] = sizeof(double)*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_color;	sizes[i++] = sizeof(double)*3*scene->num_planes;
+	arrays[i] = (void**)&scene->plane_order;	sizes[i++] = sizeof(int)*scene->num_planes;
+}
+
+static void write_compiled_scene(Scene* scene, int num_objects, const char* filename){	//Writes a built scene to a .rcs file
+	static const char zeros[RCS_ALIGN] = {0};
+	RcsHeader header;
+	void** arrays[RCS_ARRAYS];
+	size_t sizes[RCS_ARRAYS];
+	uint64_t offset = (sizeof(RcsHeader) + RCS_ALIGN - 1)/RCS_ALIGN*RCS_ALIGN;
+	FILE* file;
+	int failed;
+	int i;
+	
+	memset(&header, 0, sizeof(RcsHeader));
+	memcpy(header.magic, RCS_MAGIC, sizeof(RCS_MAGIC));
+	header.version = RCS_VERSION;
+	header.byte_order = RCS_BYTE_ORDER;
+	header.camera_width = scene->camera_width;
+	header.camera_height = scene->camera_height;
+	header.num_objects = num_objects;
+	header.num_spheres = scene->num_spheres;
+	header.num_planes = scene->num_planes;
+	header.plane_objects = scene->plane_objects;
+	header.num_nodes = scene->num_nodes;
+	header.bvh_depth = scene->bvh_depth;
+	header.bvh_leaves = scene->bvh_leaves;
+	scene_arrays(scene, arrays, sizes);
+	for(i = 0; i < RCS_ARRAYS; i++){
+		header.offset[i] = offset;
+		offset = (offset + sizes[i] + RCS_ALIGN - 1)/RCS_ALIGN*RCS_ALIGN;
+	}
+	header.file_size = offset;
+	
+	file = fopen(filename, "wb");
+	if(file == NULL){
+		fail(RAYCAST_ERROR_IO, "Could not open output file \"%s\"", filename);
+	}
+	fwrite(&header, sizeof(RcsHeader), 1, file);
+	fwrite(zeros, 1, header.offset[0] - sizeof(RcsHeader), file);
+	for(i = 0; i < RCS_ARRAYS; i++){
+		fwrite(*arrays[i], 1, sizes[i], file);
+		fwrite(zeros, 1, (i + 1 < RCS_ARRAYS ? header.offset[i + 1] : header.file_size) - header.offset[i] - sizes[i], file);
+	}
+	failed = ferror(file);
+	failed |= fclose(file) != 0;
+	if(failed){
+		fail(RAYCAST_ERROR_IO, "Could not write output file \"%s\"", filename);
+	}
+}
+
+//Maps a .rcs file and points the scene's arrays straight into it, free_scene() unmaps it again. Once the file is mapped
+//the scene holds it even if the file turns out to be damaged. Returns the number of objects in the scene the file was
+//compiled from.
+static int load_compiled_scene(const char* filename, Scene* scene, size_t* file_size){
+	RcsHeader header;
+	struct stat info;
+	void** arrays[RCS_ARRAYS];
+	size_t sizes[RCS_ARRAYS];
+	unsigned char* data;
+	int fd = open(filename, O_RDONLY);
+	int i;
+	
+	if(fd < 0){
+		fail(RAYCAST_ERROR_IO, "Could not open file \"%s\"", filename);
+	}
+	if(fstat(fd, &info) != 0){
+		close(fd);
+		fail(RAYCAST_ERROR_IO, "Could not open file \"%s\"", filename);
+	}
+	if((size_t)info.st_size < sizeof(RcsHeader) || read(fd, &header, sizeof(RcsHeader)) != sizeof(RcsHeader)
+		|| memcmp(header.magic, RCS_MAGIC, sizeof(RCS_MAGIC)) != 0){
+		close(fd);
+		fail(RAYCAST_ERROR_INPUT, "\"%s\" is not a compiled scene", filename);
+	}
+	if(header.version != RCS_VERSION || header.byte_order != RCS_BYTE_ORDER){
+		close(fd);
+		fail(RAYCAST_ERROR_INPUT, "\"%s\" was compiled by a different version of raycast, compile it again", filename);
+	}
+	if(header.file_size != (uint64_t)info.st_size || header.num_spheres < 0 || header.num_planes < 0
+		|| header.num_nodes < 0 || header.num_planes % SIMD_WIDTH != 0 || header.bvh_depth >= BVH_STACK/2
+		|| header.plane_objects > header.num_planes || header.camera_width <= 0 || header.camera_height <= 0){
+		close(fd);
+		fail(RAYCAST_ERROR_INPUT, "Compiled scene \"%s\" is damaged", filename);
+	}
+	data = mmap(NULL, header.file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){
+		fail(RAYCAST_ERROR_IO, "Could not map file \"%s\"", filename);
+	}
+	
+	memset(scene, 0, sizeof(Scene));
+	scene->mapping = data;
+	scene->mapping_size = header.file_size;
+	scene->camera_width = header.camera_width;
+	scene->camera_height = header.camera_height;
+	scene->num_spheres = header.num_spheres;
+	scene->num_planes = header.num_planes;
+	scene->plane_objects = header.plane_objects;
+	scene->num_nodes = header.num_nodes;
+	scene->bvh_depth = header.bvh_depth;
+	scene->bvh_leaves = header.bvh_leaves;
+	scene_arrays(scene, arrays, sizes);
+	for(i = 0; i < RCS_ARRAYS; i++){	//Nothing is copied, the arrays are the file
+		if(header.offset[i] % RCS_ALIGN != 0 || header.offset[i] > header.file_size
+			|| sizes[i] > header.file_size - header.offset[i]){
+			fail(RAYCAST_ERROR_INPUT, "Compiled scene \"%s\" is damaged", filename);
+		}
+		*arrays[i] = data + header.offset[i];
+	}
+	for(i = 0; i < scene->num_nodes; i++){	//A bad node would send the traversal outside of the arrays
+		const BVHNode* node = &scene->bvh_nodes[i];
+		if(node->count < 0 || node->offset < 0 || (node->count == 0 && (node->offset <= i + 1 || node->offset >= scene->num_nodes))
+			|| (node->count > 0 && node->offset > scene->num_spheres - node->count)){
+			fail(RAYCAST_ERROR_INPUT, "Compiled scene \"%s\" is damaged", filename);
+		}
+	}
+	*file_size = header.file_size;
+	return header.num_objects;
+}
+
+static inline double ray_enters_box(const BVHNode* node, const double* inverse, const int* flat, double limit){
+	//Slab test of a ray from the camera, returns where the ray enters the box or INFINITY if it misses it before limit.
+	//Only t > 0 can hit, so the part of the line behind the camera is never looked at.
+	double low = 0;
+	double high = limit;
+	double t0;
+	double t1;
+	int i;
+	for(i = 0; i < 3; i++){
+		if(flat[i]){	//Ray is parallel to this slab
+			if(node->min[i] > 0 || node->max[i] < 0) return INFINITY;
+			continue;
+		}
+		t0 = node->min[i]*inverse[i];
+		t1 = node->max[i]*inverse[i];
+		if(t0 > t1){
+			double temp = t0;
+			t0 = t1;
+			t1 = temp;
+		}
+		if(t0 > low) low = t0;
+		if(t1 < high) high = t1;
+	}
+	return low <= high ? low : INFINITY;
+}
+
+static void trace_spheres(const Scene* scene, const Kernels* kernels, const double* Rd, Hit* best,
+					RayStats* stats){	//Walks the BVH front to back and tests the spheres in every leaf the ray reaches
+	int stack[BVH_STACK];
+	double entry[BVH_STACK];	//Where the ray enters each stacked node
+	int top = 0;
+	double inverse[3];
+	int flat[3];
+	const BVHNode* node;
+	int near;
+	int far;
+	double t_near;
+	double t_far;
+	int i;
+	
+	if(scene->num_nodes == 0) return;
+	for(i = 0; i < 3; i++){
+		flat[i] = Rd[i] == 0;
+		inverse[i] = flat[i] ? 0 : 1/Rd[i];
+	}
+	COUNT(stats->nodes_visited++);
+	entry[top] = ray_enters_box(&scene->bvh_nodes[0], inverse, flat, best->t);
+	stack[top++] = 0;
+	while(top > 0){
+		top--;
+		//A node is skipped once a hit in front of it is known, equal t still ties by object order
+		if(entry[top] > best->t) continue;
+		node = &scene->bvh_nodes[stack[top]];
+		if(node->count > 0){
+			COUNT(stats->sphere_tests += node->count);
+			kernels->spheres(scene, node->offset, node->offset + node->count, Rd, best, stats);
+			continue;
+		}
+		near = node - scene->bvh_nodes + 1;
+		far = node->offset;
+		COUNT(stats->nodes_visited += 2);
+		t_near = ray_enters_box(&scene->bvh_nodes[near], inverse, flat, best->t);
+		t_far = ray_enters_box(&scene->bvh_nodes[far], inverse, flat, best->t);
+		if(t_far < t_near){	//Visit the closer child first so its hits can prune the other one
+			int temp = near;
+			double temp_t = t_near;
+			near = far;
+			far = temp;
+			t_near = t_far;
+			t_far = temp_t;
+		}
+		if(t_far != INFINITY){
+			entry[top] = t_far;
+			stack[top++] = far;
+		}
+		if(t_near != INFINITY){
+			entry[top] = t_near;
+			stack[top++] = near;
+		}
+	}
+}
+
+static inline double ray_enters_moved_box(const BVHNode* node, const double* T, double s, const double* inverse, const int* flat,
+										double limit){	//ray_enters_box() for a box scaled by s and then moved by T
+	double low = 0;
+	double high = limit;
+	double t0;
+	double t1;
+	int i;
+	for(i = 0; i < 3; i++){
+		double min = T[i] + s*node->min[i];
+		double max = T[i] + s*node->max[i];
+		if(flat[i]){
+			if(min > 0 || max < 0) return INFINITY;
+			continue;
+		}
+		t0 = min*inverse[i];
+		t1 = max*inverse[i];
+		if(t0 > t1){
+			double temp = t0;
+			t0 = t1;
+			t1 = temp;
+		}
+		if(t0 > low) low = t0;
+		if(t1 < high) high = t1;
+	}
+	return low <= high ? low : INFINITY;
+}
+
+//trace_spheres() through an instance: walks its group's BVH with every box scaled by s and moved by T, so the ray
+//stays in camera space and every t is comparable with the hits found so far
+static void trace_group(const Scene* group, const Kernels* kernels, const double* T, double s, int order, const double* Rd,
+				const double* inverse, const int* flat, double root, Hit* best, RayStats* stats){	//root is where the ray enters the group
+	int stack[BVH_STACK];
+	double entry[BVH_STACK];
+	int top = 0;
+	const BVHNode* node;
+	int near;
+	int far;
+	double t_near;
+	double t_far;
+	
+	entry[top] = root;
+	stack[top++] = 0;
+	while(top > 0){
+		top--;
+		if(entry[top] > best->t) continue;
+		node = &group->bvh_nodes[stack[top]];
+		if(node->count > 0){
+			COUNT(stats->sphere_tests += node->count);
+			kernels->instanced(group, node->offset, node->offset + node->count, T, s, order, Rd, best, stats);
+			continue;
+		}
+		near = node - group->bvh_nodes + 1;
+		far = node->offset;
+		COUNT(stats->nodes_visited += 2);
+		t_near = ray_enters_moved_box(&group->bvh_nodes[near], T, s, inverse, flat, best->t);
+		t_far = ray_enters_moved_box(&group->bvh_nodes[far], T, s, inverse, flat, best->t);
+		if(t_far < t_near){
+			int temp = near;
+			double temp_t = t_near;
+			near = far;
+			far = temp;
+			t_near = t_far;
+			t_far = temp_t;
+		}
+		if(t_far != INFINITY){
+			entry[top] = t_far;
+			stack[top++] = far;
+		}
+		if(t_near != INFINITY){
+			entry[top] = t_near;
+			stack[top++] = near;
+		}
+	}
+}
+
+static void trace_instances(const Scene* scene, const Kernels* kernels, const double* Rd, Hit* best,
+					RayStats* stats){	//Walks the instance BVH front to back and traces the group of every instance the ray reaches
+	int stack[BVH_STACK];
+	double entry[BVH_STACK];
+	int top = 0;
+	double inverse[3];
+	int flat[3];
+	double T[3];
+	double leaf_entry[BVH_MAX_LEAF];	//The leaf's instances that the ray reaches, nearest first
+	int leaf[BVH_MAX_LEAF];
+	const BVHNode* node;
+	int near;
+	int far;
+	double t_near;
+	double t_far;
+	int i;
+	int j;
+	
+	if(scene->num_instance_nodes == 0) return;
+	for(i = 0; i < 3; i++){
+		flat[i] = Rd[i] == 0;
+		inverse[i] = flat[i] ? 0 : 1/Rd[i];
+	}
+	COUNT(stats->nodes_visited++);
+	entry[top] = ray_enters_box(&scene->instance_nodes[0], inverse, flat, best->t);
+	stack[top++] = 0;
+	while(top > 0){
+		top--;
+		if(entry[top] > best->t) continue;
+		node = &scene->instance_nodes[stack[top]];
+		if(node->count > 0){	//Trace the leaf's instances nearest first, their boxes often overlap
+			int count = 0;
+			for(i = node->offset; i < node->offset + node->count; i++){
+				double t;
+				T[0] = scene->instance_x[i];
+				T[1] = scene->instance_y[i];
+				T[2] = scene->instance_z[i];
+				COUNT(stats->nodes_visited++);
+				t = ray_enters_moved_box(&scene->groups[scene->instance_group[i]].bvh_nodes[0], T, scene->instance_scale[i], inverse,
+										flat, best->t);
+				if(t == INFINITY) continue;
+				for(j = count++; j > 0 && leaf_entry[j - 1] > t; j--){
+					leaf_entry[j] = leaf_entry[j - 1];
+					leaf[j] = leaf[j - 1];
+				}
+				leaf_entry[j] = t;
+				leaf[j] = i;
+			}
+			for(j = 0; j < count && leaf_entry[j] <= best->t; j++){
+				i = leaf[j];
+				T[0] = scene->instance_x[i];
+				T[1] = scene->instance_y[i];
+				T[2] = scene->instance_z[i];
+				trace_group(&scene->groups[scene->instance_group[i]], kernels, T, scene->instance_scale[i], scene->instance_order[i],
+							Rd, inverse, flat, leaf_entry[j], best, stats);
+			}
+			continue;
+		}
+		near = node - scene->instance_nodes + 1;
+		far = node->offset;
+		COUNT(stats->nodes_visited += 2);
+		t_near = ray_enters_box(&scene->instance_nodes[near], inverse, flat, best->t);
+		t_far = ray_enters_box(&scene->instance_nodes[far], inverse, flat, best->t);
+		if(t_far < t_near){
+			int temp = near;
+			double temp_t = t_near;
+			near = far;
+			far = temp;
+			t_near = t_far;
+			t_far = temp_t;
+		}
+		if(t_far != INFINITY){
+			entry[top] = t_far;
+			stack[top++] = far;
+		}
+		if(t_near != INFINITY){
+			entry[top] = t_near;
+			stack[top++] = near;
+		}
+	}
+}
+
+#define BIN_SIZE 16	//Width and height in pixels of a --accel bins screen tile
+#define BIN_CHUNK 8	//Spheres of a tile tested between checks for an early exit
+
+typedef struct Bins {	//Spheres sorted into screen tiles by build_bins(), for --accel bins
+	Scene spheres;	//Every tile's spheres, one tile after another, in the layout the kernels read
+	double* near;	//Lower bound on the distance to each sphere, a tile's spheres are sorted by it
+	int* start;	//Tile t holds spheres start[t] to start[t + 1] - 1
+	int tiles_x;
+	int tiles_y;
+	int N;	//Size of the image the tiles cover
+	int M;
+	double build_time;	//Seconds
+} Bins;
+
+//Finds the pixels a sphere can cover as rect = first column, first output row, last column, last output row. The
+//camera is at the origin looking down +Z, so the rays through the image plane x = u z that can touch the sphere have u
+//between the two planes through the y axis that are tangent to it, and the same holds for y. Returns 0 if no pixel
+//can see the sphere. Spheres reaching back to the camera's plane may cover any pixel.
+static int sphere_pixel_rect(const Scene* scene, int N, int M, int i, int* rect){
+	double Cx = scene->sphere_x[i];
+	double Cy = scene->sphere_y[i];
+	double Cz = scene->sphere_z[i];
+	double r = scene->sphere_radius[i];
+	double pixwidth = scene->camera_width/N;
+	double pixheight = scene->camera_height/M;
+	double D = Cz*Cz - r*r;
+	double lo[2];
+	double hi[2];
+	double root;
+	int k;
+	
+	if(Cz + r <= 0) return 0;	//Every point of the sphere is behind the camera
+	if(Cz - r <= 1e-6*(fabs(Cz) + r)){
+		rect[0] = 0;
+		rect[1] = 0;
+		rect[2] = N - 1;
+		rect[3] = M - 1;
+		return 1;
+	}
+	root = r*sqrt(Cx*Cx + D);
+	lo[0] = ((Cx*Cz - root)/D + scene->camera_width/2)/pixwidth;	//In pixels, column x covers [x, x + 1)
+	hi[0] = ((Cx*Cz + root)/D + scene->camera_width/2)/pixwidth;
+	root = r*sqrt(Cy*Cy + D);
+	lo[1] = ((Cy*Cz - root)/D + scene->camera_height/2)/pixheight;	//Counted from the bottom row up
+	hi[1] = ((Cy*Cz + root)/D + scene->camera_height/2)/pixheight;
+	for(k = 0; k < 2; k++){	//One pixel of padding covers rounding, clamp before converting to int
+		int size = k == 0 ? N : M;
+		lo[k] = floor(lo[k]) - 1;
+		hi[k] = floor(hi[k]) + 1;
+		if(hi[k] < 0 || lo[k] > size - 1) return 0;
+		if(lo[k] < 0) lo[k] = 0;
+		if(hi[k] > size - 1) hi[k] = size - 1;
+	}
+	rect[0] = (int)lo[0];
+	rect[1] = M - 1 - (int)hi[1];
+	rect[2] = (int)hi[0];
+	rect[3] = M - 1 - (int)lo[1];
+	return 1;
+}
+
+static __thread const double* bin_near;	//Used by compare_near(), qsort() has no context argument, one per thread so renders can run at once
+static __thread const int* bin_order;
+
+//Orders spheres by their distance bound, then by object order, so coincident spheres are listed earliest first
+static int compare_near(const void* a, const void* b){
+	double na = bin_near[*(const int*)a];
+	double nb = bin_near[*(const int*)b];
+	if(na != nb) return na < nb ? -1 : 1;
+	return bin_order[*(const int*)a] - bin_order[*(const int*)b];
+}
+
+//Screen space binning for --accel bins. Every sphere is projected to the rectangle of pixels it can cover, and added to
+//the list of each BIN_SIZE by BIN_SIZE tile of the N by M image that rectangle touches. A tile's list is sorted by the
+//distance from the camera to the sphere's surface, so trace_bins() can stop once the closest hit is nearer than the
+//rest of the list.
+static void build_bins(const Scene* scene, int N, int M, Bins* bins){
+	Scene* packed = &bins->spheres;
+	double* near = malloc(sizeof(double)*(scene->num_spheres + 1));
+	int* rects = malloc(sizeof(int)*4*(scene->num_spheres + 1));
+	int* fill;
+	int* index;
+	Owned owned[4];
+	long long total = 0;
+	double start = now_seconds();
+	int num_tiles;
+	int tx;
+	int ty;
+	int i;
+	int j;
+	
+	memset(bins, 0, sizeof(Bins));
+	bins->N = N;
+	bins->M = M;
+	bins->tiles_x = (N + BIN_SIZE - 1)/BIN_SIZE;
+	bins->tiles_y = (M + BIN_SIZE - 1)/BIN_SIZE;
+	num_tiles = bins->tiles_x*bins->tiles_y;
+	bins->start = calloc(num_tiles + 1, sizeof(int));	//The caller's to free, with free_bins()
+	fill = malloc(sizeof(int)*(num_tiles + 1));
+	if(near == NULL || rects == NULL || bins->start == NULL || fill == NULL){
+		free(near);
+		free(rects);
+		free(fill);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	own(&owned[0], free, near);
+	own(&owned[1], free, rects);
+	own(&owned[2], free, fill);
+	for(i = 0; i < scene->num_spheres; i++){	//Count the spheres of each tile
+		double C[3] = {scene->sphere_x[i], scene->sphere_y[i], scene->sphere_z[i]};
+		if(!sphere_pixel_rect(scene, N, M, i, &rects[4*i])){
+			rects[4*i] = -1;
+			continue;
+		}
+		//No hit on the sphere is closer than |C| - r, padded like the packet frustum test against rounding
+		near[i] = sqrt(sqr(C[0]) + sqr(C[1]) + sqr(C[2])) - scene->sphere_radius[i];
+		near[i] -= (fabs(C[0]) + fabs(C[1]) + fabs(C[2]) + scene->sphere_radius[i])*1e-6;
+		for(ty = rects[4*i + 1]/BIN_SIZE; ty <= rects[4*i + 3]/BIN_SIZE; ty++){
+			for(tx = rects[4*i]/BIN_SIZE; tx <= rects[4*i + 2]/BIN_SIZE; tx++){
+				bins->start[ty*bins->tiles_x + tx + 1]++;
+			}
+		}
+	}
+	for(i = 0; i < num_tiles; i++){
+		total += bins->start[i + 1];
+		if(total > INT_MAX - SIMD_WIDTH - FLOAT_WIDTH){
+			fail(RAYCAST_ERROR_ARGUMENT, "Too many spheres per screen tile for --accel bins");
+		}
+		bins->start[i + 1] = total;
+		fill[i] = bins->start[i];
+	}
+	index = allocate(sizeof(int)*(total + 1));
+	own(&owned[3], free, index);
+	for(i = 0; i < scene->num_spheres; i++){	//Then list them
+		if(rects[4*i] < 0) continue;
+		for(ty = rects[4*i + 1]/BIN_SIZE; ty <= rects[4*i + 3]/BIN_SIZE; ty++){
+			for(tx = rects[4*i]/BIN_SIZE; tx <= rects[4*i + 2]/BIN_SIZE; tx++){
+				index[fill[ty*bins->tiles_x + tx]++] = i;
+			}
+		}
+	}
+	bin_near = near;
+	bin_order = scene->sphere_order;
+	for(i = 0; i < num_tiles; i++){
+		qsort(index + bins->start[i], bins->start[i + 1] - bins->start[i], sizeof(int), compare_near);
+	}
+	
+	//Copy the spheres out in tile order, in the same layout as the scene so the kernels can read them
+	packed->num_spheres = total;
+	packed->sphere_x = aligned_array(total);
+	packed->sphere_y = aligned_array(total);
+	packed->sphere_z = aligned_array(total);
+	packed->sphere_c = aligned_array(total);
+	packed->sphere_color = aligned_array(3*total);
+	packed->sphere_order = allocate(sizeof(int)*(total + FLOAT_WIDTH));
+	bins->near = allocate(sizeof(double)*(total + 1));
+	if(scene->sphere_r2f != NULL){
+		packed->sphere_xf = aligned_floats(total);
+		packed->sphere_yf = aligned_floats(total);
+		packed->sphere_zf = aligned_floats(total);
+		packed->sphere_r2f = aligned_floats(total);
+	}
+	for(j = 0; j < total; j++){
+		i = index[j];
+		packed->sphere_x[j] = scene->sphere_x[i];
+		packed->sphere_y[j] = scene->sphere_y[i];
+		packed->sphere_z[j] = scene->sphere_z[i];
+		packed->sphere_c[j] = scene->sphere_c[i];
+		memcpy(&packed->sphere_color[3*j], &scene->sphere_color[3*i], sizeof(double)*3);
+		packed->sphere_order[j] = scene->sphere_order[i];
+		bins->near[j] = near[i];
+		if(scene->sphere_r2f != NULL){
+			packed->sphere_xf[j] = scene->sphere_xf[i];
+			packed->sphere_yf[j] = scene->sphere_yf[i];
+			packed->sphere_zf[j] = scene->sphere_zf[i];
+			packed->sphere_r2f[j] = scene->sphere_r2f[i];
+		}
+	}
+	for(j = total; j < total + SIMD_WIDTH; j++){	//Keep vector loads past the last sphere on defined values
+		packed->sphere_x[j] = packed->sphere_y[j] = packed->sphere_z[j] = packed->sphere_c[j] = NAN;
+	}
+	for(j = total; j < total + FLOAT_WIDTH; j++){
+		packed->sphere_order[j] = 0;
+	}
+	bins->build_time = now_seconds() - start;
+	for(i = 3; i >= 0; i--){
+		disown(&owned[i]);
+	}
+	free(near);
+	free(rects);
+	free(fill);
+	free(index);
+}
+
+static void free_bins(Bins* bins){	//Also takes bins build_bins() failed part way through
+	free(bins->spheres.sphere_x);
+	free(bins->spheres.sphere_y);
+	free(bins->spheres.sphere_z);
+	free(bins->spheres.sphere_c);
+	free(bins->spheres.sphere_xf);
+	free(bins->spheres.sphere_yf);
+	free(bins->spheres.sphere_zf);
+	free(bins->spheres.sphere_r2f);
+	free(bins->spheres.sphere_color);
+	free(bins->spheres.sphere_order);
+	free(bins->near);
+	free(bins->start);
+}
+
+static void trace_bins(const Bins* bins, const Kernels* kernels, int x, int row, const double* Rd, Hit* best, RayStats* stats){	//Tests a ray through pixel x, row against its tile's spheres
+	int tile = row/BIN_SIZE*bins->tiles_x + x/BIN_SIZE;
+	int first = bins->start[tile];
+	int last = bins->start[tile + 1];
+	int end;
+	while(first < last && bins->near[first] <= best->t){	//The rest of the tile is farther than the closest hit so far
+		end = first + BIN_CHUNK < last ? first + BIN_CHUNK : last;
+		COUNT(stats->sphere_tests += end - first);
+		kernels->spheres(&bins->spheres, first, end, Rd, best, stats);
+		first = end;
+	}
+}
+
+typedef struct {	//One contiguous, aligned image. Rows are stored top to bottom, the same order as the P6 file
+	int width;
+	int height;
+	int format;
+	size_t pixel_size;	//Bytes per pixel
+	size_t stride;	//Bytes per row
+	unsigned char* data;
+} Framebuffer;
+
+static void create_framebuffer(Framebuffer* fb, int width, int height, int format){	//Allocates a black image in the given format
+	size_t size;
+	fb->width = width;
+	fb->height = height;
+	fb->format = format;
+	if(format == FORMAT_RGB8){
+		fb->pixel_size = 3;
+	}else if(format == FORMAT_FLOAT){
+		fb->pixel_size = 3*sizeof(float);
+	}else{
+		fb->pixel_size = 3*sizeof(double);
+	}
+	fb->stride = fb->pixel_size*width;	//Rows are packed so an RGB8 image can be written out in one piece
+	size = (fb->stride*height + 63)/64*64;
+	fb->data = aligned_alloc(64, size > 0 ? size : 64);
+	if(fb->data == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Not enough memory for a %d by %d image", width, height);
+	}
+	memset(fb->data, 0, size);
+}
+
+static void free_framebuffer(Framebuffer* fb){
+	free(fb->data);
+	fb->data = NULL;
+}
+
+static void release_framebuffer(void* fb){	//free_framebuffer() for own()
+	free_framebuffer(fb);
+}
+
+static inline void store_pixel(Framebuffer* fb, int x, int row, const double* color){	//Writes a color into the pixel at x, row (row 0 is the top)
+	unsigned char* pixel = fb->data + fb->stride*row + fb->pixel_size*x;
+	if(fb->format == FORMAT_RGB8){
+		pixel[0] = (int)(255*color[0]);
+		pixel[1] = (int)(255*color[1]);
+		pixel[2] = (int)(255*color[2]);
+	}else if(fb->format == FORMAT_FLOAT){
+		((float*)pixel)[0] = color[0];
+		((float*)pixel)[1] = color[1];
+		((float*)pixel)[2] = color[2];
+	}else{
+		((double*)pixel)[0] = color[0];
+		((double*)pixel)[1] = color[1];
+		((double*)pixel)[2] = color[2];
+	}
+}
+
+static inline void load_pixel(const Framebuffer* fb, int x, int row, unsigned char* rgb){	//Reads the pixel at x, row as 8 bit RGB
+	const unsigned char* pixel = fb->data + fb->stride*row + fb->pixel_size*x;
+	if(fb->format == FORMAT_RGB8){
+		rgb[0] = pixel[0];
+		rgb[1] = pixel[1];
+		rgb[2] = pixel[2];
+	}else if(fb->format == FORMAT_FLOAT){
+		rgb[0] = (int)(255*(double)((const float*)pixel)[0]);
+		rgb[1] = (int)(255*(double)((const float*)pixel)[1]);
+		rgb[2] = (int)(255*(double)((const float*)pixel)[2]);
+	}else{
+		rgb[0] = (int)(255*((const double*)pixel)[0]);
+		rgb[1] = (int)(255*((const double*)pixel)[1]);
+		rgb[2] = (int)(255*((const double*)pixel)[2]);
+	}
+}
+
+typedef struct {	//Holds everything a worker needs to raycast pixels of the scene
+	const Scene* scene;
+	const Kernels* kernels;
+	Framebuffer* fb;
+	Hit* hits;	//Closest hit of every framebuffer pixel, kept for --frames, or NULL
+	float* cost;	//Work done for every pixel of the whole N by M image, for --heatmap, or NULL
+	int N;	//Size of the whole image
+	int M;
+	int x0;	//Framebuffer pixel 0, 0 is image column x0, output row row0 (output row 0 is the top of the image)
+	int row0;
+	double w;
+	double h;
+	double pixwidth;
+	double pixheight;
+	int packet_size;	//Width and height of a ray packet, 0 traces every ray on its own
+	int fast_rays;
+	int tile_size;
+	int tiles_x;
+	int tiles_y;
+	TileQueue* queues;
+	int num_workers;
+} RenderContext;
+
+typedef struct {	//State owned by one render thread
+	RayStats stats;
+	Scene packet;	//Spheres that survived frustum culling for the current packet, in the same layout as the scene
+	int* packet_source;	//Scene slot each gathered sphere came from
+	int packet_capacity;
+	double* plane_row;	//Per plane Ny*Y + Nz for the row raycast_row_fast() is tracing
+} Worker;
+
+typedef struct {	//Per thread arguments for render_worker()
+	RenderContext* context;
+	int id;
+	Worker worker;
+} WorkerArgs;
+
+static void init_worker(Worker* worker){
+	memset(worker, 0, sizeof(Worker));
+}
+
+static void free_worker(Worker* worker){
+	free(worker->packet.sphere_x);
+	free(worker->packet.sphere_y);
+	free(worker->packet.sphere_z);
+	free(worker->packet.sphere_c);
+	free(worker->packet.sphere_xf);
+	free(worker->packet.sphere_yf);
+	free(worker->packet.sphere_zf);
+	free(worker->packet.sphere_r2f);
+	free(worker->packet.sphere_color);
+	free(worker->packet.sphere_order);
+	free(worker->packet_source);
+	free(worker->plane_row);
+}
+
+static void release_worker(void* worker){	//free_worker() for own()
+	free_worker(worker);
+}
+
+static inline void sample_ray(const RenderContext* context, double x, double y, double* Rd){	//Direction of the ray through point x, y, in pixels
+	double cx = 0;
+	double cy = 0;
+	Rd[0] = cx - (context->w/2) + context->pixwidth * x;	//Create direction vector
+	Rd[1] = cy - (context->h/2) + context->pixheight * y;
+	Rd[2] = 1;
+	normalize(Rd);
+}
+
+static inline void primary_ray(const RenderContext* context, int x, int y, double* Rd){	//Direction of the ray through the center of pixel x, y
+	sample_ray(context, x + .5, y + .5, Rd);
+}
+
+static inline void finish_pixel(RenderContext* context, int x, int y, const Hit* best){	//Stores the color of a pixel's closest hit
+	//y runs from the bottom row up, the framebuffer from the top down
+	int row = context->M - 1 - y - context->row0;
+	if(context->hits != NULL){
+		context->hits[(size_t)row*context->fb->width + x - context->x0] = *best;
+	}
+	if(best->color != NULL){	//If if our closest intersection is valid, store the associated object color
+		store_pixel(context->fb, x - context->x0, row, best->color);
+	}
+}
+
+//Finds the closest object along one ray from the camera. x, y is the pixel the ray passes through, with y counted from
+//the bottom, which picks the screen tile with --accel bins.
+static void trace_ray(RenderContext* context, Worker* worker, int x, int y, const double* Rd, Hit* best){
+	best->t = INFINITY;
+	best->order = 0;
+	best->color = NULL;
+	worker->stats.rays++;
+	//Planes go first: in a room of floor and walls every ray hits one, and the BVH walk then stops at that distance.
+	//closer_hit() orders hits by t and then object order, so the closest hit does not depend on the order of the tests.
+	context->kernels->planes(context->scene, Rd, best, &worker->stats);
+	if(context->scene->bins != NULL){	//Then the spheres of its tile or the sphere BVH, and the instances
+		trace_bins(context->scene->bins, context->kernels, x, context->M - 1 - y, Rd, best, &worker->stats);
+	}else{
+		trace_spheres(context->scene, context->kernels, Rd, best, &worker->stats);
+	}
+	trace_instances(context->scene, context->kernels, Rd, best, &worker->stats);
+}
+
+static void trace_pixel(RenderContext* context, Worker* worker, int x, int y, Hit* best){	//Finds the closest object for one pixel
+	double Rd[3];
+	primary_ray(context, x, y, Rd);
+	trace_ray(context, worker, x, y, Rd, best);
+}
+
+static inline void record_cost(RenderContext* context, int x, int y, double work){	//Adds to a pixel of the --heatmap
+	if(context->cost != NULL){
+		context->cost[(size_t)(context->M - 1 - y)*context->N + x] += work;
+	}
+}
+
+void raycast_pixel(RenderContext* context, Worker* worker, int x, int y){	//Finds the closest object for one pixel and stores its color
+	Hit best;	//Loop state is local so every worker has its own copy
+	long long work = worker->stats.nodes_visited + worker->stats.sphere_tests;
+	trace_pixel(context, worker, x, y, &best);
+	finish_pixel(context, x, y, &best);
+	//Work is counted as BVH nodes visited plus intersection tests
+	record_cost(context, x, y, worker->stats.nodes_visited + worker->stats.sphere_tests - work + context->scene->plane_objects);
+}
+
+#define FRUSTUM_PLANES 5
+
+typedef struct {	//Pyramid from the camera that contains every ray of a packet, as four inward facing side planes and z >= 0
+	double normal[FRUSTUM_PLANES][3];
+	double length[FRUSTUM_PLANES];
+} Frustum;
+
+static int box_outside_planes(const Frustum* frustum, const float* min, const float* max){	//True if the box is behind one of the planes
+	int i;
+	int j;
+	double distance;
+	for(i = 0; i < FRUSTUM_PLANES; i++){
+		distance = 0;
+		for(j = 0; j < 3; j++){	//Distance of the box corner furthest along the normal
+			double n = frustum->normal[i][j];
+			distance += n*(n > 0 ? max[j] : min[j]);
+		}
+		if(distance < 0) return 1;
+	}
+	return 0;
+}
+
+static int sphere_outside_planes(const Frustum* frustum, const double* C, double radius, double pad){
+	int i;
+	for(i = 0; i < FRUSTUM_PLANES; i++){
+		double distance = frustum->normal[i][0]*C[0] + frustum->normal[i][1]*C[1] + frustum->normal[i][2]*C[2];
+		if(distance < -(fabs(radius) + pad)*frustum->length[i]) return 1;
+	}
+	return 0;
+}
+
+static void grow_packet(Worker* worker, int count, int keep){	//Makes room for count spheres in the worker's packet scene, keeping the first keep
+	Scene* packet = &worker->packet;
+	Worker old;	//Holds the current arrays while the new ones are made, so release_worker() frees them if that fails
+	int capacity = worker->packet_capacity;
+	Owned owned;
+	int i;
+	if(count <= capacity) return;
+	while(capacity < count) capacity = capacity > 0 ? capacity*2 : 64;
+	init_worker(&old);
+	old.packet = *packet;
+	old.packet_source = worker->packet_source;
+	packet->sphere_x = packet->sphere_y = packet->sphere_z = packet->sphere_c = packet->sphere_color = NULL;
+	packet->sphere_xf = packet->sphere_yf = packet->sphere_zf = packet->sphere_r2f = NULL;
+	packet->sphere_order = worker->packet_source = NULL;
+	own(&owned, release_worker, &old);
+	packet->sphere_x = aligned_array(capacity);
+	packet->sphere_y = aligned_array(capacity);
+	packet->sphere_z = aligned_array(capacity);
+	packet->sphere_c = aligned_array(capacity);
+	packet->sphere_xf = aligned_floats(capacity);
+	packet->sphere_yf = aligned_floats(capacity);
+	packet->sphere_zf = aligned_floats(capacity);
+	packet->sphere_r2f = aligned_floats(capacity);
+	packet->sphere_color = aligned_array(3*capacity);
+	packet->sphere_order = allocate(sizeof(int)*(capacity + FLOAT_WIDTH));
+	worker->packet_source = allocate(sizeof(int)*capacity);
+	for(i = 0; i < capacity + SIMD_WIDTH; i++){	//Keep vector loads past the last gathered sphere on defined values
+		packet->sphere_x[i] = packet->sphere_y[i] = packet->sphere_z[i] = packet->sphere_c[i] = NAN;
+	}
+	for(i = 0; i < capacity + FLOAT_WIDTH; i++){
+		packet->sphere_order[i] = 0;
+	}
+	if(keep > 0){	//Spheres already gathered for the current packet
+		memcpy(packet->sphere_x, old.packet.sphere_x, sizeof(double)*keep);
+		memcpy(packet->sphere_y, old.packet.sphere_y, sizeof(double)*keep);
+		memcpy(packet->sphere_z, old.packet.sphere_z, sizeof(double)*keep);
+		memcpy(packet->sphere_c, old.packet.sphere_c, sizeof(double)*keep);
+		memcpy(packet->sphere_xf, old.packet.sphere_xf, sizeof(float)*keep);
+		memcpy(packet->sphere_yf, old.packet.sphere_yf, sizeof(float)*keep);
+		memcpy(packet->sphere_zf, old.packet.sphere_zf, sizeof(float)*keep);
+		memcpy(packet->sphere_r2f, old.packet.sphere_r2f, sizeof(float)*keep);
+		memcpy(packet->sphere_color, old.packet.sphere_color, sizeof(double)*3*keep);
+		memcpy(packet->sphere_order, old.packet.sphere_order, sizeof(int)*keep);
+		memcpy(worker->packet_source, old.packet_source, sizeof(int)*keep);
+	}
+	disown(&owned);
+	free_worker(&old);
+	worker->packet_capacity = capacity;
+}
+
+static int gather_packet(RenderContext* context, Worker* worker, const Frustum* frustum){	//Collects the spheres a packet might hit
+	const Scene* scene = context->scene;
+	Scene* packet = &worker->packet;
+	int stack[BVH_STACK];
+	int top = 0;
+	int count = 0;
+	const BVHNode* node;
+	double C[3];
+	double pad;
+	int i;
+	
+	if(scene->num_nodes == 0) return 0;
+	stack[top++] = 0;
+	while(top > 0){
+		node = &scene->bvh_nodes[stack[--top]];
+		COUNT(worker->stats.nodes_visited++);
+		if(box_outside_planes(frustum, node->min, node->max)) continue;
+		if(node->count == 0){
+			stack[top++] = node->offset;
+			stack[top++] = node - scene->bvh_nodes + 1;
+			continue;
+		}
+		grow_packet(worker, count + node->count, count);
+		for(i = node->offset; i < node->offset + node->count; i++){	//One frustum test per sphere for the whole packet
+			C[0] = scene->sphere_x[i];
+			C[1] = scene->sphere_y[i];
+			C[2] = scene->sphere_z[i];
+			pad = (fabs(C[0]) + fabs(C[1]) + fabs(C[2]) + fabs(scene->sphere_radius[i]))*1e-6;
+			if(sphere_outside_planes(frustum, C, scene->sphere_radius[i], pad)){
+				worker->stats.packet_culled++;
+				continue;
+			}
+			if(scene->sphere_r2f != NULL){	//Only copy what the kernels of the current precision read
+				packet->sphere_xf[count] = scene->sphere_xf[i];
+				packet->sphere_yf[count] = scene->sphere_yf[i];
+				packet->sphere_zf[count] = scene->sphere_zf[i];
+				packet->sphere_r2f[count] = scene->sphere_r2f[i];
+			}else{
+				packet->sphere_x[count] = C[0];
+				packet->sphere_y[count] = C[1];
+				packet->sphere_z[count] = C[2];
+				packet->sphere_c[count] = scene->sphere_c[i];
+			}
+			//Colors are not copied, raycast_packet() maps a hit back to the scene's color through packet_source. The
+			//spheres are gathered in traversal order, the kernels break ties in t by sphere_order and not by position.
+			packet->sphere_order[count] = scene->sphere_order[i];
+			worker->packet_source[count++] = i;
+		}
+	}
+	return count;	//The kernels mask off lanes past count, so what an earlier packet left there does not matter
+}
+
+void raycast_packet(RenderContext* context, Worker* worker, int x0, int y0, int x1, int y1){	//Traces the pixels x0..x1-1, y0..y1-1 as one packet
+	Frustum frustum;
+	Hit best;
+	double Rd[3];
+	double cx = 0;
+	double cy = 0;
+	double left = cx - (context->w/2) + context->pixwidth * (x0 + .5);	//Same expressions as primary_ray(), for the corner pixels
+	double right = cx - (context->w/2) + context->pixwidth * (x1 - 1 + .5);
+	double bottom = cy - (context->h/2) + context->pixheight * (y0 + .5);
+	double top = cy - (context->h/2) + context->pixheight * (y1 - 1 + .5);
+	double work;
+	long long instance_work;
+	int count;
+	int i;
+	int x;
+	int y;
+	
+	//Every ray direction (X, Y, 1) has left <= X <= right and bottom <= Y <= top
+	frustum.normal[0][0] = 1;	frustum.normal[0][1] = 0;	frustum.normal[0][2] = -left;
+	frustum.normal[1][0] = -1;	frustum.normal[1][1] = 0;	frustum.normal[1][2] = right;
+	frustum.normal[2][0] = 0;	frustum.normal[2][1] = 1;	frustum.normal[2][2] = -bottom;
+	frustum.normal[3][0] = 0;	frustum.normal[3][1] = -1;	frustum.normal[3][2] = top;
+	frustum.normal[4][0] = 0;	frustum.normal[4][1] = 0;	frustum.normal[4][2] = 1;	//Nothing behind the camera is hit
+	for(i = 0; i < FRUSTUM_PLANES; i++){
+		frustum.length[i] = sqrt(sqr(frustum.normal[i][0]) + sqr(frustum.normal[i][1]) + sqr(frustum.normal[i][2]));
+	}
+	
+	work = worker->stats.nodes_visited;
+	count = gather_packet(context, worker, &frustum);
+	work = (double)(worker->stats.nodes_visited - work)/((x1 - x0)*(y1 - y0));	//Culling is shared by the packet's rays
+	worker->stats.packets++;
+	for(y = y0; y < y1; y++){	//Only the spheres that overlap the frustum are tested per ray
+		for(x = x0; x < x1; x++){
+			primary_ray(context, x, y, Rd);
+			best.t = INFINITY;
+			best.order = 0;
+			best.color = NULL;
+			worker->stats.rays++;
+			COUNT(worker->stats.sphere_tests += count);
+			if(count > 0){
+				context->kernels->spheres(&worker->packet, 0, count, Rd, &best, &worker->stats);
+				if(best.color != NULL){	//Point the hit at the scene's color, the packet's copy is reused by the next packet
+					best.color = &context->scene->sphere_color[3*worker->packet_source[(best.color - worker->packet.sphere_color)/3]];
+				}
+			}
+			instance_work = worker->stats.nodes_visited + worker->stats.sphere_tests;
+			trace_instances(context->scene, context->kernels, Rd, &best, &worker->stats);	//Instances are not gathered, each ray walks them
+			instance_work = worker->stats.nodes_visited + worker->stats.sphere_tests - instance_work;
+			context->kernels->planes(context->scene, Rd, &best, &worker->stats);
+			finish_pixel(context, x, y, &best);
+			record_cost(context, x, y, work + count + instance_work + context->scene->plane_objects);
+		}
+	}
+}
+
+static inline double fast_rsqrt(double q){	//1/sqrt(q) to about 1e-13, without a square root or a divide
+#if defined(__x86_64__) || defined(__i386__)
+	double r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((float)q)));	//12 bit estimate
+	r = r*(1.5 - 0.5*q*r*r);	//Each Newton step doubles the correct bits
+	r = r*(1.5 - 0.5*q*r*r);
+	return r;
+#else
+	return 1/sqrt(q);
+#endif
+}
+
+//--fast-rays: traces pixels x0..x1-1 of ray row y with the per pixel setup strength reduced. Along a row the unnormalized
+//direction D = (X, Y, 1) only changes in X, so the Y and Z parts of each plane's N.D are computed once per row and a
+//pixel adds Nx*X. D is normalized with fast_rsqrt() instead of a square root and three divides, and since Rd = D/|D|
+//a plane's t = num/(N.Rd) is num/(N.D*rsqrt). X itself is computed like sample_ray() does rather than stepped, so
+//a pixel comes out the same whichever tile or thread traces it. The estimate rounds differently from normalize(),
+//so once in a while a pixel on a silhouette changes; bench/run.sh checks how many.
+void raycast_row_fast(RenderContext* context, Worker* worker, int x0, int x1, int y){
+	const Scene* scene = context->scene;
+	double Y = -(context->h/2) + context->pixheight * (y + .5);	//The expressions of sample_ray()
+	double Y2 = Y*Y;
+	double X;
+	double Rd[3];
+	double inverse;
+	Hit best;
+	long long work;
+	int x;
+	int i;
+	
+	if(worker->plane_row == NULL){
+		worker->plane_row = malloc(sizeof(double)*(scene->num_planes + 1));
+		if(worker->plane_row == NULL){
+			fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+		}
+	}
+	for(i = 0; i < scene->num_planes; i++){
+		worker->plane_row[i] = Y*scene->plane_ny[i] + scene->plane_nz[i];
+	}
+	for(x = x0; x < x1; x++){
+		work = worker->stats.nodes_visited + worker->stats.sphere_tests;
+		X = -(context->w/2) + context->pixwidth * (x + .5);
+		inverse = fast_rsqrt(X*X + Y2 + 1);
+		Rd[0] = X*inverse;
+		Rd[1] = Y*inverse;
+		Rd[2] = inverse;
+		best.t = INFINITY;
+		best.order = 0;
+		best.color = NULL;
+		worker->stats.rays++;
+		COUNT(worker->stats.plane_calls += scene->plane_objects);
+		for(i = 0; i < scene->plane_objects; i++){	//The padding planes never hit, so they are skipped
+			double t = scene->plane_num[i]/((worker->plane_row[i] + X*scene->plane_nx[i])*inverse);
+			COUNT(worker->stats.plane_hits += t > 0);
+			if(t > 0 && closer_hit(t, scene->plane_order[i], &best)){
+				best.t = t;
+				best.order = scene->plane_order[i];
+				best.color = &scene->plane_color[3*i];
+			}
+		}
+		if(scene->bins != NULL){
+			trace_bins(scene->bins, context->kernels, x, context->M - 1 - y, Rd, &best, &worker->stats);
+		}else{
+			trace_spheres(scene, context->kernels, Rd, &best, &worker->stats);
+		}
+		trace_instances(scene, context->kernels, Rd, &best, &worker->stats);
+		finish_pixel(context, x, y, &best);
+		record_cost(context, x, y, worker->stats.nodes_visited + worker->stats.sphere_tests - work + scene->plane_objects);
+	}
+}
+
+void raycast_tile(RenderContext* context, Worker* worker, int tile){	//Raycasts every pixel inside of one tile
+	int x;
+	int row;
+	int size = context->packet_size;
+	//Tiles cover the framebuffer, and are laid out top to bottom in output rows
+	int x0 = context->x0 + (tile % context->tiles_x) * context->tile_size;
+	int row0 = context->row0 + (tile / context->tiles_x) * context->tile_size;
+	int x1 = x0 + context->tile_size;
+	int row1 = row0 + context->tile_size;
+	if(x1 > context->x0 + context->fb->width) x1 = context->x0 + context->fb->width;
+	if(row1 > context->row0 + context->fb->height) row1 = context->row0 + context->fb->height;
+	
+	if(size > 0){	//Split the tile into packets, output rows row..row + size - 1 are rays M - row - size..M - row - 1
+		for(row = row0; row < row1; row += size){
+			int last = row + size < row1 ? row + size : row1;
+			for(x = x0; x < x1; x += size){
+				raycast_packet(context, worker, x, context->M - last, x + size < x1 ? x + size : x1, context->M - row);
+			}
+		}
+		return;
+	}
+	if(context->fast_rays){
+		for(row = row0; row < row1; row += 1){
+			raycast_row_fast(context, worker, x0, x1, context->M - 1 - row);
+		}
+		return;
+	}
+	for(row = row0; row < row1; row += 1){
+		for(x = x0; x < x1; x += 1){
+			raycast_pixel(context, worker, x, context->M - 1 - row);
+		}
+	}
+}
+
+static void* render_worker(void* input){	//Thread body: drain our own tile queue, then steal from the others
+	WorkerArgs* args = input;
+	RenderContext* context = args->context;
+	int victim;
+	int tile;
+	
+	while((tile = pop_tile(&context->queues[args->id])) >= 0){	//Work through our own tiles first
+		raycast_tile(context, &args->worker, tile);
+	}
+	victim = (args->id + 1) % context->num_workers;
+	while(victim != args->id){	//Our queue is empty, steal tiles from the other workers until every queue is drained
+		if((tile = steal_tile(&context->queues[victim])) >= 0){
+			raycast_tile(context, &args->worker, tile);
+		}else{
+			victim = (victim + 1) % context->num_workers;
+		}
+	}
+	return NULL;
+}
+
+static void add_stats(RayStats* totals, const RayStats* stats){	//Adds one worker's counters into the totals
+	totals->rays += stats->rays;
+	totals->nodes_visited += stats->nodes_visited;
+	totals->sphere_tests += stats->sphere_tests;
+	totals->packets += stats->packets;
+	totals->packet_culled += stats->packet_culled;
+	totals->sphere_calls += stats->sphere_calls;
+	totals->sphere_hits += stats->sphere_hits;
+	totals->plane_calls += stats->plane_calls;
+	totals->plane_hits += stats->plane_hits;
+}
+
+static void report_phases(const PhaseTimes* phases, const RayStats* totals){	//Prints where the time went for --stats
+	printf("phase: read_scene %.3f ms\n", phases->read_scene*1000);
+	printf("phase: move_camera_to_front %.3f ms\n", phases->move_camera_to_front*1000);
+	printf("phase: build_scene %.3f ms\n", phases->build_scene*1000);
+	printf("phase: raycast_scene %.3f ms, %lld rays (%.2f Mrays/s)\n", phases->raycast_scene*1000, totals->rays,
+		phases->raycast_scene > 0 ? totals->rays/phases->raycast_scene/1e6 : 0);
+	printf("phase: create_image %.3f ms\n", phases->create_image*1000);
+	if(phases->autotune > 0){
+		printf("phase: autotune %.3f ms\n", phases->autotune*1000);
+	}
+#ifdef RAYCAST_STATS
+	printf("intersections: %lld sphere tests, %lld hits (%.2f%%), %lld plane tests, %lld hits (%.2f%%)\n",
+		totals->sphere_calls, totals->sphere_hits, totals->sphere_calls > 0 ? 100.0*totals->sphere_hits/totals->sphere_calls : 0,
+		totals->plane_calls, totals->plane_hits, totals->plane_calls > 0 ? 100.0*totals->plane_hits/totals->plane_calls : 0);
+#else
+	printf("intersections: not counted, build with make STATS=1\n");
+#endif
+}
+
+static void report_bvh_stats(const Scene* scene, const RayStats* totals){	//Prints BVH build and traversal statistics for --stats
+	printf("bvh: %d spheres, %d nodes, %d leaves, depth %d, built in %.3f ms\n", scene->num_spheres, scene->num_nodes,
+		scene->bvh_leaves, scene->bvh_depth, scene->bvh_build_time*1000);
+	if(scene->num_groups > 0){
+		long long drawn = 0;
+		int unique = 0;
+		int i;
+		for(i = 0; i < scene->num_groups; i++){
+			unique += scene->groups[i].num_spheres;
+		}
+		for(i = 0; i < scene->num_instances; i++){
+			drawn += scene->groups[scene->instance_group[i]].num_spheres;
+		}
+		printf("instances: %d instances of %d groups, %d unique spheres drawn as %lld, %d nodes, built in %.3f ms\n",
+			scene->num_instances, scene->num_groups, unique, drawn, scene->num_instance_nodes, scene->instance_build_time*1000);
+	}
+	if(scene->bins != NULL){
+		int num_tiles = scene->bins->tiles_x*scene->bins->tiles_y;
+		printf("bins: %d by %d tiles of %d pixels, %d sphere entries (%.2f per tile), built in %.3f ms\n",
+			scene->bins->tiles_x, scene->bins->tiles_y, BIN_SIZE, scene->bins->spheres.num_spheres,
+			(double)scene->bins->spheres.num_spheres/num_tiles, scene->bins->build_time*1000);
+	}
+#ifdef RAYCAST_STATS
+	double rays = totals->rays > 0 ? (double)totals->rays : 1;
+	printf("bvh: %lld rays, %lld nodes visited (%.2f per ray), %lld sphere tests (%.2f per ray)\n", totals->rays,
+		totals->nodes_visited, totals->nodes_visited/rays, totals->sphere_tests, totals->sphere_tests/rays);
+#else
+	printf("bvh: %lld rays, nodes visited and sphere tests not counted, build with make STATS=1\n", totals->rays);
+#endif
+	if(totals->packets > 0){
+		printf("packets: %lld packets, %.2f spheres culled per packet by the frustum test\n", totals->packets,
+			(double)totals->packet_culled/totals->packets);
+	}
+}
+
+static void init_render_context(RenderContext* context, const Scene* scene, Framebuffer* fb, Hit* hits, float* cost, int N, int M,
+						int x0, int row0, RenderOptions* options){
+	//Grab camera width and height, and calculate our pixel widths and pixel heights
+	context->scene = scene;
+	context->kernels = select_kernels(options->kernel, options->precision);
+	context->fb = fb;
+	context->hits = hits;
+	context->cost = cost;
+	context->N = N;
+	context->M = M;
+	context->x0 = x0;
+	context->row0 = row0;
+	context->w = scene->camera_width;
+	context->pixwidth = context->w/N;
+	context->h = scene->camera_height;
+	context->pixheight = context->h/M;
+	context->packet_size = options->packet_size;
+	context->fast_rays = options->fast_rays;
+	context->tile_size = options->tile_size;
+	context->tiles_x = (fb->width + options->tile_size - 1)/options->tile_size;
+	context->tiles_y = (fb->height + options->tile_size - 1)/options->tile_size;
+}
+
+static void release_render_threads(void* input){	//Frees the queues and workers of raycast_scene() when a thread failed
+	WorkerArgs* args = input;
+	RenderContext* context = args[0].context;
+	int i;
+	for(i = 0; i < context->num_workers; i++){
+		free_worker(&args[i].worker);
+		free_tile_queue(&context->queues[i]);
+	}
+	free(context->queues);
+	free(args);
+}
+
+//This raycasts our scene. The framebuffer holds the part of the N by M image that starts at column x0 and output row
+//row0, counters are added to totals. If hits is not NULL the closest hit of every pixel is stored there as well, and if
+//cost is not NULL the work done for each pixel.
+void raycast_scene(const Scene* scene, Framebuffer* fb, Hit* hits, float* cost, int N, int M, int x0, int row0,
+					RenderOptions* options, RayStats* totals){
+	RenderContext context;
+	Worker worker;
+	Thread* threads;
+	WorkerArgs* args;
+	Owned owned[2];
+	int num_tiles;
+	int per_worker;
+	int i;
+	int x;
+	int row;
+	
+	init_render_context(&context, scene, fb, hits, cost, N, M, x0, row0, options);
+	num_tiles = context.tiles_x*context.tiles_y;
+	
+	if(options->threads <= 1){	//Serial path, raycast every shape for each pixel
+		init_worker(&worker);
+		own(&owned[0], release_worker, &worker);
+		if(context.packet_size > 0){
+			for(i = 0; i < num_tiles; i++){
+				raycast_tile(&context, &worker, i);
+			}
+		}else if(context.fast_rays){
+			for(row = row0; row < row0 + fb->height; row += 1){
+				raycast_row_fast(&context, &worker, x0, x0 + fb->width, M - 1 - row);
+			}
+		}else{
+			for(row = row0; row < row0 + fb->height; row += 1){
+				for(x = x0; x < x0 + fb->width; x += 1){
+					raycast_pixel(&context, &worker, x, M - 1 - row);
+				}
+			}
+		}
+		add_stats(totals, &worker.stats);
+		disown(&owned[0]);
+		free_worker(&worker);
+	}else{
+		//Hand each worker a contiguous run of tiles to start with
+		context.num_workers = options->threads;
+		per_worker = (num_tiles + context.num_workers - 1)/context.num_workers;
+		context.queues = malloc(sizeof(TileQueue)*context.num_workers);
+		threads = malloc(sizeof(Thread)*context.num_workers);
+		args = malloc(sizeof(WorkerArgs)*context.num_workers);
+		if(context.queues == NULL || threads == NULL || args == NULL){
+			free(context.queues);
+			free(threads);
+			free(args);
+			fail(RAYCAST_ERROR_MEMORY, "Out of memory starting %d threads", context.num_workers);
+		}
+		for(i = 0; i < context.num_workers; i++){
+			int first = i*per_worker;
+			int last = first + per_worker;
+			if(first > num_tiles) first = num_tiles;
+			if(last > num_tiles) last = num_tiles;
+			init_tile_queue(&context.queues[i], first, last);
+		}
+		
+		for(i = 0; i < context.num_workers; i++){
+			args[i].context = &context;
+			args[i].id = i;
+			init_worker(&args[i].worker);
+			start_thread(&threads[i], render_worker, &args[i]);
+		}
+		own(&owned[0], free, threads);
+		own(&owned[1], release_render_threads, args);
+		join_threads(threads, context.num_workers);
+		disown(&owned[1]);
+		disown(&owned[0]);
+		for(i = 0; i < context.num_workers; i++){
+			add_stats(totals, &args[i].worker.stats);
+			free_worker(&args[i].worker);
+		}
+		
+		for(i = 0; i < context.num_workers; i++){
+			free_tile_queue(&context.queues[i]);
+		}
+		free(context.queues);
+		free(threads);
+		free(args);
+	}
+}
+
+typedef struct {	//Edge pixels shared out between the anti-aliasing threads
+	RenderContext* context;
+	const Hit* hits;
+	const int* edges;	//Pixel indices, highest contrast first when the budget is short
+	int num_edges;
+	int samples;	//Extra samples for each edge pixel
+	int extra;	//The first extra edges get one more sample, to use up the budget
+	int num_workers;
+} AntialiasJob;
+
+typedef struct {	//Per thread arguments for antialias_worker()
+	AntialiasJob* job;
+	int id;
+	Worker worker;
+} AntialiasArgs;
+
+static double radical_inverse(int i, int base){	//Digits of i mirrored around the decimal point, for the Halton sequence
+	double inverse = 1.0/base;
+	double scale = inverse;
+	double value = 0;
+	while(i > 0){
+		value += (i % base)*scale;
+		i /= base;
+		scale *= inverse;
+	}
+	return value;
+}
+
+static double color_distance(const Hit* a, const Hit* b){	//Sum of the channel differences between two hits, a miss is black
+	static const double black[3] = {0, 0, 0};
+	const double* p = a->color != NULL ? a->color : black;
+	const double* q = b->color != NULL ? b->color : black;
+	return fabs(p[0] - q[0]) + fabs(p[1] - q[1]) + fabs(p[2] - q[2]);
+}
+
+static void* antialias_worker(void* input){	//Thread body: supersample every num_workers'th edge pixel
+	AntialiasArgs* args = input;
+	AntialiasJob* job = args->job;
+	RenderContext* context = job->context;
+	const Hit* center;
+	Hit best;
+	int samples;
+	double Rd[3];
+	double sum[3];
+	int pixel;
+	int x;
+	int y;
+	int i;
+	int s;
+	
+	for(i = args->id; i < job->num_edges; i += job->num_workers){
+		pixel = job->edges[i];
+		x = pixel % context->N;
+		y = context->M - 1 - pixel/context->N;	//Rays count rows from the bottom
+		center = &job->hits[pixel];
+		samples = job->samples + (i < job->extra);
+		sum[0] = sum[1] = sum[2] = 0;
+		if(center->color != NULL){	//The first pass already traced the center of the pixel
+			sum[0] = center->color[0];
+			sum[1] = center->color[1];
+			sum[2] = center->color[2];
+		}
+		for(s = 1; s <= samples; s++){	//Halton points spread the samples evenly over the pixel
+			sample_ray(context, x + radical_inverse(s, 2), y + radical_inverse(s, 3), Rd);
+			trace_ray(context, &args->worker, x, y, Rd, &best);
+			if(best.color != NULL){
+				sum[0] += best.color[0];
+				sum[1] += best.color[1];
+				sum[2] += best.color[2];
+			}
+		}
+		sum[0] /= samples + 1;
+		sum[1] /= samples + 1;
+		sum[2] /= samples + 1;
+		store_pixel(context->fb, x, context->M - 1 - y, sum);
+	}
+	return NULL;
+}
+
+static __thread const double* edge_contrast;	//Used by compare_contrast(), per thread like bin_near
+
+static int compare_contrast(const void* a, const void* b){	//Orders edge pixels by falling contrast, then by index
+	double ca = edge_contrast[*(const int*)a];
+	double cb = edge_contrast[*(const int*)b];
+	if(ca != cb) return ca < cb ? 1 : -1;
+	return *(const int*)a - *(const int*)b;
+}
+
+static void release_antialias_threads(void* input){	//Frees the workers of antialias() when one of them failed
+	AntialiasArgs* args = input;
+	int i;
+	for(i = 0; i < args[0].job->num_workers; i++){
+		free_worker(&args[i].worker);
+	}
+	free(args);
+}
+
+//Adaptive anti-aliasing. After the first pass, a pixel whose closest object or color differs from one of its four
+//neighbors gets options->aa_samples more rays spread over its area, and is set to the average of all of them. Every
+//other pixel keeps its single center sample. If the extra rays would go over options->aa_budget, the highest contrast
+//edges are served first and each gets an even share of the budget, at least one ray.
+static void antialias(const Scene* scene, Framebuffer* fb, const Hit* hits, int N, int M, RenderOptions* options,
+				RayStats* totals){
+	RenderContext context;
+	AntialiasJob job;
+	AntialiasArgs* args;
+	Thread* threads;
+	double* contrast = calloc((size_t)N*M + 1, sizeof(double));
+	int* edges = malloc(sizeof(int)*((size_t)N*M + 1));
+	Owned owned[4];
+	int num_edges = 0;
+	int pixel;
+	int x;
+	int row;
+	int i;
+	
+	if(contrast == NULL || edges == NULL){
+		free(contrast);
+		free(edges);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	own(&owned[0], free, contrast);
+	own(&owned[1], free, edges);
+	for(i = 0; i < N*M; i++){	//-1 marks a flat pixel
+		contrast[i] = -1;
+	}
+	for(row = 0; row < M; row++){	//Compare every pixel with its right and lower neighbor, so each pair is seen once
+		for(x = 0; x < N; x++){
+			pixel = row*N + x;
+			for(i = 0; i < 2; i++){
+				int other = i == 0 ? pixel + 1 : pixel + N;
+				double distance;
+				if(i == 0 ? x + 1 >= N : row + 1 >= M) continue;
+				if((hits[pixel].color == NULL) == (hits[other].color == NULL)
+					&& (hits[pixel].color == NULL || (hits[pixel].order == hits[other].order && hits[pixel].color == hits[other].color))){
+					continue;	//Same object, or both missed. The spheres of an instance share its order but not a color
+				}
+				distance = color_distance(&hits[pixel], &hits[other]);
+				if(distance == 0) continue;	//Touching objects of the same color leave no visible edge
+				if(distance > contrast[pixel]) contrast[pixel] = distance;
+				if(distance > contrast[other]) contrast[other] = distance;
+			}
+		}
+	}
+	for(i = 0; i < N*M; i++){
+		if(contrast[i] >= 0) edges[num_edges++] = i;
+	}
+	
+	job.samples = options->aa_samples;
+	job.num_edges = num_edges;
+	job.extra = 0;
+	if(options->aa_budget >= 0 && (long long)num_edges*job.samples > options->aa_budget){	//Not enough rays for every edge
+		edge_contrast = contrast;
+		qsort(edges, num_edges, sizeof(int), compare_contrast);
+		job.samples = num_edges > 0 ? options->aa_budget/num_edges : 0;
+		if(job.samples < 1) job.samples = 1;
+		if(job.num_edges > options->aa_budget/job.samples){
+			job.num_edges = options->aa_budget/job.samples;
+		}else{
+			job.extra = options->aa_budget - (long long)job.num_edges*job.samples;
+		}
+	}
+	
+	init_render_context(&context, scene, fb, NULL, NULL, N, M, 0, 0, options);
+	job.context = &context;
+	job.hits = hits;
+	job.edges = edges;
+	job.num_workers = options->threads > 1 ? options->threads : 1;
+	args = malloc(sizeof(AntialiasArgs)*job.num_workers);
+	threads = malloc(sizeof(Thread)*job.num_workers);
+	if(args == NULL || threads == NULL){
+		free(args);
+		free(threads);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory starting %d threads", job.num_workers);
+	}
+	for(i = 0; i < job.num_workers; i++){
+		args[i].job = &job;
+		args[i].id = i;
+		init_worker(&args[i].worker);
+		if(job.num_workers > 1) start_thread(&threads[i], antialias_worker, &args[i]);
+	}
+	own(&owned[2], free, threads);
+	own(&owned[3], release_antialias_threads, args);
+	if(job.num_workers == 1){	//Serial path, no threads
+		antialias_worker(&args[0]);
+	}else{
+		join_threads(threads, job.num_workers);
+	}
+	for(i = 3; i >= 0; i--){
+		disown(&owned[i]);
+	}
+	for(i = 0; i < job.num_workers; i++){
+		add_stats(totals, &args[i].worker.stats);
+		free_worker(&args[i].worker);
+	}
+	if(options->stats){
+		long long extra_rays = (long long)job.num_edges*job.samples + job.extra;
+		printf("aa: %d edge pixels of %d, %d supersampled, %lld extra rays (%.2f per pixel)\n",
+			num_edges, N*M, job.num_edges, extra_rays, N*M > 0 ? (double)extra_rays/((double)N*M) : 0);
+	}
+	free(args);
+	free(threads);
+	free(contrast);
+	free(edges);
+}
+
+typedef struct {	//An output image being written, as P6 or as QOI (https://qoiformat.org) when the file ends in .qoi
+	FILE* output_pointer;
+	const char* name;
+	int qoi;
+	unsigned char index[64][4];	//QOI: the last pixel seen with each hash, RGBA
+	unsigned char previous[4];	//QOI: the pixel before the next one
+	int run;	//QOI: pixels repeating the previous one that have not been written yet
+	unsigned char* buffer;	//QOI: encoded bytes of the current write_pixels() call
+	size_t capacity;
+} ImageFile;
+
+static int is_qoi(const char* output){	//True if the output file should be written as QOI
+	const char* periodPointer = strrchr(output, '.');
+	return periodPointer != NULL && strcmp(periodPointer, ".qoi") == 0;
+}
+
+static ImageFile* create_image_file(const char* output){	//Opens the output file, the caller writes the header
+	ImageFile* image = calloc(1, sizeof(ImageFile));
+	if(image == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	image->output_pointer = fopen(output, "wb");	/*Open the output file*/
+	if(image->output_pointer == NULL){
+		free(image);
+		fail(RAYCAST_ERROR_IO, "Could not open output file \"%s\"", output);
+	}
+	image->name = output;
+	return image;
+}
+
+static ImageFile* open_image(const char* output, int width, int height){	//Opens the output file and writes the P6 or QOI header
+	ImageFile* image = create_image_file(output);
+	unsigned char header[14] = {'q', 'o', 'i', 'f'};
+	int i;
+	if(!is_qoi(output)){
+		fprintf(image->output_pointer, "P6\n%d %d\n255\n", width, height);	//Write P6 header to output.ppm
+		return image;
+	}
+	image->qoi = 1;
+	for(i = 0; i < 4; i++){	//Width and height are big endian, then 3 channels and the sRGB color space
+		header[4 + i] = (unsigned)width >> (24 - 8*i);
+		header[8 + i] = (unsigned)height >> (24 - 8*i);
+	}
+	header[12] = 3;
+	header[13] = 0;
+	fwrite(header, 1, sizeof(header), image->output_pointer);
+	image->previous[3] = 255;
+	return image;
+}
+
+//A region render (--region) is written as a P6 file of just the region, with its place in the whole image in a
+//comment that raycast --merge reads back: "# region x0 y0 x1 y1 of width height".
+static ImageFile* open_partial_image(const char* output, const int* region, int width, int height){
+	ImageFile* image = create_image_file(output);
+	fprintf(image->output_pointer, "P6\n# region %d %d %d %d of %d %d\n%d %d\n255\n", region[0], region[1], region[2],
+		region[3], width, height, region[2] - region[0], region[3] - region[1]);
+	return image;
+}
+
+//QOI codes each pixel as a run of the previous pixel, a reference to a recently seen one, a small difference from the
+//previous one, or in full. Large flat areas, which most of our images are, become a byte per 62 pixels.
+static void encode_qoi(ImageFile* image, const unsigned char* rgb, size_t count){
+	unsigned char* out;
+	unsigned char* px;
+	size_t needed = 4*count + 1;	//Worst case is a full RGB op for every pixel, plus a run ended by the first one
+	size_t i;
+	int hash;
+	int vr;
+	int vg;
+	int vb;
+	if(needed > image->capacity){	//The image stays valid for close_image() if the larger buffer can not be had
+		free(image->buffer);
+		image->buffer = NULL;
+		image->capacity = 0;
+		image->buffer = allocate(needed);
+		image->capacity = needed;
+	}
+	out = image->buffer;
+	for(i = 0; i < count; i++, rgb += 3){
+		if(rgb[0] == image->previous[0] && rgb[1] == image->previous[1] && rgb[2] == image->previous[2]){
+			if(++image->run == 62){	//Longest run one byte can hold
+				*out++ = 0xc0 | 61;
+				image->run = 0;
+			}
+			continue;
+		}
+		if(image->run > 0){
+			*out++ = 0xc0 | (image->run - 1);
+			image->run = 0;
+		}
+		hash = (rgb[0]*3 + rgb[1]*5 + rgb[2]*7 + 255*11) % 64;
+		px = image->index[hash];
+		if(px[0] == rgb[0] && px[1] == rgb[1] && px[2] == rgb[2] && px[3] == 255){
+			*out++ = hash;
+		}else{
+			px[0] = rgb[0];
+			px[1] = rgb[1];
+			px[2] = rgb[2];
+			px[3] = 255;
+			vr = (signed char)(rgb[0] - image->previous[0]);	//Differences wrap around like the decoder's
+			vg = (signed char)(rgb[1] - image->previous[1]);
+			vb = (signed char)(rgb[2] - image->previous[2]);
+			if(vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1){
+				*out++ = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+			}else if(vg >= -32 && vg <= 31 && vr - vg >= -8 && vr - vg <= 7 && vb - vg >= -8 && vb - vg <= 7){
+				*out++ = 0x80 | (vg + 32);
+				*out++ = (vr - vg + 8) << 4 | (vb - vg + 8);
+			}else{
+				*out++ = 0xfe;
+				*out++ = rgb[0];
+				*out++ = rgb[1];
+				*out++ = rgb[2];
+			}
+		}
+		image->previous[0] = rgb[0];
+		image->previous[1] = rgb[1];
+		image->previous[2] = rgb[2];
+	}
+	fwrite(image->buffer, 1, out - image->buffer, image->output_pointer);
+}
+
+static void write_pixels(ImageFile* image, const unsigned char* rgb, size_t count){	//Appends count RGB pixels to the image
+	if(image->qoi){
+		encode_qoi(image, rgb, count);
+	}else{
+		fwrite(rgb, 3, count, image->output_pointer);
+	}
+}
+
+static void write_rows(ImageFile* image, const Framebuffer* fb){	//Appends every row of the framebuffer to the image
+	unsigned char* row;
+	Owned owned;
+	int x;
+	int y;
+	if(fb->format == FORMAT_RGB8 && !image->qoi){	//RGB8 is already laid out like P6, write it straight from the framebuffer
+		fwrite(fb->data, 1, fb->stride*fb->height, image->output_pointer);
+	}else if(fb->format == FORMAT_RGB8){
+		for(y = 0; y < fb->height; y++){
+			write_pixels(image, (unsigned char*)fb->data + (size_t)y*fb->stride, fb->width);
+		}
+	}else{	//Other formats are converted one row at a time
+		row = allocate(3*(size_t)fb->width + 1);
+		own(&owned, free, row);
+		for(y = 0; y < fb->height; y++){
+			for(x = 0; x < fb->width; x++){
+				load_pixel(fb, x, y, &row[3*x]);
+			}
+			write_pixels(image, row, fb->width);
+		}
+		disown(&owned);
+		free(row);
+	}
+}
+
+static void close_image(ImageFile* image){	//Finishes the image, closes its file and frees it, then reports a failed write
+	static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+	const char* name = image->name;
+	int failed;
+	if(image->qoi){	//A run may still be open at the last pixel
+		if(image->run > 0){
+			fputc(0xc0 | (image->run - 1), image->output_pointer);
+		}
+		fwrite(end, 1, sizeof(end), image->output_pointer);
+	}
+	failed = ferror(image->output_pointer);
+	failed |= fclose(image->output_pointer) != 0;
+	free(image->buffer);
+	free(image);
+	if(failed){
+		fail(RAYCAST_ERROR_IO, "Could not write output file \"%s\"", name);
+	}
+}
+
+static void release_image(void* input){	//Closes and frees an image that will not be finished, for own()
+	ImageFile* image = input;
+	fclose(image->output_pointer);
+	free(image->buffer);
+	free(image);
+}
+
+static void create_image(const Framebuffer* fb, const char* output){	//Encodes the framebuffer into a P6 .ppm or a .qoi file
+	ImageFile* image = open_image(output, fb->width, fb->height);
+	Owned owned;
+	own(&owned, release_image, image);
+	write_rows(image, fb);	//Write buffer to output.ppm
+	disown(&owned);
+	close_image(image);
+}
+
+static void create_partial_image(const Framebuffer* fb, const char* output, const int* region, int width, int height){	//create_image() for a region
+	ImageFile* image = open_partial_image(output, region, width, height);
+	Owned owned;
+	own(&owned, release_image, image);
+	write_rows(image, fb);
+	disown(&owned);
+	close_image(image);
+}
+
+static void write_heatmap(const float* cost, int width, int height, const char* output){	//Writes the per pixel work as a P6 heatmap
+	//Black is no work, then red, yellow and white for the most expensive pixel in the image
+	ImageFile* image = open_image(output, width, height);
+	unsigned char* row;
+	Owned owned[2];
+	double most = 0;
+	double sum = 0;
+	double v;
+	size_t i;
+	int x;
+	int y;
+	
+	own(&owned[0], release_image, image);
+	row = allocate(3*(size_t)width + 1);
+	own(&owned[1], free, row);
+	for(i = 0; i < (size_t)width*height; i++){
+		if(cost[i] > most) most = cost[i];
+		sum += cost[i];
+	}
+	for(y = 0; y < height; y++){
+		for(x = 0; x < width; x++){
+			v = most > 0 ? 3*cost[(size_t)y*width + x]/most : 0;
+			row[3*x] = (int)(255*fmin(v, 1));
+			row[3*x + 1] = (int)(255*fmin(fmax(v - 1, 0), 1));
+			row[3*x + 2] = (int)(255*fmin(fmax(v - 2, 0), 1));
+		}
+		write_pixels(image, row, width);
+	}
+	disown(&owned[1]);
+	disown(&owned[0]);
+	free(row);
+	close_image(image);
+	printf("heatmap: %s, %.1f nodes and tests per pixel on average, %.0f at most\n", output,
+		width*height > 0 ? sum/((double)width*height) : 0, most);
+}
+
+#define QOI_BAND_ROWS 64	//Band height .qoi output is rendered in when --band-rows is not given
+
+typedef struct {	//A finished band handed to the writer thread
+	ImageFile* image;
+	const Framebuffer* fb;
+	double time;	//Seconds spent writing, for --stats
+} BandWrite;
+
+static void* band_writer(void* input){	//Thread body: write one band while the next one renders
+	BandWrite* job = input;
+	double start = now_seconds();
+	write_rows(job->image, job->fb);
+	job->time += now_seconds() - start;
+	return NULL;
+}
+
+//Renders the image band_rows rows at a time and streams each band into the output file as soon as it is done, so
+//memory stays at two bands however large the image is. While one band is being written on a separate thread, the next
+//one renders into the other buffer. Bands go from the top of the image down, in the same order as the P6 file.
+//The writer's time is reported as create_image even though it overlaps raycast_scene. With --region only the rows and
+//columns of the region are rendered and written.
+static void stream_image(const Scene* scene, const char* output, int width, int height, float* cost, RenderOptions* options,
+					RayStats* totals, PhaseTimes* phases){
+	int whole[4] = {0, 0, width, height};
+	const int* region = options->region[2] > 0 ? options->region : whole;
+	ImageFile* image = options->region[2] > 0 ? open_partial_image(output, region, width, height)
+												: open_image(output, width, height);
+	Framebuffer bands[2] = {{0}};
+	BandWrite job = {NULL, NULL, 0};
+	Thread writer = {0};	//Not started until the first band is done
+	ErrorTrap trap;	//The writer uses job and bands, an error while it runs has to wait for it
+	Owned owned[3];	//Owned by the outer trap, so they are released after the writer is joined
+	double start;
+	volatile int writing = 0;
+	int current = 0;
+	int row;
+	int rows;
+	int i;
+	
+	own(&owned[0], release_image, image);
+	own(&owned[1], release_framebuffer, &bands[0]);
+	own(&owned[2], release_framebuffer, &bands[1]);
+	create_framebuffer(&bands[0], region[2] - region[0], options->band_rows, options->format);
+	create_framebuffer(&bands[1], region[2] - region[0], options->band_rows, options->format);
+	if(setjmp(trap.jump) != 0){
+		leave_trap(&trap, NULL);
+		if(writing) join_threads(&writer, 1);
+		fail(trap.error.code, "%s", trap.error.message);
+	}
+	enter_trap(&trap);
+	for(row = region[1]; row < region[3]; row += options->band_rows){
+		rows = region[3] - row < options->band_rows ? region[3] - row : options->band_rows;
+		bands[current].height = rows;	//The last band may be shorter
+		memset(bands[current].data, 0, bands[current].stride*rows);
+		start = now_seconds();
+		raycast_scene(scene, &bands[current], NULL, cost, width, height, region[0], row, options, totals);
+		phases->raycast_scene += now_seconds() - start;
+		
+		if(writing){	//Wait for the previous band before queueing this one, the file has to stay in order
+			writing = 0;
+			join_threads(&writer, 1);
+		}
+		job.image = image;
+		job.fb = &bands[current];
+		start_thread(&writer, band_writer, &job);
+		writing = 1;
+		current = 1 - current;	//Render the next band into the buffer that is not being written
+	}
+	writing = 0;
+	leave_trap(&trap, NULL);
+	join_threads(&writer, 1);
+	for(i = 2; i >= 0; i--){
+		disown(&owned[i]);
+	}
+	free_framebuffer(&bands[0]);
+	free_framebuffer(&bands[1]);
+	close_image(image);
+	phases->create_image += job.time;
+}
+
+typedef struct {	//What render_frames() keeps from one frame to the next
+	Scene* scene;
+	Object** object_array;
+	int object_counter;
+	int* slot;	//Sphere or plane slot of every object in object_array
+	int* changed;	//Last frame each object in object_array was changed in
+	int* parent;	//Parent of every BVH node, -1 for the root
+	int* leaf;	//Leaf that holds every sphere slot
+	int* stamp;	//Last frame each pixel was retraced in
+	Hit* hits;	//Closest hit of every pixel in the current frame
+	int (*rects)[4];	//Screen areas to retrace this frame, as x0, row0, x1, row1
+	int num_rects;
+	int rect_capacity;
+} Animation;
+
+static void add_footprint(Animation* animation, const RenderContext* context, int slot){	//Adds the pixels a sphere might cover
+	//A ray can only hit the sphere if its line passes through the sphere's box. Every point of the box is seen
+	//through the camera along X = x/z, Y = y/z, and while the box stays on one side of z = 0 those are bounded by the
+	//projections of its corners. Every hit is in front of the camera, so a box entirely behind it covers nothing.
+	const Scene* scene = context->scene;
+	double min[3];
+	double max[3];
+	double X;
+	double Y;
+	double low[2] = {INFINITY, INFINITY};
+	double high[2] = {-INFINITY, -INFINITY};
+	int* rect;
+	int i;
+	
+	if(animation->num_rects >= animation->rect_capacity){
+		int capacity = animation->rect_capacity > 0 ? animation->rect_capacity*2 : 16;
+		int (*rects)[4] = realloc(animation->rects, sizeof(int[4])*capacity);
+		if(rects == NULL){	//The old list is still the animation's, free_animation() frees it
+			fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+		}
+		animation->rects = rects;
+		animation->rect_capacity = capacity;
+	}
+	rect = animation->rects[animation->num_rects];
+	rect[0] = 0;	//Start with the whole screen
+	rect[1] = 0;
+	rect[2] = context->N;
+	rect[3] = context->M;
+	sphere_bounds(scene->sphere_x[slot], scene->sphere_y[slot], scene->sphere_z[slot], scene->sphere_radius[slot], min, max);
+	if(max[2] <= 0){
+		return;
+	}
+	if(min[2] > 0){
+		for(i = 0; i < 8; i++){
+			double z = i & 4 ? max[2] : min[2];
+			X = (i & 1 ? max[0] : min[0])/z;
+			Y = (i & 2 ? max[1] : min[1])/z;
+			if(X < low[0]) low[0] = X;
+			if(X > high[0]) high[0] = X;
+			if(Y < low[1]) low[1] = Y;
+			if(Y > high[1]) high[1] = Y;
+		}
+		//Invert primary_ray() and widen by a pixel on each side to cover rounding
+		low[0] = floor((low[0] + context->w/2)/context->pixwidth - .5) - 1;
+		high[0] = ceil((high[0] + context->w/2)/context->pixwidth - .5) + 1;
+		low[1] = floor((low[1] + context->h/2)/context->pixheight - .5) - 1;
+		high[1] = ceil((high[1] + context->h/2)/context->pixheight - .5) + 1;
+		if(low[0] == low[0] && high[0] == high[0] && low[1] == low[1] && high[1] == high[1]){	//Not NaN
+			if(low[0] > 0) rect[0] = low[0] < context->N ? (int)low[0] : context->N;
+			if(high[0] < context->N - 1) rect[2] = high[0] >= 0 ? (int)high[0] + 1 : 0;
+			if(high[1] < context->M - 1) rect[1] = high[1] >= 0 ? context->M - 1 - (int)high[1] : context->M;	//Rays count rows from the bottom
+			if(low[1] > 0) rect[3] = low[1] < context->M ? context->M - (int)low[1] : 0;
+		}
+	}
+	if(rect[0] < rect[2] && rect[1] < rect[3]){
+		animation->num_rects++;
+	}
+}
+
+static void refit_sphere(Animation* animation, int slot){	//Updates the BVH boxes above a sphere that moved or changed size
+	Scene* scene = animation->scene;
+	BVHNode* node;
+	Box bounds;
+	double min[3];
+	double max[3];
+	int n = animation->leaf[slot];
+	int i;
+	
+	while(n >= 0){
+		node = &scene->bvh_nodes[n];
+		box_empty(&bounds);
+		if(node->count > 0){
+			for(i = node->offset; i < node->offset + node->count; i++){
+				sphere_bounds(scene->sphere_x[i], scene->sphere_y[i], scene->sphere_z[i], scene->sphere_radius[i], min, max);
+				box_grow(&bounds, min, max);
+			}
+		}else{
+			for(i = 0; i < 3; i++){	//Float bounds widen exactly to double
+				min[i] = fmin(node[1].min[i], scene->bvh_nodes[node->offset].min[i]);
+				max[i] = fmax(node[1].max[i], scene->bvh_nodes[node->offset].max[i]);
+			}
+			box_grow(&bounds, min, max);
+		}
+		for(i = 0; i < 3; i++){
+			node->min[i] = round_down(bounds.min[i]);
+			node->max[i] = round_up(bounds.max[i]);
+		}
+		n = animation->parent[n];
+	}
+}
+
+static void free_animation(Animation* animation){
+	free(animation->slot);
+	free(animation->changed);
+	free(animation->parent);
+	free(animation->leaf);
+	free(animation->stamp);
+	free(animation->hits);
+	free(animation->rects);
+}
+
+static void release_animation(void* animation){	//free_animation() for own()
+	free_animation(animation);
+}
+
+static void init_animation(Animation* animation, Scene* scene, Object** object_array, int object_counter, int N, int M){
+	int i;
+	int j;
+	animation->scene = scene;
+	animation->object_array = object_array;
+	animation->object_counter = object_counter;
+	animation->slot = malloc(sizeof(int)*(object_counter + 1));
+	animation->changed = calloc(object_counter + 1, sizeof(int));
+	animation->parent = malloc(sizeof(int)*(scene->num_nodes + 1));
+	animation->leaf = malloc(sizeof(int)*(scene->num_spheres + 1));
+	animation->stamp = calloc((size_t)N*M, sizeof(int));
+	animation->hits = malloc(sizeof(Hit)*((size_t)N*M + 1));
+	animation->rects = NULL;
+	animation->num_rects = 0;
+	animation->rect_capacity = 0;
+	if(animation->slot == NULL || animation->changed == NULL || animation->parent == NULL || animation->leaf == NULL
+		|| animation->stamp == NULL || animation->hits == NULL){
+		free_animation(animation);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	for(i = 0; i < scene->num_spheres; i++){
+		animation->slot[scene->sphere_order[i]] = i;
+	}
+	for(i = 0; i < scene->num_planes; i++){
+		if(scene->plane_order[i] != 0){	//Padding planes have order 0, which is the camera
+			animation->slot[scene->plane_order[i]] = i;
+		}
+	}
+	if(scene->num_nodes > 0) animation->parent[0] = -1;
+	for(i = 0; i < scene->num_nodes; i++){
+		if(scene->bvh_nodes[i].count == 0){
+			animation->parent[i + 1] = i;
+			animation->parent[scene->bvh_nodes[i].offset] = i;
+		}else{
+			for(j = scene->bvh_nodes[i].offset; j < scene->bvh_nodes[i].offset + scene->bvh_nodes[i].count; j++){
+				animation->leaf[j] = i;
+			}
+		}
+	}
+}
+
+//Applies one change to object_array and the scene. Spheres are updated in place and their old and new footprints are
+//queued for retracing, anything else changes the whole image and returns 1.
+static int apply_delta(Animation* animation, const RenderContext* context, const Delta* delta, int order){
+	Scene* scene = animation->scene;
+	Object* object = animation->object_array[order];
+	int slot = animation->slot[order];
+	store_value(object, delta->field, delta->value, (double*)delta->vector, 0);	//Checked by read_frames()
+	if(object->kind == 0){
+		if(object != animation->object_array[0]) return 0;	//Only the first camera is rendered
+		scene->camera_width = object->camera.width;
+		scene->camera_height = object->camera.height;
+		return 1;
+	}
+	if(object->kind == 2){
+		scene->plane_x[slot] = object->plane.position[0];
+		scene->plane_y[slot] = object->plane.position[1];
+		scene->plane_z[slot] = object->plane.position[2];
+		scene->plane_nx[slot] = object->plane.normal[0];
+		scene->plane_ny[slot] = object->plane.normal[1];
+		scene->plane_nz[slot] = object->plane.normal[2];
+		memcpy(&scene->plane_color[3*slot], object->plane.color, sizeof(double)*3);
+		bake_plane(scene, slot);
+		return 1;
+	}
+	add_footprint(animation, context, slot);
+	scene->sphere_x[slot] = object->sphere.position[0];
+	scene->sphere_y[slot] = object->sphere.position[1];
+	scene->sphere_z[slot] = object->sphere.position[2];
+	scene->sphere_radius[slot] = object->sphere.radius;
+	memcpy(&scene->sphere_color[3*slot], object->sphere.color, sizeof(double)*3);
+	bake_sphere(scene, slot);
+	refit_sphere(animation, slot);
+	add_footprint(animation, context, slot);
+	return 0;
+}
+
+//Brings the image up to date after the spheres in changed_orders moved. Only pixels inside a footprint are looked at.
+//A pixel whose closest hit was one of the changed spheres is traced again in full, any other pixel keeps its hit
+//unless one of the changed spheres is now in front of it. Returns the number of pixels retraced.
+static int retrace_frame(Animation* animation, RenderContext* context, Worker* worker, const int* changed_orders,
+					int num_changed, int frame){
+	static const double black[3] = {0, 0, 0};
+	const Scene* scene = animation->scene;
+	double Rd[3];
+	Hit* best;
+	int retraced = 0;
+	int pixel;
+	int r;
+	int i;
+	int x;
+	int row;
+	
+	for(r = 0; r < animation->num_rects; r++){
+		for(row = animation->rects[r][1]; row < animation->rects[r][3]; row++){
+			for(x = animation->rects[r][0]; x < animation->rects[r][2]; x++){
+				pixel = row*context->N + x;
+				if(animation->stamp[pixel] == frame) continue;	//Footprints overlap, each pixel is retraced once
+				animation->stamp[pixel] = frame;
+				retraced++;
+				best = &animation->hits[pixel];
+				if(best->color == NULL || animation->changed[best->order] != frame){
+					//Only the changed spheres can beat a hit that did not move
+					primary_ray(context, x, context->M - 1 - row, Rd);
+					worker->stats.rays++;
+					COUNT(worker->stats.sphere_tests += num_changed);
+					for(i = 0; i < num_changed; i++){
+						int slot = animation->slot[changed_orders[i]];
+						context->kernels->spheres(scene, slot, slot + 1, Rd, best, &worker->stats);
+					}
+				}else{
+					trace_pixel(context, worker, x, context->M - 1 - row, best);
+				}
+				store_pixel(context->fb, x, row, best->color != NULL ? best->color : black);
+			}
+		}
+	}
+	return retraced;
+}
+
+static void release_deltas(void* deltas){	//Frees a Delta* that read_frames() may still move, for own()
+	free(*(Delta**)deltas);
+}
+
+static void frame_name(const char* output, int frame, char* name){	//out.ppm becomes out-0000.ppm, out-0001.ppm, ...
+	int length = strlen(output) - 4;	//argument_checker() made sure output ends in .ppm or .qoi
+	sprintf(name, "%.*s-%04d%s", length, output, frame, output + length);
+}
+
+//Renders frame 0 from the scene, then applies each frame of changes from the --frames file and only retraces the parts
+//of the image the changed spheres covered before or cover now. Changes to the camera or a plane affect every pixel, so
+//those frames are rendered in full. Every frame matches what a full render of the changed scene would produce.
+static void render_frames(Scene* scene, Object** object_array, Object** file_objects, int object_counter, const char* output, int N,
+					int M, RenderOptions* options, RayStats* totals, PhaseTimes* phases){
+	Animation animation;
+	RenderContext context;
+	Worker worker;
+	Framebuffer fb;
+	Delta* deltas = NULL;
+	int* changed_orders = malloc(sizeof(int)*(object_counter + 1));
+	char* name = malloc(strlen(output) + 16);
+	Owned owned[6];
+	int num_deltas;
+	int num_frames;
+	int num_changed;
+	int full;
+	int order;
+	int retraced;
+	int frame;
+	int i;
+	int next = 0;
+	int camera = 0;
+	double start;
+	double image_start;
+	
+	if(changed_orders == NULL || name == NULL){
+		free(changed_orders);
+		free(name);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	own(&owned[0], free, changed_orders);
+	own(&owned[1], free, name);
+	own(&owned[2], release_deltas, &deltas);
+	num_deltas = read_frames(options->frames, file_objects, object_counter, &deltas, &num_frames);
+	while(file_objects[camera]->kind != 0) camera++;	//move_camera_to_front() swapped the camera with object 0
+	init_animation(&animation, scene, object_array, object_counter, N, M);
+	own(&owned[3], release_animation, &animation);
+	create_framebuffer(&fb, N, M, options->format);
+	own(&owned[4], release_framebuffer, &fb);
+	init_worker(&worker);
+	own(&owned[5], release_worker, &worker);
+	
+	for(frame = 0; frame < num_frames; frame++){
+		start = now_seconds();
+		init_render_context(&context, scene, &fb, animation.hits, NULL, N, M, 0, 0, options);
+		animation.num_rects = 0;
+		num_changed = 0;
+		full = frame == 0;
+		for(; next < num_deltas && deltas[next].frame == frame; next++){
+			order = deltas[next].object == camera ? 0 : deltas[next].object == 0 ? camera : deltas[next].object;
+			if(animation.changed[order] != frame){
+				animation.changed[order] = frame;
+				changed_orders[num_changed++] = order;
+			}
+			full |= apply_delta(&animation, &context, &deltas[next], order);
+		}
+		
+		if(full){	//Render the whole frame, which also fills in the hit of every pixel
+			init_render_context(&context, scene, &fb, animation.hits, NULL, N, M, 0, 0, options);
+			memset(fb.data, 0, fb.stride*M);
+			raycast_scene(scene, &fb, animation.hits, NULL, N, M, 0, 0, options, totals);
+			retraced = N*M;
+		}else{
+			retraced = retrace_frame(&animation, &context, &worker, changed_orders, num_changed, frame);
+		}
+		image_start = now_seconds();
+		phases->raycast_scene += image_start - start;
+		frame_name(output, frame, name);
+		create_image(&fb, name);
+		phases->create_image += now_seconds() - image_start;
+		if(options->stats){
+			printf("frame %d: %d objects changed, %d of %d pixels retraced in %.3f ms\n", frame, num_changed, retraced,
+				N*M, (now_seconds() - start)*1000);
+		}
+	}
+	add_stats(totals, &worker.stats);
+	for(i = 5; i >= 0; i--){
+		disown(&owned[i]);
+	}
+	free_worker(&worker);
+	free_framebuffer(&fb);
+	free_animation(&animation);
+	free(deltas);
+	free(changed_orders);
+	free(name);
+}
+
+#define PROGRESSIVE_STEP 4	//The first --progressive pass traces every 4th pixel of every 4th row, 1/16 of the rays
+
+typedef struct {	//One level of a progressive render, shared out between threads a row at a time
+	RenderContext* context;
+	Hit* hits;	//Closest hit of every pixel of the image
+	unsigned char* traced;	//Step of the level that traced each pixel, 0 if it has not been traced yet
+	int step;	//This level traces the pixels on every step'th column of every step'th row
+	int next_row;
+	double deadline;	//now_seconds() at which to stop handing out rows, 0 for none
+	int stopped;	//Set when the deadline passed before every row was handed out
+	pthread_mutex_t lock;
+	int num_workers;
+} ProgressiveJob;
+
+typedef struct {	//Per thread arguments for progressive_worker()
+	ProgressiveJob* job;
+	Worker worker;
+} ProgressiveArgs;
+
+static void* progressive_worker(void* input){	//Thread body: trace the new pixels of rows of the level until they or the time run out
+	ProgressiveArgs* args = input;
+	ProgressiveJob* job = args->job;
+	RenderContext* context = job->context;
+	long long work;
+	size_t pixel;
+	int row;
+	int x;
+	
+	while(1){
+		pthread_mutex_lock(&job->lock);
+		if(job->next_row < context->M && job->deadline > 0 && now_seconds() > job->deadline){
+			job->stopped = 1;
+		}
+		row = job->stopped ? context->M : job->next_row;
+		job->next_row += job->step;
+		pthread_mutex_unlock(&job->lock);
+		if(row >= context->M) break;
+		for(x = 0; x < context->N; x += job->step){
+			pixel = (size_t)row*context->N + x;
+			if(job->traced[pixel] != 0) continue;	//A coarser level already traced it
+			work = args->worker.stats.nodes_visited + args->worker.stats.sphere_tests;
+			trace_pixel(context, &args->worker, x, context->M - 1 - row, &job->hits[pixel]);
+			record_cost(context, x, context->M - 1 - row, args->worker.stats.nodes_visited + args->worker.stats.sphere_tests
+				- work + context->scene->plane_objects);
+			job->traced[pixel] = job->step;
+		}
+	}
+	return NULL;
+}
+
+static void release_progressive_workers(void* input){	//Frees the workers of a progressive level when one of them failed
+	ProgressiveArgs* args = input;
+	int i;
+	for(i = 0; i < args[0].job->num_workers; i++){
+		free_worker(&args[i].worker);
+	}
+}
+
+static void fill_progressive(Framebuffer* fb, const Hit* hits, const unsigned char* traced){	//Colors every pixel from the finest traced pixel covering it
+	int row;
+	int x;
+	int step;
+	size_t pixel;
+	memset(fb->data, 0, fb->stride*fb->height);
+	for(row = 0; row < fb->height; row++){
+		for(x = 0; x < fb->width; x++){
+			for(step = 1; step <= PROGRESSIVE_STEP; step *= 2){	//The first level traced every pixel at a multiple of PROGRESSIVE_STEP
+				pixel = (size_t)(row - row % step)*fb->width + x - x % step;
+				if(traced[pixel] != 0) break;
+			}
+			if(hits[pixel].color != NULL){
+				store_pixel(fb, x, row, hits[pixel].color);
+			}
+		}
+	}
+}
+
+//Progressive rendering for --progressive. The first level traces 1/16 of the pixels, one in every PROGRESSIVE_STEP by
+//PROGRESSIVE_STEP block, and each level after it halves the step and traces only the pixels no earlier level did. An
+//image is made by giving every pixel the color of the finest traced pixel at the corner of its block, so once the last
+//level is done the image is the same as a normal render. The first level always finishes, later levels stop handing
+//out rows once options->deadline seconds of rendering have passed (0 for no limit), and the best image so far is
+//written to output.
+//With options->snapshots the image after each level is written to output-0000.ppm, output-0001.ppm, ...
+static void progressive_render(const Scene* scene, const char* output, int N, int M, float* cost, RenderOptions* options,
+						RayStats* totals, PhaseTimes* phases){
+	RenderContext context;
+	ProgressiveJob job;
+	ProgressiveArgs* args;
+	Thread* threads;
+	Framebuffer fb;
+	char* name = malloc(strlen(output) + 16);
+	Owned owned[7];
+	int level = 0;
+	int finished = 1;
+	long long rays;
+	double start = now_seconds();
+	double image_start;
+	int i;
+	
+	job.hits = malloc(sizeof(Hit)*((size_t)N*M + 1));
+	job.traced = calloc((size_t)N*M + 1, 1);
+	own(&owned[0], free, name);
+	own(&owned[1], free, job.hits);
+	own(&owned[2], free, job.traced);
+	if(name == NULL || job.hits == NULL || job.traced == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Not enough memory for a %d by %d image", N, M);
+	}
+	create_framebuffer(&fb, N, M, options->format);
+	own(&owned[3], release_framebuffer, &fb);
+	init_render_context(&context, scene, &fb, NULL, cost, N, M, 0, 0, options);
+	job.context = &context;
+	job.num_workers = options->threads > 1 ? options->threads : 1;
+	args = malloc(sizeof(ProgressiveArgs)*job.num_workers);
+	threads = malloc(sizeof(Thread)*job.num_workers);
+	own(&owned[4], free, args);
+	own(&owned[5], free, threads);
+	if(args == NULL || threads == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory starting %d threads", job.num_workers);
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	
+	for(job.step = PROGRESSIVE_STEP; job.step >= 1 && finished; job.step /= 2, level++){
+		job.next_row = 0;
+		job.stopped = 0;
+		job.deadline = job.step == PROGRESSIVE_STEP || options->deadline == 0 ? 0 : start + options->deadline;
+		for(i = 0; i < job.num_workers; i++){
+			args[i].job = &job;
+			init_worker(&args[i].worker);
+			if(job.num_workers > 1) start_thread(&threads[i], progressive_worker, &args[i]);
+		}
+		own(&owned[6], release_progressive_workers, args);
+		if(job.num_workers == 1){	//Serial path, no threads
+			progressive_worker(&args[0]);
+		}else{
+			join_threads(threads, job.num_workers);
+		}
+		disown(&owned[6]);
+		rays = 0;
+		for(i = 0; i < job.num_workers; i++){
+			rays += args[i].worker.stats.rays;
+			add_stats(totals, &args[i].worker.stats);
+			free_worker(&args[i].worker);
+		}
+		finished = !job.stopped;
+		if(options->stats){
+			printf("progressive: level %d, step %d, %lld rays, %s at %.3f ms\n", level, job.step, rays,
+				finished ? "done" : "out of time", (now_seconds() - start)*1000);
+		}
+		if(options->snapshots && rays > 0 && (job.step > 1 || !finished)){	//The last level is the output itself
+			image_start = now_seconds();
+			fill_progressive(&fb, job.hits, job.traced);
+			frame_name(output, level, name);
+			create_image(&fb, name);
+			phases->create_image += now_seconds() - image_start;
+		}
+	}
+	phases->raycast_scene += now_seconds() - start;
+	image_start = now_seconds();
+	fill_progressive(&fb, job.hits, job.traced);
+	create_image(&fb, output);
+	phases->create_image += now_seconds() - image_start;
+	
+	for(i = 5; i >= 0; i--){
+		disown(&owned[i]);
+	}
+	pthread_mutex_destroy(&job.lock);
+	free_framebuffer(&fb);
+	free(job.hits);
+	free(job.traced);
+	free(args);
+	free(threads);
+	free(name);
+}
+
+//Picks the cameras --cameras names, "all" or a comma separated list of names, in the order given. Names are checked
+//here rather than in the parser, they end up in file names. Returns the number of cameras. *cameras is set before a
+//name in list is looked at, so it can be freed after an error.
+static int find_cameras(Object** object_array, int object_counter, const char* list, Object*** cameras){
+	int num_cameras = 0;
+	int count = 0;
+	int i;
+	int j;
+	
+	for(i = 0; i < object_counter + 1; i++){
+		if(object_array[i]->kind != 0) continue;
+		num_cameras++;
+		if(object_array[i]->camera.name == NULL) continue;
+		if(object_array[i]->camera.name[0] == '\0' || strchr(object_array[i]->camera.name, '/') != NULL){
+			fail(RAYCAST_ERROR_INPUT, "Camera name \"%s\" can not be used in a file name", object_array[i]->camera.name);
+		}
+		for(j = 0; j < i; j++){
+			if(object_array[j]->kind == 0 && object_array[j]->camera.name != NULL
+				&& strcmp(object_array[j]->camera.name, object_array[i]->camera.name) == 0){
+				fail(RAYCAST_ERROR_INPUT, "Camera \"%s\" is defined twice", object_array[i]->camera.name);
+			}
+		}
+	}
+	*cameras = allocate(sizeof(Object*)*(num_cameras + 1));
+	if(strcmp(list, "all") == 0){
+		for(i = 0; i < object_counter + 1; i++){
+			if(object_array[i]->kind != 0) continue;
+			if(object_array[i]->camera.name == NULL){	//Each view is written to a file named after its camera
+				fail(RAYCAST_ERROR_INPUT, "Every camera needs a \"name\" to be rendered with --cameras all");
+			}
+			(*cameras)[count++] = object_array[i];
+		}
+		return count;
+	}
+	while(*list != '\0'){
+		int length = strcspn(list, ",");
+		Object* camera = NULL;
+		for(i = 0; i < object_counter + 1 && camera == NULL; i++){
+			if(object_array[i]->kind == 0 && object_array[i]->camera.name != NULL
+				&& (int)strlen(object_array[i]->camera.name) == length
+				&& strncmp(object_array[i]->camera.name, list, length) == 0){
+				camera = object_array[i];
+			}
+		}
+		if(camera == NULL){
+			fail(RAYCAST_ERROR_ARGUMENT, "Unknown camera \"%.*s\"", length, list);
+		}
+		for(j = 0; j < count; j++){
+			if((*cameras)[j] == camera){
+				fail(RAYCAST_ERROR_ARGUMENT, "Camera \"%s\" is listed twice", camera->camera.name);
+			}
+		}
+		if(count >= num_cameras){
+			fail(RAYCAST_ERROR_ARGUMENT, "More cameras listed than the scene has");
+		}
+		(*cameras)[count++] = camera;
+		list += length;
+		if(*list == ',') list++;
+	}
+	return count;
+}
+
+static void camera_name(const char* output, const char* camera, char* name){	//out.ppm becomes out-front.ppm for the camera named front
+	int length = strlen(output) - 4;	//argument_checker() made sure output ends in .ppm or .qoi
+	sprintf(name, "%.*s-%s%s", length, output, camera, output + length);
+}
+
+typedef struct {	//The tiles of every view of a --cameras batch, numbered one view after another
+	RenderContext* contexts;
+	int* first_tile;	//Number of each view's first tile, and the total after the last view
+	int num_views;
+	TileQueue* queues;
+	int num_workers;
+} ViewBatch;
+
+typedef struct {	//Per thread arguments for view_worker()
+	ViewBatch* batch;
+	int id;
+	Worker worker;
+} ViewWorkerArgs;
+
+static void raycast_batch_tile(ViewBatch* batch, Worker* worker, int tile){	//Finds the view a batch tile belongs to
+	int low = 0;
+	int high = batch->num_views - 1;
+	while(low < high){
+		int middle = (low + high + 1)/2;
+		if(batch->first_tile[middle] <= tile){
+			low = middle;
+		}else{
+			high = middle - 1;
+		}
+	}
+	raycast_tile(&batch->contexts[low], worker, tile - batch->first_tile[low]);
+}
+
+static void* view_worker(void* input){	//Thread body, like render_worker() over the tiles of all views
+	ViewWorkerArgs* args = input;
+	ViewBatch* batch = args->batch;
+	int victim;
+	int tile;
+	
+	while((tile = pop_tile(&batch->queues[args->id])) >= 0){
+		raycast_batch_tile(batch, &args->worker, tile);
+	}
+	victim = (args->id + 1) % batch->num_workers;
+	while(victim != args->id){
+		if((tile = steal_tile(&batch->queues[victim])) >= 0){
+			raycast_batch_tile(batch, &args->worker, tile);
+		}else{
+			victim = (victim + 1) % batch->num_workers;
+		}
+	}
+	return NULL;
+}
+
+typedef struct {	//What render_cameras() makes for its views, all of it freed by release_views()
+	Scene* views;	//Moved copies of the scene
+	Bins* bins;
+	Framebuffer* fbs;
+	Hit** hits;
+	int num_views;
+} CameraViews;
+
+static void release_views(void* input){	//Frees the views of render_cameras(), including ones it did not get to
+	CameraViews* made = input;
+	int v;
+	for(v = 0; v < made->num_views; v++){
+		free_translated_scene(&made->views[v]);
+		free_bins(&made->bins[v]);
+		free_framebuffer(&made->fbs[v]);
+		free(made->hits[v]);
+	}
+	free(made->views);
+	free(made->bins);
+	free(made->fbs);
+	free(made->hits);
+}
+
+static void release_view_threads(void* input){	//Frees the queues and workers of render_cameras() when a thread failed
+	ViewWorkerArgs* args = input;
+	ViewBatch* batch = args[0].batch;
+	int i;
+	for(i = 0; i < batch->num_workers; i++){
+		free_worker(&args[i].worker);
+		free_tile_queue(&batch->queues[i]);
+	}
+	free(batch->queues);
+	free(args);
+}
+
+//Renders the scene from each camera in cameras into its own N by M image, named after the camera. The views share the
+//parsed scene and its BVH, each only gets moved copies of the positions (translate_scene()). Their tiles go into one
+//set of queues, so threads that finish one view carry on with the next instead of waiting for a slow view to end.
+static void render_cameras(const Scene* scene, Object** cameras, int num_views, const char* output, int N, int M,
+					RenderOptions* options, RayStats* totals, PhaseTimes* phases){
+	CameraViews made;
+	ViewBatch batch;
+	ViewWorkerArgs* args;
+	Thread* threads;
+	Owned owned[6];
+	struct stat output_stat;
+	char* name = malloc(strlen(output) + 130);	//Camera names are at most 128 characters
+	double start = now_seconds();
+	int per_worker;
+	int v;
+	int i;
 	
-	object_counter = read_scene(argv[3], object_array);	//Parse .json scene file
-	move_camera_to_front(object_array, object_counter);	//Make camera the first object in our object array
-	raycast_scene(object_array, object_counter, pixel_buffer, width, height);	//Raycast our scene into the pixel array
-	create_image(pixel_buffer, argv[4], width, height);	//Put info from pixel array into a P6 PPM file
+	made.views = calloc(num_views, sizeof(Scene));
+	made.bins = calloc(num_views, sizeof(Bins));
+	made.fbs = calloc(num_views, sizeof(Framebuffer));
+	made.hits = calloc(num_views, sizeof(Hit*));
+	made.num_views = num_views;
+	batch.contexts = malloc(sizeof(RenderContext)*num_views);
+	batch.first_tile = malloc(sizeof(int)*(num_views + 1));
+	if(name == NULL || made.views == NULL || made.bins == NULL || made.fbs == NULL || made.hits == NULL
+		|| batch.contexts == NULL || batch.first_tile == NULL){	//release_views() needs all of its arrays
+		free(name);
+		free(made.views);
+		free(made.bins);
+		free(made.fbs);
+		free(made.hits);
+		free(batch.contexts);
+		free(batch.first_tile);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory for %d views", num_views);
+	}
+	own(&owned[0], free, name);
+	own(&owned[1], free, batch.contexts);
+	own(&owned[2], free, batch.first_tile);
+	own(&owned[3], release_views, &made);
+	batch.num_views = num_views;
+	batch.first_tile[0] = 0;
+	for(v = 0; v < num_views; v++){
+		Scene* view = &made.views[v];
+		translate_scene(scene, cameras[v]->camera.position, view);
+		view->camera_width = cameras[v]->camera.width;
+		view->camera_height = cameras[v]->camera.height;
+		if(options->precision == PRECISION_FLOAT){
+			bake_float_scene(view);
+		}
+		if(options->accel == ACCEL_BINS){
+			build_bins(view, N, M, &made.bins[v]);
+			view->bins = &made.bins[v];
+		}
+		create_framebuffer(&made.fbs[v], N, M, options->format);
+		if(options->aa_samples > 0){
+			made.hits[v] = malloc(sizeof(Hit)*((size_t)N*M + 1));
+			if(made.hits[v] == NULL){
+				fail(RAYCAST_ERROR_MEMORY, "Not enough memory for a %d by %d image", N, M);
+			}
+		}
+		init_render_context(&batch.contexts[v], view, &made.fbs[v], made.hits[v], NULL, N, M, 0, 0, options);
+		batch.first_tile[v + 1] = batch.first_tile[v] + batch.contexts[v].tiles_x*batch.contexts[v].tiles_y;
+	}
+	if(options->stats){
+		printf("cameras: %d views, moved copies of the scene made in %.3f ms\n", num_views, (now_seconds() - start)*1000);
+	}
+	phases->build_scene += now_seconds() - start;
 	
-	return 0;
-}
\ No newline at end of file
+	start = now_seconds();
+	batch.num_workers = options->threads > 1 ? options->threads : 1;
+	per_worker = (batch.first_tile[num_views] + batch.num_workers - 1)/batch.num_workers;
+	batch.queues = malloc(sizeof(TileQueue)*batch.num_workers);
+	threads = malloc(sizeof(Thread)*batch.num_workers);
+	args = malloc(sizeof(ViewWorkerArgs)*batch.num_workers);
+	if(batch.queues == NULL || threads == NULL || args == NULL){
+		free(batch.queues);
+		free(threads);
+		free(args);
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory starting %d threads", batch.num_workers);
+	}
+	for(i = 0; i < batch.num_workers; i++){
+		int first = i*per_worker;
+		int last = first + per_worker;
+		if(first > batch.first_tile[num_views]) first = batch.first_tile[num_views];
+		if(last > batch.first_tile[num_views]) last = batch.first_tile[num_views];
+		init_tile_queue(&batch.queues[i], first, last);
+		args[i].batch = &batch;
+		args[i].id = i;
+		init_worker(&args[i].worker);
+	}
+	own(&owned[4], free, threads);
+	own(&owned[5], release_view_threads, args);
+	if(batch.num_workers == 1){	//No threads to start, the one worker drains every tile itself
+		view_worker(&args[0]);
+	}else{
+		for(i = 0; i < batch.num_workers; i++){
+			start_thread(&threads[i], view_worker, &args[i]);
+		}
+		join_threads(threads, batch.num_workers);
+	}
+	disown(&owned[5]);
+	disown(&owned[4]);
+	for(i = 0; i < batch.num_workers; i++){
+		add_stats(totals, &args[i].worker.stats);
+		free_worker(&args[i].worker);
+		free_tile_queue(&batch.queues[i]);
+	}
+	free(batch.queues);
+	free(threads);
+	free(args);
+	for(v = 0; v < num_views; v++){	//Anti-aliasing runs view by view, it shares its edges out between the threads itself
+		if(made.hits[v] != NULL){
+			antialias(&made.views[v], &made.fbs[v], made.hits[v], N, M, options, totals);
+			free(made.hits[v]);
+			made.hits[v] = NULL;
+		}
+	}
+	phases->raycast_scene = now_seconds() - start;
+	
+	start = now_seconds();
+	for(v = 0; v < num_views; v++){
+		camera_name(output, cameras[v]->camera.name, name);
+		create_image(&made.fbs[v], name);
+		if(options->stats && stat(name, &output_stat) == 0){
+			printf("output: %s, %lld bytes, %.1fx smaller than raw RGB\n", name, (long long)output_stat.st_size,
+				output_stat.st_size > 0 ? 3.0*N*M/output_stat.st_size : 0);
+		}
+		free_framebuffer(&made.fbs[v]);	//Written out, the rest of the views are freed at the end
+	}
+	phases->create_image = now_seconds() - start;
+	
+	for(i = 3; i >= 0; i--){
+		disown(&owned[i]);
+	}
+	release_views(&made);
+	free(batch.contexts);
+	free(batch.first_tile);
+	free(name);
+}
+
+static int camera_at_origin(const Object* camera){
+	return camera->camera.position[0] == 0 && camera->camera.position[1] == 0 && camera->camera.position[2] == 0;
+}
+
+static void move_camera_to_front(Object** object_array, int object_count){	//Moves the first camera object to the front of object_array
+	//Any other cameras stay where they are, after it and in file order, for --cameras
+	Object* temp_object;
+	int counter = 0;
+	while(counter < object_count + 1){	//Iterate through all objects in object_array
+		if(object_array[counter]->kind == 0){
+			if(counter != 0){	//If the camera is found further in the array, switch first object with it
+				temp_object = object_array[0];
+				object_array[0] = object_array[counter];
+				object_array[counter] = temp_object;
+			}
+			return;
+		}
+		counter++;
+	}
+}
+
+typedef struct {	//What raycast_run() and raycast_compile() hold, cleared first and freed by release_run()
+	Arena arena;	//Holds every object read from the scene file
+	Object** object_array;	//Array of object pointers, filled in by read_scene()
+	Object** file_objects;	//object_array in file order, for --frames
+	Object** cameras;	//Views of --cameras
+	Scene scene;	//As built, or as mapped from a .rcs file
+	Scene view;	//scene moved so the camera is at the origin, when it is not there already
+	Bins bins;
+	Framebuffer fb;
+	Hit* hits;
+	float* cost;
+} Run;
+
+static void release_run(void* input){	//Frees everything a Run holds, whatever point it got to
+	Run* run = input;
+	free(run->cost);
+	free(run->hits);
+	free_framebuffer(&run->fb);
+	free_bins(&run->bins);
+	free_translated_scene(&run->view);
+	free_float_scene(&run->scene);
+	free_scene(&run->scene);
+	free(run->cameras);
+	free(run->file_objects);
+	free(run->object_array);
+	free_arena(&run->arena);
+}
+
+int raycast_compile(const char* input, const char* output, RaycastError* error){
+	ErrorTrap trap;
+	Run run;	//Only the objects and the scene are used
+	Owned owned;
+	Scene* scene = &run.scene;
+	size_t file_size;
+	int object_counter;
+	int i;
+	
+	memset(&run, 0, sizeof(Run));
+	if(setjmp(trap.jump) != 0) return leave_trap(&trap, error);
+	enter_trap(&trap);
+	own(&owned, release_run, &run);
+	object_counter = read_scene(input, &run.object_array, &run.arena, &file_size);
+	move_camera_to_front(run.object_array, object_counter);
+	build_scene(run.object_array, object_counter, &run.scene);
+	if(run.scene.num_groups > 0){	//A .rcs file only has room for the arrays of plain spheres and planes
+		fail(RAYCAST_ERROR_INPUT, "Scenes with groups or instances can not be compiled");
+	}
+	for(i = 1; i < object_counter + 1; i++){	//The header has room for one camera
+		if(run.object_array[i]->kind == 0){
+			fail(RAYCAST_ERROR_INPUT, "Scenes with more than one camera can not be compiled");
+		}
+	}
+	if(!camera_at_origin(run.object_array[0])){	//Compile the scene as the camera sees it, from the origin
+		translate_scene(&run.scene, run.object_array[0]->camera.position, &run.view);
+		scene = &run.view;
+	}
+	write_compiled_scene(scene, object_counter + 1, output);
+	return leave_trap(&trap, error);	//Which frees run
+}
+
+typedef struct {	//One part of a region render being merged, see open_partial_image()
+	FILE* fp;
+	char* name;
+	int region[4];
+} RegionPart;
+
+static int compare_parts(const void* a, const void* b){	//Orders parts by their first column
+	return ((const RegionPart*)a)->region[0] - ((const RegionPart*)b)->region[0];
+}
+
+typedef struct {	//What raycast_merge() holds, freed by release_merge()
+	RegionPart* parts;	//Files not opened yet are NULL
+	int num_parts;
+	RegionPart** active;
+	unsigned char* row_buffer;
+	ImageFile* image;	//Output being written
+} Merge;
+
+static void release_merge(void* input){	//Closes the files of raycast_merge() and frees what it allocated
+	Merge* merge = input;
+	int i;
+	for(i = 0; merge->parts != NULL && i < merge->num_parts; i++){
+		if(merge->parts[i].fp != NULL) fclose(merge->parts[i].fp);
+	}
+	if(merge->image != NULL) release_image(merge->image);
+	free(merge->parts);
+	free(merge->active);
+	free(merge->row_buffer);
+}
+
+//raycast --merge output.ppm part.ppm... streams the parts of a --region render into one P6 image, a row at a time.
+//Every pixel of the image has to come from exactly one part.
+int raycast_merge(const char* output, char** part_names, int num_parts, RaycastError* error){
+	ErrorTrap trap;
+	Merge merge = {NULL, 0, NULL, NULL, NULL};
+	Owned owned;
+	RegionPart* parts;
+	RegionPart** active;
+	unsigned char* row_buffer;
+	ImageFile* image;
+	long long area = 0;
+	int width = 0, height = 0, part_width, part_height, max_value;
+	int row, counter, num_active, x;
+	
+	if(setjmp(trap.jump) != 0) return leave_trap(&trap, error);
+	enter_trap(&trap);
+	own(&owned, release_merge, &merge);
+	parts = merge.parts = calloc(num_parts, sizeof(RegionPart));
+	merge.num_parts = num_parts;
+	active = merge.active = malloc(sizeof(RegionPart*)*num_parts);
+	if(parts == NULL || active == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	for(counter = 0; counter < num_parts; counter++){
+		int N, M;
+		parts[counter].name = part_names[counter];
+		parts[counter].fp = fopen(parts[counter].name, "rb");
+		if(parts[counter].fp == NULL){
+			fail(RAYCAST_ERROR_IO, "Could not open region file \"%s\"", parts[counter].name);
+		}
+		if(fscanf(parts[counter].fp, "P6 # region %d %d %d %d of %d %d %d %d %d", &parts[counter].region[0],
+					&parts[counter].region[1], &parts[counter].region[2], &parts[counter].region[3], &N, &M,
+					&part_width, &part_height, &max_value) != 9 || fgetc(parts[counter].fp) != '\n' || max_value != 255
+				|| part_width != parts[counter].region[2] - parts[counter].region[0]
+				|| part_height != parts[counter].region[3] - parts[counter].region[1]
+				|| part_width <= 0 || part_height <= 0 || parts[counter].region[0] < 0 || parts[counter].region[1] < 0
+				|| parts[counter].region[2] > N || parts[counter].region[3] > M){
+			fail(RAYCAST_ERROR_INPUT, "\"%s\" is not a region written by --region", parts[counter].name);
+		}
+		if(counter == 0){
+			width = N;
+			height = M;
+		}else if(N != width || M != height){
+			fail(RAYCAST_ERROR_INPUT, "\"%s\" is a region of a %d by %d image, not %d by %d", parts[counter].name, N, M,
+				width, height);
+		}
+		area += (long long)part_width*part_height;
+	}
+	if(area != (long long)width*height){
+		fail(RAYCAST_ERROR_INPUT, "Regions cover %lld pixels of a %d by %d image", area, width, height);
+	}
+	qsort(parts, num_parts, sizeof(RegionPart), compare_parts);
+	row_buffer = merge.row_buffer = allocate((size_t)width*3 + 1);
+	image = merge.image = open_image(output, width, height);
+	for(row = 0; row < height; row++){	//The parts covering a row have to line up end to end from column 0 to width
+		num_active = 0;
+		for(counter = 0; counter < num_parts; counter++){
+			if(parts[counter].region[1] <= row && row < parts[counter].region[3]){
+				active[num_active++] = &parts[counter];
+			}
+		}
+		x = 0;
+		for(counter = 0; counter < num_active; counter++){
+			if(active[counter]->region[0] != x){
+				fail(RAYCAST_ERROR_INPUT, "Regions %s at row %d column %d", active[counter]->region[0] > x ? "leave a gap"
+					: "overlap", row, x < active[counter]->region[0] ? x : active[counter]->region[0]);
+			}
+			part_width = active[counter]->region[2] - active[counter]->region[0];
+			if(fread(row_buffer + (size_t)x*3, 3, part_width, active[counter]->fp) != (size_t)part_width){
+				fail(RAYCAST_ERROR_INPUT, "\"%s\" is missing pixels", active[counter]->name);
+			}
+			x += part_width;
+		}
+		if(x != width){
+			fail(RAYCAST_ERROR_INPUT, "Regions leave a gap at row %d column %d", row, x);
+		}
+		write_pixels(image, row_buffer, width);
+	}
+	merge.image = NULL;	//close_image() frees it even when it fails
+	close_image(image);
+	return leave_trap(&trap, error);	//Which closes the parts and frees merge
+}
+
+#define AUTOTUNE_ROWS 64	//Height of each timed band, the largest tile size tried
+#define AUTOTUNE_MAX_BANDS 4
+#define AUTOTUNE_MARGIN 1.03	//A setting has to be this much faster to replace the one before it, so noise does not
+
+static const int autotune_tiles[] = {8, 16, 32, 64};
+static const int autotune_packets[] = {0, 2, 4, 8};
+
+typedef struct {	//The search of autotune()
+	const Scene* scene;
+	Framebuffer band;
+	int N;
+	int M;
+	int num_bands;
+	RenderOptions best;	//Fastest settings so far
+	double best_rate;	//Rays per second with them
+	int tried;
+	int stats;
+} Autotune;
+
+static double time_bands(Autotune* tune, RenderOptions* options){	//Renders the bands with options, returns rays per second
+	RayStats stats;
+	double start = now_seconds();
+	double elapsed;
+	int b;
+	memset(&stats, 0, sizeof(RayStats));
+	for(b = 0; b < tune->num_bands; b++){	//Spread from the top of the image to the bottom
+		int row = tune->num_bands == 1 ? (tune->M - tune->band.height)/2
+										: (int)((long long)(tune->M - tune->band.height)*b/(tune->num_bands - 1));
+		raycast_scene(tune->scene, &tune->band, NULL, NULL, tune->N, tune->M, 0, row, options, &stats);
+	}
+	elapsed = now_seconds() - start;
+	return elapsed > 0 ? stats.rays/elapsed : 0;
+}
+
+static void try_setting(Autotune* tune, RenderOptions* candidate){	//Keeps candidate if it beats the best settings
+	double rate = time_bands(tune, candidate);
+	tune->tried++;
+	if(tune->stats){
+		printf("autotune: tile %d, threads %d, packet %d, kernel %s: %.2f Mrays/s\n", candidate->tile_size,
+			candidate->threads, candidate->packet_size, candidate->kernel, rate/1e6);
+	}
+	if(rate > tune->best_rate*AUTOTUNE_MARGIN){
+		tune->best_rate = rate;
+		tune->best = *candidate;
+	}
+}
+
+static long long bucket(long long n){	//Rounds up to a power of two, so similar scenes share a profile entry
+	long long power = 1;
+	if(n <= 0) return 0;
+	while(power < n) power *= 2;
+	return power;
+}
+
+//Reads the entry for key from a tuning profile into options. Returns 0 when there is none, or it can not be used here.
+static int read_profile(const char* profile, const char* key, int packets, RenderOptions* options, double* rate){
+	const Kernels* table = options->precision == PRECISION_FLOAT ? float_kernel_table : kernel_table;
+	int count = sizeof(kernel_table)/sizeof(kernel_table[0]);
+	FILE* file = fopen(profile, "r");
+	char line[512];
+	char kernel[16];
+	size_t length = strlen(key);
+	int tile_size, threads, packet_size;
+	int found = 0;
+	int i;
+	
+	if(file == NULL) return 0;	//Nothing tuned yet
+	while(!found && fgets(line, sizeof(line), file) != NULL){
+		if(strncmp(line, key, length) != 0 || line[length] != ' ') continue;
+		if(sscanf(line + length, " tile_size=%d threads=%d packet=%d kernel=%15s mrays=%lf", &tile_size, &threads,
+				&packet_size, kernel, rate) != 5 || tile_size <= 0 || threads <= 0
+			|| (packet_size != 0 && (!packets || (packet_size != 2 && packet_size != 4 && packet_size != 8)))){
+			continue;
+		}
+		for(i = 0; i < count && !found; i++){	//A kernel this CPU can not run means measuring again
+			if(strcmp(table[i].name, kernel) == 0 && kernel_supported(&table[i])){
+				options->tile_size = tile_size;
+				options->threads = threads;
+				options->packet_size = packet_size;
+				options->kernel = table[i].name;
+				*rate *= 1e6;
+				found = 1;
+			}
+		}
+	}
+	fclose(file);
+	return found;
+}
+
+static void write_profile(const char* profile, const char* key, const RenderOptions* options, double rate){	//Adds or replaces the entry for key
+	char* temporary = allocate(strlen(profile) + 5);
+	char line[512];
+	size_t length = strlen(key);
+	FILE* old = fopen(profile, "r");
+	FILE* file;
+	int failed;
+	
+	sprintf(temporary, "%s.new", profile);
+	file = fopen(temporary, "w");
+	if(file == NULL){
+		if(old != NULL) fclose(old);
+		free(temporary);
+		fail(RAYCAST_ERROR_IO, "Could not write tuning profile \"%s\"", profile);
+	}
+	if(old != NULL){	//Keep the other entries
+		while(fgets(line, sizeof(line), old) != NULL){
+			if(strncmp(line, key, length) != 0 || line[length] != ' ') fputs(line, file);
+		}
+		fclose(old);
+	}
+	fprintf(file, "%s tile_size=%d threads=%d packet=%d kernel=%s mrays=%.2f\n", key, options->tile_size,
+		options->threads, options->packet_size, options->kernel, rate/1e6);
+	failed = ferror(file);
+	failed |= fclose(file) != 0;
+	failed = failed || rename(temporary, profile) != 0;	//Readers see the old file or the new one
+	free(temporary);
+	if(failed){
+		fail(RAYCAST_ERROR_IO, "Could not write tuning profile \"%s\"", profile);
+	}
+}
+
+//--autotune: sets options->tile_size, threads, packet_size and kernel to the fastest settings for this scene and
+//image size. Settings are timed on a few full width bands of the image, about an eighth of its rows, one knob at a
+//time: the kernel sets this CPU supports, then the packet size, then the thread count (powers of two up to the
+//number of cores), then the tile size, each time keeping the best of the others. With a tune_profile, the result is
+//stored under the scene's sphere, plane and instance counts and the image size (rounded up to powers of two), the
+//precision, accel, fast_rays and core count, and a later run with the same characteristics uses it without timing.
+//What it picked is printed only with options->stats.
+static void autotune(const Scene* scene, int N, int M, RenderOptions* options){
+	const Kernels* table = options->precision == PRECISION_FLOAT ? float_kernel_table : kernel_table;
+	int count = sizeof(kernel_table)/sizeof(kernel_table[0]);
+	int packets = options->accel != ACCEL_BINS && !options->fast_rays && !options->progressive;	//Those trace ray by ray
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	Autotune tune;
+	RenderOptions candidate;
+	Owned owned;
+	double start = now_seconds();
+	double rate;
+	char key[256];
+	int i;
+	
+	if(cores < 1) cores = 1;
+	snprintf(key, sizeof(key), "spheres=%lld planes=%lld instances=%lld pixels=%lld precision=%s accel=%s fast_rays=%d packets=%d cores=%ld",
+		bucket(scene->num_spheres), bucket(scene->plane_objects), bucket(scene->num_instances), bucket((long long)N*M),
+		options->precision == PRECISION_FLOAT ? "float" : "double", options->accel == ACCEL_BINS ? "bins" : "bvh",
+		options->fast_rays, packets, cores);
+	if(options->tune_profile != NULL && read_profile(options->tune_profile, key, packets, options, &rate)){
+		if(options->stats){	//Like the rest of --stats, stdout is the caller's otherwise
+			printf("autotune: tile %d, threads %d, packet %d, kernel %s from %s (%.2f Mrays/s when measured)\n",
+				options->tile_size, options->threads, options->packet_size, options->kernel, options->tune_profile, rate/1e6);
+		}
+		return;
+	}
+	
+	tune.scene = scene;
+	tune.N = N;
+	tune.M = M;
+	tune.num_bands = M/(8*AUTOTUNE_ROWS);
+	if(tune.num_bands < 1) tune.num_bands = 1;
+	if(tune.num_bands > AUTOTUNE_MAX_BANDS) tune.num_bands = AUTOTUNE_MAX_BANDS;
+	tune.tried = 0;
+	tune.stats = options->stats;
+	create_framebuffer(&tune.band, N, M < AUTOTUNE_ROWS ? M : AUTOTUNE_ROWS, options->format);
+	own(&owned, release_framebuffer, &tune.band);
+	
+	tune.best = *options;	//Start from one thread, 16 pixel tiles, no packets and the fastest kernels
+	tune.best.threads = 1;
+	tune.best.tile_size = 16;
+	tune.best.packet_size = 0;
+	tune.best.kernel = select_kernels("auto", options->precision)->name;
+	time_bands(&tune, &tune.best);	//Warm up the caches, the first timing would be slow whatever it tried
+	tune.best_rate = 0;
+	candidate = tune.best;
+	try_setting(&tune, &candidate);
+	for(i = 0; i < count; i++){
+		candidate = tune.best;
+		candidate.kernel = table[i].name;
+		if(kernel_supported(&table[i]) && strcmp(candidate.kernel, tune.best.kernel) != 0) try_setting(&tune, &candidate);
+	}
+	for(i = 1; packets && i < (int)(sizeof(autotune_packets)/sizeof(int)); i++){
+		candidate = tune.best;
+		candidate.packet_size = autotune_packets[i];
+		try_setting(&tune, &candidate);
+	}
+	for(i = 2; i < 2*cores; i *= 2){	//Powers of two below the core count, and the core count
+		candidate = tune.best;
+		candidate.threads = i < cores ? i : (int)cores;
+		try_setting(&tune, &candidate);
+	}
+	for(i = 0; i < (int)(sizeof(autotune_tiles)/sizeof(int)); i++){
+		candidate = tune.best;
+		candidate.tile_size = autotune_tiles[i];
+		if(candidate.tile_size != 16) try_setting(&tune, &candidate);
+	}
+	disown(&owned);
+	free_framebuffer(&tune.band);
+	
+	options->tile_size = tune.best.tile_size;
+	options->threads = tune.best.threads;
+	options->packet_size = tune.best.packet_size;
+	options->kernel = tune.best.kernel;
+	if(options->stats){
+		printf("autotune: tile %d, threads %d, packet %d, kernel %s, %.2f Mrays/s, %d settings timed on %d of %d rows in %.1f ms\n",
+			options->tile_size, options->threads, options->packet_size, options->kernel, tune.best_rate/1e6, tune.tried,
+			tune.num_bands*tune.band.height, M, (now_seconds() - start)*1000);
+	}
+	if(options->tune_profile != NULL){
+		write_profile(options->tune_profile, key, options, tune.best_rate);
+	}
+}
+
+void raycast_default_options(RenderOptions* options){
+	options->threads = 1;
+	options->tile_size = 16;
+	options->kernel = "auto";
+	options->stats = 0;
+	options->format = FORMAT_RGB8;
+	options->precision = PRECISION_DOUBLE;
+	options->accel = ACCEL_BVH;
+	options->packet_size = 0;
+	options->band_rows = 0;
+	options->frames = NULL;
+	options->heatmap = NULL;
+	options->region[0] = options->region[1] = options->region[2] = options->region[3] = 0;
+	options->aa_samples = 0;
+	options->aa_budget = -1;
+	options->progressive = 0;
+	options->deadline = 0;
+	options->snapshots = 0;
+	options->fast_rays = 0;
+	options->cameras = NULL;
+	options->autotune = 0;
+	options->tune_profile = NULL;
+}
+
+int raycast_run(int width, int height, const char* input, const char* output, const RenderOptions* run_options,
+				RaycastError* error){
+	ErrorTrap trap;
+	Run run;	//Everything below that has to be freed again, by leave_trap()
+	Owned owned;
+	Object** object_array;
+	RayStats totals;
+	PhaseTimes phases;
+	struct stat output_stat;
+	size_t file_size;
+	double start;
+	int object_counter;
+	int compiled;
+	RenderOptions options = *run_options;
+	Scene* scene = &run.scene;	//The scene as it is rendered
+	int num_cameras;
+	const char* periodPointer;
+	
+	memset(&run, 0, sizeof(Run));
+	if(setjmp(trap.jump) != 0) return leave_trap(&trap, error);
+	enter_trap(&trap);
+	own(&owned, release_run, &run);
+	if(width <= 0 || height <= 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "Width and height must be greater than 0");
+	}
+	periodPointer = strrchr(input, '.');	//Ensure that the input scene file has an extension .json, or .rcs when compiled
+	if(periodPointer == NULL){
+		fail(RAYCAST_ERROR_ARGUMENT, "Input scene file does not have a file extension");
+	}
+	if(strcmp(periodPointer, ".json") != 0 && strcmp(periodPointer, ".rcs") != 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "Input scene file is not of type JSON or RCS");
+	}
+	periodPointer = strrchr(output, '.');	//Ensure that the output picture file has an extension .ppm, or .qoi
+	if(periodPointer == NULL){
+		fail(RAYCAST_ERROR_ARGUMENT, "Output picture file does not have a file extension");
+	}
+	if(strcmp(periodPointer, ".ppm") != 0 && strcmp(periodPointer, ".qoi") != 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "Output picture file is not of type PPM or QOI");
+	}
+	if(options.frames != NULL && options.band_rows > 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "--frames can not be combined with --band-rows");
+	}
+	compiled = strcmp(strrchr(input, '.'), ".rcs") == 0;
+	if(options.frames != NULL && compiled){	//Frames change objects, which a compiled scene no longer has
+		fail(RAYCAST_ERROR_ARGUMENT, "--frames needs a .json scene");
+	}
+	if(options.aa_samples > 0 && (options.frames != NULL || options.band_rows > 0)){	//Edges need the whole image
+		fail(RAYCAST_ERROR_ARGUMENT, "--aa can not be combined with --frames or --band-rows");
+	}
+	if(options.frames != NULL && options.heatmap != NULL){
+		fail(RAYCAST_ERROR_ARGUMENT, "--frames can not be combined with --heatmap");
+	}
+#ifndef RAYCAST_STATS
+	if(options.heatmap != NULL){	//The heatmap draws nodes_visited and sphere_tests, which only make STATS=1 counts
+		fail(RAYCAST_ERROR_ARGUMENT, "--heatmap needs a build with make STATS=1");
+	}
+#endif
+	if(options.progressive && (options.frames != NULL || options.band_rows > 0 || options.region[2] > 0
+								|| options.aa_samples > 0 || options.packet_size > 0)){	//Levels are traced ray by ray over the whole image
+		fail(RAYCAST_ERROR_ARGUMENT, "--progressive can not be combined with --frames, --band-rows, --region, --aa or --packet");
+	}
+	if(options.accel == ACCEL_BINS && (options.frames != NULL || options.packet_size > 0)){	//Both walk the BVH
+		fail(RAYCAST_ERROR_ARGUMENT, "--accel bins can not be combined with --frames or --packet");
+	}
+	if(options.fast_rays && (options.frames != NULL || options.progressive || options.packet_size > 0)){	//These trace pixels out of row order
+		fail(RAYCAST_ERROR_ARGUMENT, "--fast-rays can not be combined with --frames, --progressive or --packet");
+	}
+	if(options.cameras != NULL && (options.frames != NULL || options.progressive || options.band_rows > 0
+								|| options.region[2] > 0 || options.heatmap != NULL)){	//Each view is rendered whole into its own image
+		fail(RAYCAST_ERROR_ARGUMENT, "--cameras can not be combined with --frames, --progressive, --band-rows, --region or --heatmap");
+	}
+	if(options.cameras != NULL && options.autotune){	//The views would each need their own timing
+		fail(RAYCAST_ERROR_ARGUMENT, "--autotune can not be combined with --cameras");
+	}
+	if(options.cameras != NULL && compiled){	//A compiled scene keeps only the camera it was compiled for
+		fail(RAYCAST_ERROR_ARGUMENT, "--cameras needs a .json scene");
+	}
+	if(options.snapshots && !options.progressive){
+		fail(RAYCAST_ERROR_ARGUMENT, "--snapshots needs --progressive");
+	}
+	
+	if(options.region[2] > 0){
+		if(options.region[2] > width || options.region[3] > height){
+			fail(RAYCAST_ERROR_ARGUMENT, "Region does not fit inside of a %d by %d image", width, height);
+		}
+		//Anti-aliasing looks at the neighbors of a pixel, which may belong to another region
+		if(options.frames != NULL || options.aa_samples > 0 || options.heatmap != NULL){
+			fail(RAYCAST_ERROR_ARGUMENT, "--region can not be combined with --frames, --aa or --heatmap");
+		}
+		if(is_qoi(output)){	//raycast --merge reads where a region goes from its P6 header
+			fail(RAYCAST_ERROR_ARGUMENT, "--region output must be a .ppm file");
+		}
+	}
+	
+	memset(&phases, 0, sizeof(PhaseTimes));
+	start = now_seconds();
+	if(compiled){	//A compiled scene is already built, map it and go
+		object_counter = load_compiled_scene(input, &run.scene, &file_size) - 1;
+	}else{
+		object_counter = read_scene(input, &run.object_array, &run.arena, &file_size);	//Parse .json scene file
+	}
+	object_array = run.object_array;
+	phases.read_scene = now_seconds() - start;
+	if(options.stats){
+		printf("read_scene: %d objects, %.2f MB in %.3f ms (%.1f MB/s)\n", object_counter + 1, file_size/1e6,
+			phases.read_scene*1000, phases.read_scene > 0 ? file_size/1e6/phases.read_scene : 0);
+	}
+	if(options.frames != NULL){	//Changes in the frames file number objects in file order, so keep a copy of it
+		run.file_objects = allocate(sizeof(Object*)*(object_counter + 1));
+		memcpy(run.file_objects, object_array, sizeof(Object*)*(object_counter + 1));
+	}
+	if(!compiled){
+		start = now_seconds();
+		move_camera_to_front(object_array, object_counter);	//Make camera the first object in our object array
+		phases.move_camera_to_front = now_seconds() - start;
+		start = now_seconds();
+		build_scene(object_array, object_counter, &run.scene);	//Pack the objects into arrays by kind for the intersection kernels
+		phases.build_scene = now_seconds() - start;
+	}
+	if(options.frames != NULL && scene->num_groups > 0){	//Frames change plain objects, and retrace what they covered
+		fail(RAYCAST_ERROR_ARGUMENT, "--frames can not be used with a scene that has groups or instances");
+	}
+	if(options.cameras != NULL){	//Render each view from the one built scene and stop
+		num_cameras = find_cameras(object_array, object_counter, options.cameras, &run.cameras);
+		memset(&totals, 0, sizeof(RayStats));
+		render_cameras(scene, run.cameras, num_cameras, output, width, height, &options, &totals, &phases);
+		if(options.stats){
+			report_bvh_stats(scene, &totals);
+			report_phases(&phases, &totals);
+		}
+		return leave_trap(&trap, error);
+	}
+	if(!compiled && !camera_at_origin(object_array[0])){	//Move the scene so the camera is at the origin again
+		if(options.frames != NULL){	//Frames change objects in place, in the scene file's coordinates
+			fail(RAYCAST_ERROR_ARGUMENT, "--frames needs the camera at [0, 0, 0]");
+		}
+		start = now_seconds();
+		translate_scene(&run.scene, object_array[0]->camera.position, &run.view);
+		scene = &run.view;
+		phases.build_scene += now_seconds() - start;
+	}
+	if(options.precision == PRECISION_FLOAT){	//The float kernels read their own copy of the scene
+		start = now_seconds();
+		bake_float_scene(scene);
+		phases.build_scene += now_seconds() - start;
+	}
+	if(options.accel == ACCEL_BINS){	//Sort the spheres into screen tiles, after the float copy so the tiles get one too
+		start = now_seconds();
+		build_bins(scene, width, height, &run.bins);
+		scene->bins = &run.bins;
+		phases.build_scene += now_seconds() - start;
+	}
+	if(options.autotune){	//Time the settings on the scene as it will be rendered
+		start = now_seconds();
+		autotune(scene, width, height, &options);
+		phases.autotune = now_seconds() - start;
+	}
+	memset(&totals, 0, sizeof(RayStats));
+	if(options.heatmap != NULL){
+		run.cost = calloc((size_t)width*height + 1, sizeof(float));
+		if(run.cost == NULL){
+			fail(RAYCAST_ERROR_MEMORY, "Not enough memory for a %d by %d heatmap", width, height);
+		}
+	}
+	if(is_qoi(output) && options.band_rows == 0 && options.frames == NULL && !options.progressive
+		&& options.aa_samples == 0){	//Encode finished bands on the writer thread while the rest of the image renders
+		options.band_rows = QOI_BAND_ROWS;
+	}
+	if(options.frames != NULL){	//Render an animation, retracing only what changes between frames
+		render_frames(scene, object_array, run.file_objects, object_counter, output, width, height, &options, &totals,
+			&phases);
+	}else if(options.progressive){	//Render coarse to fine until the deadline
+		progressive_render(scene, output, width, height, run.cost, &options, &totals, &phases);
+	}else if(options.band_rows > 0){	//Render and write the image a band at a time
+		stream_image(scene, output, width, height, run.cost, &options, &totals, &phases);
+	}else if(options.region[2] > 0){	//Render only the region and write it as a partial image
+		create_framebuffer(&run.fb, options.region[2] - options.region[0], options.region[3] - options.region[1],
+			options.format);
+		start = now_seconds();
+		raycast_scene(scene, &run.fb, NULL, NULL, width, height, options.region[0], options.region[1], &options, &totals);
+		phases.raycast_scene = now_seconds() - start;
+		start = now_seconds();
+		create_partial_image(&run.fb, output, options.region, width, height);
+		phases.create_image = now_seconds() - start;
+	}else{
+		create_framebuffer(&run.fb, width, height, options.format);	//Create one contiguous image to hold color values
+		if(options.aa_samples > 0){	//Anti-aliasing finds edges from the closest hit of every pixel
+			run.hits = malloc(sizeof(Hit)*((size_t)width*height + 1));
+			if(run.hits == NULL){
+				fail(RAYCAST_ERROR_MEMORY, "Not enough memory for a %d by %d image", width, height);
+			}
+		}
+		start = now_seconds();
+		raycast_scene(scene, &run.fb, run.hits, run.cost, width, height, 0, 0, &options, &totals);	//Raycast our scene into the framebuffer
+		if(run.hits != NULL){
+			antialias(scene, &run.fb, run.hits, width, height, &options, &totals);
+		}
+		phases.raycast_scene = now_seconds() - start;
+		start = now_seconds();
+		create_image(&run.fb, output);	//Put info from the framebuffer into a P6 PPM file
+		phases.create_image = now_seconds() - start;
+	}
+	if(options.stats){
+		if(options.frames == NULL && stat(output, &output_stat) == 0){
+			printf("output: %s, %lld bytes, %.1fx smaller than raw RGB\n", output, (long long)output_stat.st_size,
+				output_stat.st_size > 0 ? 3.0*width*height/output_stat.st_size : 0);
+		}
+		report_bvh_stats(scene, &totals);
+		report_phases(&phases, &totals);
+	}
+	if(options.heatmap != NULL){	//run.cost was made for it
+		write_heatmap(run.cost, width, height, options.heatmap);
+	}
+	return leave_trap(&trap, error);	//Which frees run
+}
+struct RaycastScene {	//What raycast_parse_scene() and raycast_load_scene() hand out, only read once made
+	Scene scene;
+	Arena arena;	//The objects of a .json scene, kept for their cameras
+	Object** object_array;	//The cameras are found here, the first camera is at 0
+	int object_counter;
+	Object camera;	//The one camera of a compiled scene, object_array holds only it
+};
+
+//Makes a RaycastScene from the .json text at json, or from the file filename when json is NULL
+static int make_scene(const char* filename, const char* json, size_t size, RaycastScene** scene, RaycastError* error){
+	ErrorTrap trap;
+	SceneReader reader;
+	RaycastScene* result = calloc(1, sizeof(RaycastScene));
+	const char* periodPointer = filename != NULL ? strrchr(filename, '.') : NULL;
+	size_t file_size;
+	
+	*scene = NULL;
+	borrow_scene(&reader, json, size);
+	if(setjmp(trap.jump) != 0){	//Free everything made so far
+		close_scene(&reader);
+		if(result != NULL){
+			free_scene(&result->scene);
+			free(result->object_array);
+			free_arena(&result->arena);
+			free(result);
+		}
+		return leave_trap(&trap, error);
+	}
+	enter_trap(&trap);
+	if(result == NULL){
+		fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+	}
+	if(periodPointer != NULL && strcmp(periodPointer, ".rcs") == 0){	//Compiled, the camera is at the origin
+		load_compiled_scene(filename, &result->scene, &file_size);
+		result->camera.kind = 0;
+		result->camera.camera.width = result->scene.camera_width;
+		result->camera.camera.height = result->scene.camera_height;
+		result->object_array = malloc(sizeof(Object*));
+		if(result->object_array == NULL){
+			fail(RAYCAST_ERROR_MEMORY, "Out of memory");
+		}
+		result->object_array[0] = &result->camera;
+		result->object_counter = 0;
+	}else{
+		if(filename != NULL){
+			if(periodPointer == NULL || strcmp(periodPointer, ".json") != 0){
+				fail(RAYCAST_ERROR_ARGUMENT, "Input scene file is not of type JSON or RCS");
+			}
+			if(!open_scene(&reader, filename)){
+				fail(RAYCAST_ERROR_IO, "Could not open file \"%s\"", filename);
+			}
+		}
+		result->object_counter = parse_objects(&reader, &result->object_array, &result->arena);
+		close_scene(&reader);
+		move_camera_to_front(result->object_array, result->object_counter);
+		build_scene(result->object_array, result->object_counter, &result->scene);
+	}
+	*scene = result;
+	return leave_trap(&trap, error);
+}
+
+int raycast_parse_scene(const char* json, size_t size, RaycastScene** scene, RaycastError* error){
+	return make_scene(NULL, json, size, scene, error);
+}
+
+int raycast_load_scene(const char* filename, RaycastScene** scene, RaycastError* error){
+	return make_scene(filename, NULL, 0, scene, error);
+}
+
+void raycast_free_scene(RaycastScene* scene){
+	if(scene == NULL) return;
+	free_scene(&scene->scene);
+	free(scene->object_array);
+	free_arena(&scene->arena);
+	free(scene);
+}
+
+typedef struct {	//What raycast_render() makes for its view, cleared first and freed by release_render()
+	Scene view;
+	int translated;	//view has moved copies of the positions, otherwise it shares them with the scene
+	Bins bins;
+	Hit* hits;
+} RenderView;
+
+static void release_render(void* input){
+	RenderView* made = input;
+	free(made->hits);
+	free_bins(&made->bins);
+	if(made->translated){
+		free_translated_scene(&made->view);
+	}else{	//Only the float copy is the view's own
+		free_float_scene(&made->view);
+	}
+}
+
+//Renders into the caller's pixels from a view of the shared scene. The view gets its own moved positions, float copy
+//and bins, so nothing of scene is written and renders from several threads do not meet.
+int raycast_render(const RaycastScene* scene, const char* camera, int width, int height,
+					const RenderOptions* render_options, unsigned char* pixels, RaycastError* error){
+	ErrorTrap trap;
+	RenderOptions options = *render_options;
+	const Object* view_camera = NULL;
+	RenderView made;	//Freed by leave_trap()
+	Owned owned;
+	Scene* view = &made.view;
+	Framebuffer fb;
+	RayStats totals;
+	int i;
+	
+	memset(&made, 0, sizeof(RenderView));
+	if(setjmp(trap.jump) != 0) return leave_trap(&trap, error);
+	enter_trap(&trap);
+	own(&owned, release_render, &made);
+	if(width <= 0 || height <= 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "Width and height must be greater than 0");
+	}
+	if(options.frames != NULL || options.heatmap != NULL || options.region[2] > 0 || options.band_rows > 0
+		|| options.progressive || options.cameras != NULL || options.autotune){	//These write files of their own
+		fail(RAYCAST_ERROR_ARGUMENT, "Jobs can not use --frames, --heatmap, --region, --band-rows, --progressive, --cameras or --autotune");
+	}
+	if(options.accel == ACCEL_BINS && options.packet_size > 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "--accel bins can not be combined with --packet");
+	}
+	if(options.fast_rays && options.packet_size > 0){
+		fail(RAYCAST_ERROR_ARGUMENT, "--fast-rays can not be combined with --packet");
+	}
+	for(i = 0; i < scene->object_counter + 1 && view_camera == NULL; i++){
+		const Object* object = scene->object_array[i];
+		if(object->kind == 0 && (camera == NULL || (object->camera.name != NULL && strcmp(object->camera.name, camera) == 0))){
+			view_camera = object;
+		}
+	}
+	if(view_camera == NULL){
+		fail(RAYCAST_ERROR_ARGUMENT, "Unknown camera \"%s\"", camera);
+	}
+	options.stats = 0;	//Nothing is printed, stdout belongs to the caller
+	options.format = FORMAT_RGB8;	//pixels is the framebuffer
+	
+	made.translated = !camera_at_origin(view_camera);
+	if(made.translated){
+		translate_scene(&scene->scene, view_camera->camera.position, view);
+	}else{	//Only what the view makes for itself below is freed again
+		*view = scene->scene;
+	}
+	view->camera_width = view_camera->camera.width;
+	view->camera_height = view_camera->camera.height;
+	if(options.precision == PRECISION_FLOAT){
+		bake_float_scene(view);
+	}
+	if(options.accel == ACCEL_BINS){
+		build_bins(view, width, height, &made.bins);
+		view->bins = &made.bins;
+	}
+	fb.width = width;
+	fb.height = height;
+	fb.format = FORMAT_RGB8;
+	fb.pixel_size = 3;
+	fb.stride = 3*(size_t)width;
+	fb.data = pixels;
+	memset(pixels, 0, fb.stride*height);	//Pixels that hit nothing are never stored
+	if(options.aa_samples > 0){
+		made.hits = malloc(sizeof(Hit)*((size_t)width*height + 1));
+		if(made.hits == NULL){
+			fail(RAYCAST_ERROR_MEMORY, "Not enough memory for a %d by %d image", width, height);
+		}
+	}
+	memset(&totals, 0, sizeof(RayStats));
+	raycast_scene(view, &fb, made.hits, NULL, width, height, 0, 0, &options, &totals);
+	if(made.hits != NULL){
+		antialias(view, &fb, made.hits, width, height, &options, &totals);
+	}
+	return leave_trap(&trap, error);	//Which frees made
+}
+
+static size_t scene_bytes(const Scene* scene){	//Memory held by the arrays build_scene() made
+	size_t bytes = sizeof(double)*(5*(scene->num_spheres + SIMD_WIDTH) + 3*scene->num_spheres)
+				+ sizeof(int)*scene->num_spheres + sizeof(BVHNode)*scene->num_nodes
+				+ sizeof(double)*10*scene->num_planes + sizeof(int)*scene->num_planes
+				+ (4*sizeof(double) + 2*sizeof(int))*scene->num_instances + sizeof(BVHNode)*scene->num_instance_nodes
+				+ sizeof(Scene)*scene->num_groups;
+	int i;
+	for(i = 0; scene->groups != NULL && i < scene->num_groups; i++){
+		bytes += scene_bytes(&scene->groups[i]);
+	}
+	return bytes;
+}
+
+size_t raycast_scene_size(const RaycastScene* scene){
+	const ArenaBlock* block;
+	size_t bytes = sizeof(RaycastScene) + sizeof(Object*)*(scene->object_counter + 1);
+	if(scene->scene.mapping != NULL){	//Pages of the file, shared with the page cache
+		return bytes + scene->scene.mapping_size;
+	}
+	for(block = scene->arena.head; block != NULL; block = block->next){
+		bytes += sizeof(ArenaBlock) + block->used;	//Not block->size, a small scene would count as a whole ARENA_BLOCK_SIZE
+	}
+	return bytes + scene_bytes(&scene->scene);
+}
+
+int raycast_write_image(const char* output, int width, int height, const unsigned char* pixels, RaycastError* error){
+	ErrorTrap trap;
+	Framebuffer fb;
+	const char* periodPointer = strrchr(output, '.');
+	
+	if(setjmp(trap.jump) != 0) return leave_trap(&trap, error);
+	enter_trap(&trap);
+	if(periodPointer == NULL || (strcmp(periodPointer, ".ppm") != 0 && strcmp(periodPointer, ".qoi") != 0)){
+		fail(RAYCAST_ERROR_ARGUMENT, "Output picture file is not of type PPM or QOI");
+	}
+	fb.width = width;
+	fb.height = height;
+	fb.format = FORMAT_RGB8;
+	fb.pixel_size = 3;
+	fb.stride = 3*(size_t)width;
+	fb.data = (unsigned char*)pixels;	//Only read
+	create_image(&fb, output);
+	return leave_trap(&trap, error);
+}
@@ -0,0 +1,106 @@
+#ifndef RAYCAST_H
+#define RAYCAST_H
+
+#include <stddef.h>
+
+//The raycaster as a library. main.c is the raycast command line tool, built on the functions below.
+//
+//Every function is reentrant: nothing is kept between calls except in the handles they return, and any number of
+//threads may parse and render at the same time, including several renders of one RaycastScene. Errors are returned
+//as one of the RAYCAST_ERROR_ codes with a message in a RaycastError, the library never exits the process.
+//
+//	RaycastScene* scene;
+//	RaycastError error;
+//	RenderOptions options;
+//	raycast_default_options(&options);
+//	if(raycast_parse_scene(json, json_size, &scene, &error) != RAYCAST_OK
+//		|| raycast_render(scene, NULL, 640, 480, &options, pixels, &error) != RAYCAST_OK){
+//		fprintf(stderr, "Error: %s\n", error.message);
+//	}
+//	raycast_free_scene(scene);
+
+#define RAYCAST_OK 0
+#define RAYCAST_ERROR_ARGUMENT 1	//Options or arguments that can not be used, or can not be used together
+#define RAYCAST_ERROR_INPUT 2	//A scene, frames, compiled scene or region file that is not valid
+#define RAYCAST_ERROR_IO 3	//A file that could not be opened, read or written
+#define RAYCAST_ERROR_MEMORY 4	//Out of memory
+#define RAYCAST_ERROR_SYSTEM 5	//A thread that could not be started
+
+typedef struct {	//Why a call failed
+	int code;	//One of the RAYCAST_ERROR_ values
+	char message[256];	//For example "Unknown type, "cube", on line number 12.", without a leading "Error: "
+} RaycastError;
+
+#define FORMAT_RGB8 0	//Pixel formats a Framebuffer can hold
+#define FORMAT_FLOAT 1
+#define FORMAT_DOUBLE 2
+
+#define PRECISION_DOUBLE 0	//Number types the intersection kernels can work in
+#define PRECISION_FLOAT 1
+
+#define ACCEL_BVH 0	//Sphere acceleration structures
+#define ACCEL_BINS 1
+
+typedef struct {	//Render settings taken from the command line options
+	int threads;	//Number of render threads, 1 keeps the serial path
+	int tile_size;	//Width and height of a tile handed to a render thread
+	const char* kernel;	//Intersection kernels to use, "auto" picks the fastest the CPU supports
+	int stats;	//Print statistics about the render
+	int format;	//Pixel format of the framebuffer, one of the FORMAT_ values
+	int precision;	//PRECISION_DOUBLE or PRECISION_FLOAT for the intersection math and the scene it reads
+	int accel;	//How rays find the spheres they might hit, one of the ACCEL_ values
+	int packet_size;	//Trace packet_size by packet_size blocks of rays together, 0 to trace rays one at a time
+	int band_rows;	//Stream the image to the output file this many rows at a time, 0 renders it whole
+	char* frames;	//File of per frame scene changes to render as an animation, NULL renders one image
+	char* heatmap;	//Write the work done for each pixel to this .ppm file, NULL for none
+	int region[4];	//Only render output pixels x0 <= x < x1, y0 <= y < y1 (y = 0 is the top), x1 = 0 for the whole image
+	int aa_samples;	//Extra rays for pixels on an edge, 0 turns anti-aliasing off
+	long long aa_budget;	//Most extra rays for the whole image, -1 for no limit
+	int progressive;	//Render coarse to fine, see progressive_render()
+	double deadline;	//Seconds the progressive levels after the first may take, 0 for no limit
+	int snapshots;	//Write the image after each progressive level
+	int fast_rays;	//Step ray directions and plane denominators along each row, see raycast_row_fast()
+	char* cameras;	//"all" or a comma separated list of camera names to render in one batch, NULL renders the first camera
+	int autotune;	//Pick tile_size, threads, packet_size and kernel by timing bands of the image, see autotune()
+	char* tune_profile;	//File of settings autotune found before, by scene characteristics, NULL to always measure
+} RenderOptions;
+
+typedef struct RaycastScene RaycastScene;	//A parsed and built scene, read only once made
+
+void raycast_default_options(RenderOptions* options);	//One thread, automatic kernels, no extras
+
+//raycast width height input output: renders a .json or .rcs scene file to a .ppm or .qoi image, with every option
+//the command line has. --stats output goes to stdout. Everything this call allocates or opens is freed or closed
+//again when it returns, after an error as well. Output files written before an error are left in place.
+int raycast_run(int width, int height, const char* input, const char* output, const RenderOptions* options,
+				RaycastError* error);
+
+int raycast_compile(const char* input, const char* output, RaycastError* error);	//raycast --compile input.json output.rcs
+
+//raycast --merge output part...: puts the parts of a --region render back together
+int raycast_merge(const char* output, char** parts, int num_parts, RaycastError* error);
+
+//Parses and builds the .json scene in the size bytes at json, which the scene does not keep. On success *scene is a
+//new handle for raycast_render(), free it with raycast_free_scene(). On error *scene is NULL and the scene made so far
+//is freed.
+int raycast_parse_scene(const char* json, size_t size, RaycastScene** scene, RaycastError* error);
+
+//Like raycast_parse_scene() for a .json or .rcs file. A compiled scene has one unnamed camera.
+int raycast_load_scene(const char* filename, RaycastScene** scene, RaycastError* error);
+
+void raycast_free_scene(RaycastScene* scene);	//NULL is allowed
+
+size_t raycast_scene_size(const RaycastScene* scene);	//Bytes of memory the scene holds, for a cache of scenes
+
+//Renders the scene from the camera named camera (NULL for the first camera of the file) into pixels: width*height
+//8 bit RGB triples, top row first. Uses the threads, tile_size, kernel, precision, accel, packet_size, aa_samples,
+//aa_budget and fast_rays options, the options that write files (frames, heatmap, region, band_rows, progressive,
+//cameras) and autotune are refused, stats and format are ignored. The scene is only read, so any number of renders
+//of it may run at once. Like raycast_run(), it frees what it allocated when it returns, after an error as well.
+int raycast_render(const RaycastScene* scene, const char* camera, int width, int height, const RenderOptions* options,
+					unsigned char* pixels, RaycastError* error);
+
+//Writes width*height 8 bit RGB triples, top row first, to a .ppm or .qoi file
+int raycast_write_image(const char* output, int width, int height, const unsigned char* pixels, RaycastError* error);
+
+#endif
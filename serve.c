@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "tool.h"
+
+//raycast --serve: a raycast that stays running and renders jobs, so a render no longer pays for starting the process
+//and parsing its scene. A job is one line with the arguments of a raycast command, options included:
+//
+//	[options] width height scene.json output.ppm
+//
+//Each job gets one reply line, when it is done, starting with its number (the jobs of a connection count from 1):
+//
+//	3 ok out.ppm cache=hit wait_ms=0.012 load_ms=0.004 render_ms=5.210 write_ms=0.310 total_ms=5.536 mpixels_s=14.21
+//	4 error Could not open file "missing.json"
+//
+//Replies come in the order jobs finish, which is not the order they were sent. The line "stats" replies with totals
+//for the server, and "quit" stops it once the queued jobs are done. Words are separated by spaces, so file names
+//can not contain any.
+//
+//Parsed scenes are cached by path, and loaded again when the file's modification time or size changes. When the
+//scenes take more than the cache limit, the least recently used ones that no job is rendering are freed. Jobs wait in
+//one queue for a pool of worker threads, which takes the job with the fewest pixels first, unless the oldest job has
+//waited SERVE_STARVE_SECONDS. A job renders with its own --threads (default 1, at most the core count) inside the
+//worker that took it.
+
+#define SERVE_MAX_LINE 4096	//Longest job line
+#define SERVE_MAX_ARGS 64	//Most words in a job line
+#define SERVE_STARVE_SECONDS 1.0	//A job queued this long goes ahead of smaller jobs
+
+typedef struct CachedScene {	//One scene file in the cache
+	char* path;
+	struct timespec mtime;	//The file as it was when it was loaded
+	off_t size;
+	RaycastScene* scene;	//NULL until loaded
+	size_t bytes;	//raycast_scene_size()
+	int users;	//Jobs rendering the scene or waiting for it to load
+	int loading;
+	int cached;	//0 once taken out of the cache, the last user frees it
+	unsigned long long last_used;
+	struct CachedScene* next;
+} CachedScene;
+
+struct Server;
+
+typedef struct {	//Where jobs come from and where their replies go
+	struct Server* server;
+	FILE* input;
+	int output;	//File descriptor replies are written to
+	pthread_mutex_t write_lock;	//One reply line at a time
+	int jobs;	//Job lines read so far
+	int pending;	//Jobs queued or rendering
+	int reading;	//0 once the input has ended
+} Connection;
+
+typedef struct Job {
+	Connection* connection;
+	int id;
+	char* line;	//argv points into line
+	char* argv[SERVE_MAX_ARGS + 2];
+	RenderOptions options;
+	int width;
+	int height;
+	const char* scene;
+	const char* output;
+	double queued;	//now_seconds() when the job was read
+	struct Job* next;
+} Job;
+
+typedef struct Server {	//What the connection and worker threads share, everything below lock is guarded by it
+	int listener;	//Listening socket, -1 when jobs come from stdin
+	double start;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	//Signaled when a job is queued, broadcast when the server stops
+	pthread_cond_t loaded;	//Broadcast when a scene has loaded or failed to
+	Job* queue;	//Oldest first
+	int queued;
+	int running;
+	int stopping;
+	CachedScene* cache;
+	size_t cache_bytes;
+	size_t cache_limit;
+	unsigned long long clock;	//Counts cache lookups, for last_used
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long jobs;	//Finished jobs, with or without an error
+	long long errors;
+	double total_latency;	//Seconds from reading to finishing each job
+	double max_latency;
+	double pixels;	//Of the jobs that rendered
+} Server;
+
+static double now_seconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void reply(Connection* connection, const char* format, ...){	//Writes one line to the connection
+	char line[SERVE_MAX_LINE];
+	size_t length;
+	size_t done = 0;
+	ssize_t written;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+	length = strlen(line);
+	line[length++] = '\n';
+	pthread_mutex_lock(&connection->write_lock);
+	while(done < length){	//A client that went away loses its replies, the server carries on
+		written = write(connection->output, line + done, length - done);
+		if(written < 0 && errno == EINTR) continue;
+		if(written <= 0) break;
+		done += written;
+	}
+	pthread_mutex_unlock(&connection->write_lock);
+}
+
+static void release_connection(Connection* connection){	//Frees the connection once its input ended and every reply is out, lock held
+	if(connection->reading || connection->pending > 0) return;
+	if(connection->server->listener >= 0){
+		close(connection->output);
+	}
+	pthread_mutex_destroy(&connection->write_lock);
+	free(connection);
+}
+
+static void free_cached(CachedScene* entry){
+	raycast_free_scene(entry->scene);
+	free(entry->path);
+	free(entry);
+}
+
+static void uncache(Server* server, CachedScene* entry){	//Takes entry out of the cache, lock held
+	CachedScene** link = &server->cache;
+	while(*link != entry) link = &(*link)->next;
+	*link = entry->next;
+	entry->cached = 0;
+	server->cache_bytes -= entry->bytes;
+	if(entry->users == 0) free_cached(entry);
+}
+
+static void evict(Server* server){	//Frees least recently used scenes no job is using until the cache fits, lock held
+	CachedScene* entry;
+	CachedScene* oldest;
+	while(server->cache_bytes > server->cache_limit){
+		oldest = NULL;
+		for(entry = server->cache; entry != NULL; entry = entry->next){
+			if(entry->users == 0 && entry->scene != NULL && (oldest == NULL || entry->last_used < oldest->last_used)){
+				oldest = entry;
+			}
+		}
+		if(oldest == NULL) return;	//Everything left is in use, it is freed when the jobs are done with it
+		server->evictions++;
+		uncache(server, oldest);
+	}
+}
+
+//Returns the cached scene for path, loading it when it is not cached or its file changed. NULL after an error.
+static CachedScene* acquire_scene(Server* server, const char* path, int* hit, RaycastError* error){
+	CachedScene* entry;
+	RaycastScene* scene;
+	struct stat info;
+	int status;
+
+	if(stat(path, &info) != 0){
+		error->code = RAYCAST_ERROR_IO;
+		snprintf(error->message, sizeof(error->message), "Could not open file \"%s\"", path);
+		return NULL;
+	}
+	pthread_mutex_lock(&server->lock);
+	while(1){
+		for(entry = server->cache; entry != NULL && strcmp(entry->path, path) != 0; entry = entry->next);
+		if(entry == NULL) break;
+		if(entry->loading){	//Another job is loading it, wait and look again
+			entry->users++;
+			while(entry->loading) pthread_cond_wait(&server->loaded, &server->lock);
+			entry->users--;
+			if(!entry->cached && entry->users == 0) free_cached(entry);
+			continue;
+		}
+		if(entry->mtime.tv_sec != info.st_mtim.tv_sec || entry->mtime.tv_nsec != info.st_mtim.tv_nsec
+			|| entry->size != info.st_size){	//The file changed since it was loaded
+			uncache(server, entry);
+			break;
+		}
+		entry->users++;
+		entry->last_used = ++server->clock;
+		server->hits++;
+		*hit = 1;
+		pthread_mutex_unlock(&server->lock);
+		return entry;
+	}
+	entry = calloc(1, sizeof(CachedScene));
+	if(entry == NULL || (entry->path = strdup(path)) == NULL){
+		pthread_mutex_unlock(&server->lock);
+		free(entry);
+		error->code = RAYCAST_ERROR_MEMORY;
+		snprintf(error->message, sizeof(error->message), "Out of memory");
+		return NULL;
+	}
+	entry->mtime = info.st_mtim;
+	entry->size = info.st_size;
+	entry->users = 1;
+	entry->loading = 1;
+	entry->cached = 1;
+	entry->next = server->cache;
+	server->cache = entry;
+	server->misses++;
+	*hit = 0;
+	pthread_mutex_unlock(&server->lock);
+
+	status = raycast_load_scene(path, &scene, error);	//Outside the lock, other jobs go on meanwhile
+
+	pthread_mutex_lock(&server->lock);
+	entry->loading = 0;
+	pthread_cond_broadcast(&server->loaded);
+	entry->users--;
+	if(status != RAYCAST_OK){	//Jobs that waited for it try for themselves
+		if(entry->cached){
+			uncache(server, entry);
+		}else if(entry->users == 0){
+			free_cached(entry);
+		}
+		pthread_mutex_unlock(&server->lock);
+		return NULL;
+	}
+	entry->users++;
+	entry->scene = scene;
+	entry->last_used = ++server->clock;
+	if(entry->cached){
+		entry->bytes = raycast_scene_size(scene);
+		server->cache_bytes += entry->bytes;
+		evict(server);
+	}
+	pthread_mutex_unlock(&server->lock);
+	return entry;
+}
+
+static void release_scene(Server* server, CachedScene* entry){
+	pthread_mutex_lock(&server->lock);
+	entry->users--;
+	if(!entry->cached && entry->users == 0){
+		free_cached(entry);
+	}else{
+		evict(server);
+	}
+	pthread_mutex_unlock(&server->lock);
+}
+
+static Job* take_job(Server* server){	//Smallest job first, unless the oldest has waited too long, lock held
+	Job** link = &server->queue;
+	Job** smallest = link;
+	Job* job;
+	if(now_seconds() - server->queue->queued < SERVE_STARVE_SECONDS){
+		for(; *link != NULL; link = &(*link)->next){
+			if((double)(*link)->width*(*link)->height < (double)(*smallest)->width*(*smallest)->height){
+				smallest = link;
+			}
+		}
+	}
+	job = *smallest;
+	*smallest = job->next;
+	server->queued--;
+	return job;
+}
+
+static void run_job(Server* server, Job* job){	//Renders and writes one job and replies with its times
+	CachedScene* entry;
+	RaycastError error;
+	unsigned char* pixels;
+	double start = now_seconds();
+	double loaded;
+	double rendered;
+	double written;
+	int hit = 0;
+	int status;
+
+	entry = acquire_scene(server, job->scene, &hit, &error);
+	loaded = rendered = now_seconds();
+	status = entry != NULL ? RAYCAST_OK : error.code;
+	pixels = malloc(3*(size_t)job->width*job->height + 1);
+	if(status == RAYCAST_OK && pixels == NULL){
+		status = error.code = RAYCAST_ERROR_MEMORY;
+		snprintf(error.message, sizeof(error.message), "Not enough memory for a %d by %d image", job->width, job->height);
+	}
+	if(status == RAYCAST_OK){
+		status = raycast_render(entry->scene, NULL, job->width, job->height, &job->options, pixels, &error);
+		rendered = now_seconds();
+	}
+	if(entry != NULL){
+		release_scene(server, entry);
+	}
+	if(status == RAYCAST_OK){
+		status = raycast_write_image(job->output, job->width, job->height, pixels, &error);
+	}
+	free(pixels);
+	written = now_seconds();
+
+	pthread_mutex_lock(&server->lock);
+	server->jobs++;
+	server->total_latency += written - job->queued;
+	if(written - job->queued > server->max_latency) server->max_latency = written - job->queued;
+	if(status == RAYCAST_OK){
+		server->pixels += (double)job->width*job->height;
+	}else{
+		server->errors++;
+	}
+	pthread_mutex_unlock(&server->lock);
+	if(status != RAYCAST_OK){
+		reply(job->connection, "%d error %s", job->id, error.message);
+		return;
+	}
+	reply(job->connection, "%d ok %s cache=%s wait_ms=%.3f load_ms=%.3f render_ms=%.3f write_ms=%.3f total_ms=%.3f mpixels_s=%.2f",
+		job->id, job->output, hit ? "hit" : "miss", (start - job->queued)*1000, (loaded - start)*1000,
+		(rendered - loaded)*1000, (written - rendered)*1000, (written - job->queued)*1000,
+		rendered > loaded ? job->width*(double)job->height/(rendered - loaded)/1e6 : 0);
+}
+
+static void* serve_worker(void* input){	//Thread body of the worker pool, runs jobs until the server stops
+	Server* server = input;
+	Job* job;
+	while(1){
+		pthread_mutex_lock(&server->lock);
+		while(server->queue == NULL && !server->stopping){
+			pthread_cond_wait(&server->work, &server->lock);
+		}
+		if(server->queue == NULL){	//Stopping, and every queued job is done
+			pthread_mutex_unlock(&server->lock);
+			return NULL;
+		}
+		job = take_job(server);
+		server->running++;
+		pthread_mutex_unlock(&server->lock);
+
+		run_job(server, job);
+
+		pthread_mutex_lock(&server->lock);
+		server->running--;
+		job->connection->pending--;
+		release_connection(job->connection);
+		pthread_mutex_unlock(&server->lock);
+		free(job->line);
+		free(job);
+	}
+}
+
+static void stop_server(Server* server){	//Lets the workers finish the queue and stops taking connections
+	pthread_mutex_lock(&server->lock);
+	server->stopping = 1;
+	pthread_cond_broadcast(&server->work);
+	pthread_mutex_unlock(&server->lock);
+	if(server->listener >= 0){
+		shutdown(server->listener, SHUT_RDWR);	//Wakes up accept()
+	}
+}
+
+static void report(Server* server, Connection* connection){	//The reply to "stats"
+	double uptime;
+	int scenes = 0;
+	CachedScene* entry;
+	pthread_mutex_lock(&server->lock);
+	uptime = now_seconds() - server->start;
+	for(entry = server->cache; entry != NULL; entry = entry->next) scenes++;
+	reply(connection, "stats jobs=%lld errors=%lld queued=%d running=%d scenes=%d cache_mb=%.2f cache_limit_mb=%.2f "
+		"hits=%lld misses=%lld evictions=%lld mean_ms=%.3f max_ms=%.3f jobs_s=%.2f mpixels_s=%.2f",
+		server->jobs, server->errors, server->queued, server->running, scenes, server->cache_bytes/1e6,
+		server->cache_limit/1e6, server->hits, server->misses, server->evictions,
+		server->jobs > 0 ? server->total_latency/server->jobs*1000 : 0, server->max_latency*1000,
+		uptime > 0 ? server->jobs/uptime : 0, uptime > 0 ? server->pixels/uptime/1e6 : 0);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static int read_job(Connection* connection, char* line){	//Queues the job on one line or answers a command, 0 after "quit"
+	Server* server = connection->server;
+	RaycastError error;
+	Job* job;
+	Job** link;
+	char* word;
+	char* end;
+	int argc = 1;
+	int used;
+	long width;
+	long height;
+	long cores;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	word = line + strspn(line, " \t");
+	if(*word == '\0' || *word == '#') return 1;
+	if(strcmp(word, "stats") == 0){
+		report(server, connection);
+		return 1;
+	}
+	if(strcmp(word, "quit") == 0){
+		stop_server(server);
+		return 0;
+	}
+
+	connection->jobs++;
+	job = calloc(1, sizeof(Job));
+	if(job == NULL || (job->line = strdup(word)) == NULL){
+		free(job);
+		reply(connection, "%d error Out of memory", connection->jobs);
+		return 1;
+	}
+	job->connection = connection;
+	job->id = connection->jobs;
+	job->queued = now_seconds();
+	job->argv[0] = "raycast";
+	for(word = strtok_r(job->line, " \t", &end); word != NULL && argc <= SERVE_MAX_ARGS; word = strtok_r(NULL, " \t", &end)){
+		job->argv[argc++] = word;
+	}
+	job->argv[argc] = NULL;
+	used = word == NULL ? parse_options(argc, job->argv, &job->options, &error) : -1;
+	if(word != NULL){
+		snprintf(error.message, sizeof(error.message), "More than %d words in a job", SERVE_MAX_ARGS);
+	}else if(used >= 0 && argc - used != 5){
+		used = -1;
+		snprintf(error.message, sizeof(error.message), "A job is [options] width height input output");
+	}
+	if(used >= 0){
+		width = strtol(job->argv[used + 1], &end, 10);
+		height = *end == '\0' ? strtol(job->argv[used + 2], &end, 10) : 0;
+		if(*end != '\0' || width <= 0 || height <= 0 || width > 1 << 16 || height > 1 << 16){
+			used = -1;
+			snprintf(error.message, sizeof(error.message), "Width or Height field is not a number from 1 to 65536");
+		}else{
+			job->width = width;
+			job->height = height;
+			job->scene = job->argv[used + 3];
+			job->output = job->argv[used + 4];
+		}
+	}
+	if(used >= 0 && (job->options.frames != NULL || job->options.heatmap != NULL || job->options.region[2] > 0
+		|| job->options.band_rows > 0 || job->options.progressive || job->options.cameras != NULL || job->options.autotune)){
+		used = -1;	//raycast_render() refuses them too, but only after the scene is loaded and cached
+		snprintf(error.message, sizeof(error.message),
+			"Jobs can not use --frames, --heatmap, --region, --band-rows, --progressive, --cameras or --autotune");
+	}
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if(used >= 0 && cores > 0 && job->options.threads > cores){	//One job does not get to start more threads than there are cores
+		job->options.threads = cores;
+	}
+	pthread_mutex_lock(&server->lock);
+	if(used >= 0 && server->stopping){
+		used = -1;
+		snprintf(error.message, sizeof(error.message), "The server is stopping");
+	}
+	if(used < 0){	//Counted like a job that failed
+		server->jobs++;
+		server->errors++;
+		pthread_mutex_unlock(&server->lock);
+		reply(connection, "%d error %s", job->id, error.message);
+		free(job->line);
+		free(job);
+		return 1;
+	}
+	for(link = &server->queue; *link != NULL; link = &(*link)->next);
+	*link = job;
+	server->queued++;
+	connection->pending++;
+	pthread_cond_signal(&server->work);
+	pthread_mutex_unlock(&server->lock);
+	return 1;
+}
+
+static void* read_connection(void* input){	//Thread body: queues the jobs of one connection until its input ends
+	Connection* connection = input;
+	Server* server = connection->server;
+	char line[SERVE_MAX_LINE];
+	while(fgets(line, sizeof(line), connection->input) != NULL){
+		if(strchr(line, '\n') == NULL && !feof(connection->input)){	//Too long, skip the rest of it
+			int c;
+			while((c = fgetc(connection->input)) != '\n' && c != EOF);
+			reply(connection, "%d error A job line is longer than %d characters", ++connection->jobs, SERVE_MAX_LINE - 2);
+			continue;
+		}
+		if(!read_job(connection, line)) break;
+	}
+	if(server->listener >= 0){
+		fclose(connection->input);
+	}
+	pthread_mutex_lock(&server->lock);
+	connection->reading = 0;
+	release_connection(connection);
+	pthread_mutex_unlock(&server->lock);
+	return NULL;
+}
+
+static Connection* new_connection(Server* server, FILE* input, int output){
+	Connection* connection = calloc(1, sizeof(Connection));
+	if(connection == NULL) return NULL;
+	connection->server = server;
+	connection->input = input;
+	connection->output = output;
+	connection->reading = 1;
+	pthread_mutex_init(&connection->write_lock, NULL);
+	return connection;
+}
+
+static int serve_error(RaycastError* error, int code, const char* what, const char* address){	//For serve()'s setup
+	error->code = code;
+	snprintf(error->message, sizeof(error->message), "%s \"%s\": %s", what, address, strerror(errno));
+	return code;
+}
+
+int serve(const char* address, int workers, size_t cache_limit, RaycastError* error){
+	static Server server;	//Outlives serve(), connections may still be reading when it returns
+	pthread_t* threads;
+	pthread_t reader;
+	struct sockaddr_un socket_address;
+	struct stat info;
+	Connection* connection;
+	FILE* input;
+	int started;
+	int fd;
+	int i;
+
+	memset(&server, 0, sizeof(Server));
+	server.listener = -1;
+	server.cache_limit = cache_limit;
+	server.start = now_seconds();
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.work, NULL);
+	pthread_cond_init(&server.loaded, NULL);
+	signal(SIGPIPE, SIG_IGN);	//Replies to a client that is gone fail instead of ending the server
+
+	if(strcmp(address, "-") != 0){
+		memset(&socket_address, 0, sizeof(socket_address));
+		socket_address.sun_family = AF_UNIX;
+		if(strlen(address) >= sizeof(socket_address.sun_path)){
+			error->code = RAYCAST_ERROR_ARGUMENT;
+			snprintf(error->message, sizeof(error->message), "Socket path \"%s\" is too long", address);
+			return error->code;
+		}
+		strcpy(socket_address.sun_path, address);
+		if(stat(address, &info) == 0 && S_ISSOCK(info.st_mode)){	//Left behind by a server that did not stop cleanly
+			unlink(address);
+		}
+		server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(server.listener < 0 || bind(server.listener, (struct sockaddr*)&socket_address, sizeof(socket_address)) != 0
+			|| listen(server.listener, 64) != 0){
+			return serve_error(error, RAYCAST_ERROR_SYSTEM, "Could not listen on", address);
+		}
+	}
+	threads = malloc(sizeof(pthread_t)*workers);
+	for(started = 0; threads != NULL && started < workers; started++){
+		if(pthread_create(&threads[started], NULL, serve_worker, &server) != 0) break;
+	}
+	if(started == 0){	//Nothing to render the jobs, give the socket back as well
+		if(threads == NULL) errno = ENOMEM;
+		serve_error(error, threads == NULL ? RAYCAST_ERROR_MEMORY : RAYCAST_ERROR_SYSTEM, "Could not create a worker thread for",
+			address);
+		free(threads);
+		if(server.listener >= 0){
+			close(server.listener);
+			unlink(address);
+		}
+		return error->code;
+	}
+
+	if(server.listener < 0){	//Jobs from stdin, replies to stdout, until the end of stdin or "quit"
+		connection = new_connection(&server, stdin, STDOUT_FILENO);
+		if(connection != NULL){
+			read_connection(connection);
+		}
+		stop_server(&server);
+	}else{
+		while(1){
+			fd = accept(server.listener, NULL, NULL);
+			if(fd < 0){
+				if(errno == EINTR || errno == ECONNABORTED) continue;
+				break;	//Stopped by "quit"
+			}
+			connection = NULL;
+			input = fdopen(dup(fd), "r");	//Replies still go out on fd after the input is closed
+			if(input == NULL || (connection = new_connection(&server, input, fd)) == NULL
+				|| pthread_create(&reader, NULL, read_connection, connection) != 0){
+				if(input != NULL) fclose(input);
+				free(connection);
+				close(fd);
+				continue;
+			}
+			pthread_detach(reader);
+		}
+		stop_server(&server);
+	}
+	for(i = 0; i < started; i++){
+		pthread_join(threads[i], NULL);
+	}
+	if(server.listener >= 0){	//Connections still open get no more replies, the process is about to end
+		close(server.listener);
+		unlink(address);
+	}
+	fprintf(stderr, "serve: %lld jobs, %lld errors, %lld cache hits, %lld misses, %lld evictions, mean latency %.3f ms, "
+		"max %.3f ms\n", server.jobs, server.errors, server.hits, server.misses, server.evictions,
+		server.jobs > 0 ? server.total_latency/server.jobs*1000 : 0, server.max_latency*1000);
+	while(server.cache != NULL){
+		uncache(&server, server.cache);
+	}
+	free(threads);
+	error->code = RAYCAST_OK;
+	error->message[0] = '\0';
+	return RAYCAST_OK;
+}
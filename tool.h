@@ -0,0 +1,15 @@
+#ifndef TOOL_H
+#define TOOL_H
+
+#include <stddef.h>
+#include "raycast.h"
+
+//What main.c and serve.c, the two files of the raycast command line tool, share.
+
+int parse_options(int c, char** argv, RenderOptions* options, RaycastError* error);	//main.c
+
+//raycast --serve address: renders jobs read from stdin ("-") or from connections to the Unix socket address with
+//workers threads, keeping up to cache_limit bytes of scenes loaded. Returns once told to stop, see serve.c.
+int serve(const char* address, int workers, size_t cache_limit, RaycastError* error);
+
+#endif